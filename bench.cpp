@@ -0,0 +1,312 @@
+#include <algorithm>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <string.h>
+#include <unistd.h>
+
+#include "nbd.h"
+#include "utils-data.h"
+#include "utils-hist.h"
+#include "utils-pool.h"
+#include "utils-str.h"
+#include "utils-time.h"
+
+// each primitive is run BENCH_RUNS times, each run long enough
+// (BENCH_RUN_NS) to make the clock overhead irrelevant
+#define BENCH_RUNS	15
+#define BENCH_RUN_NS	20000000
+
+#define BLOCK_SIZE 4096
+
+// results go here so that the compiler cannot drop the work
+volatile uint64_t sink = 0;
+
+unsigned char block_a[BLOCK_SIZE], block_b[BLOCK_SIZE];
+
+histogram_t bench_hist;
+
+buffer_pool_t *bench_pool = NULL;
+
+void bench_u64_to_bytes(uint64_t n)
+{
+	unsigned char buffer[8];
+	uint64_t total = 0;
+
+	for(uint64_t index=0; index<n; index++)
+	{
+		u64_to_bytes(buffer, index);
+		total += buffer[7];
+	}
+
+	sink = total;
+}
+
+void bench_bytes_to_u64(uint64_t n)
+{
+	uint64_t total = 0;
+
+	for(uint64_t index=0; index<n; index++)
+		total += bytes_to_u64(&block_a[index & 255]);
+
+	sink = total;
+}
+
+void bench_u32_to_bytes(uint64_t n)
+{
+	unsigned char buffer[4];
+	uint64_t total = 0;
+
+	for(uint64_t index=0; index<n; index++)
+	{
+		u32_to_bytes(buffer, index);
+		total += buffer[3];
+	}
+
+	sink = total;
+}
+
+void bench_bytes_to_u32(uint64_t n)
+{
+	uint64_t total = 0;
+
+	for(uint64_t index=0; index<n; index++)
+		total += bytes_to_u32(&block_a[index & 255]);
+
+	sink = total;
+}
+
+void bench_encode_request(uint64_t n)
+{
+	unsigned char cmd[28];
+	uint64_t total = 0;
+
+	for(uint64_t index=0; index<n; index++)
+	{
+		encode_request_nbd(cmd, 0, index, index * BLOCK_SIZE, BLOCK_SIZE);
+		total += cmd[23];
+	}
+
+	sink = total;
+}
+
+void bench_get_random_bytes(uint64_t n)
+{
+	uint64_t handle = 0, total = 0;
+
+	for(uint64_t index=0; index<n; index++)
+	{
+		get_random_bytes((unsigned char *)&handle, sizeof handle);
+		total += handle;
+	}
+
+	sink = total;
+}
+
+void bench_format(uint64_t n)
+{
+	uint64_t total = 0;
+
+	for(uint64_t index=0; index<n; index++)
+		total += format("%08x", uint32_t(index)).size();
+
+	sink = total;
+}
+
+void bench_zero_scan_bytes(uint64_t n)
+{
+	uint64_t total = 0;
+
+	// how verify_device_has_no_data() used to do it
+	for(uint64_t index=0; index<n; index++)
+	{
+		for(int b=0; b<BLOCK_SIZE; b++)
+		{
+			if (block_b[b])
+			{
+				total++;
+				break;
+			}
+		}
+
+		// keep the compiler from hoisting the scan out of the loop
+		__asm__ __volatile__("" : : "r"(block_b) : "memory");
+	}
+
+	sink = total;
+}
+
+void bench_is_zero(uint64_t n)
+{
+	uint64_t total = 0;
+
+	for(uint64_t index=0; index<n; index++)
+	{
+		total += is_zero(block_b, BLOCK_SIZE);
+
+		__asm__ __volatile__("" : : "r"(block_b) : "memory");
+	}
+
+	sink = total;
+}
+
+void bench_memcmp(uint64_t n)
+{
+	uint64_t total = 0;
+
+	for(uint64_t index=0; index<n; index++)
+	{
+		total += memcmp(block_a, block_a + BLOCK_SIZE / 2, BLOCK_SIZE / 2) == 0;
+
+		__asm__ __volatile__("" : : "r"(block_a) : "memory");
+	}
+
+	sink = total;
+}
+
+void bench_get_ns(uint64_t n)
+{
+	uint64_t total = 0;
+
+	for(uint64_t index=0; index<n; index++)
+		total += get_ns();
+
+	sink = total;
+}
+
+void bench_hist_add(uint64_t n)
+{
+	for(uint64_t index=0; index<n; index++)
+		hist_add(&bench_hist, (index * 2654435761u) & 0xfffff);
+
+	sink = bench_hist.n;
+}
+
+void bench_malloc(uint64_t n)
+{
+	uint64_t total = 0;
+
+	for(uint64_t index=0; index<n; index++)
+	{
+		unsigned char *p = (unsigned char *)malloc(BLOCK_SIZE);
+		p[0] = index;
+		total += p[0];
+
+		// or the compiler drops the malloc/free pair
+		__asm__ __volatile__("" : : "r"(p) : "memory");
+
+		free(p);
+	}
+
+	sink = total;
+}
+
+void bench_pool_get_put(uint64_t n)
+{
+	uint64_t total = 0;
+
+	for(uint64_t index=0; index<n; index++)
+	{
+		unsigned char *p = (unsigned char *)pool_get(bench_pool, BLOCK_SIZE);
+		p[0] = index;
+		total += p[0];
+		pool_put(bench_pool, p);
+	}
+
+	sink = total;
+}
+
+typedef struct
+{
+	const char *name;
+	void (*fn)(uint64_t n);
+} bench_t;
+
+bench_t benches[] = {
+	{ "u64_to_bytes", bench_u64_to_bytes },
+	{ "bytes_to_u64", bench_bytes_to_u64 },
+	{ "u32_to_bytes", bench_u32_to_bytes },
+	{ "bytes_to_u32", bench_bytes_to_u32 },
+	{ "encode_request_nbd", bench_encode_request },
+	{ "get_random_bytes(8)", bench_get_random_bytes },
+	{ "format(\"%08x\")", bench_format },
+	{ "zero scan 4k (bytes)", bench_zero_scan_bytes },
+	{ "is_zero 4k", bench_is_zero },
+	{ "memcmp 2k", bench_memcmp },
+	{ "malloc/free 4k", bench_malloc },
+	{ "pool_get/pool_put 4k", bench_pool_get_put },
+	{ "get_ns", bench_get_ns },
+	{ "hist_add", bench_hist_add },
+	{ NULL, NULL }
+};
+
+void run_bench(const bench_t *b)
+{
+	// find how many iterations take at least BENCH_RUN_NS (this also warms up)
+	uint64_t n = 1;
+
+	for(;;)
+	{
+		uint64_t start_ns = get_ns();
+		b -> fn(n);
+		uint64_t took = get_ns() - start_ns;
+
+		if (took >= BENCH_RUN_NS)
+			break;
+
+		n *= 2;
+	}
+
+	double ns_op[BENCH_RUNS];
+
+	for(int index=0; index<BENCH_RUNS; index++)
+	{
+		uint64_t start_ns = get_ns();
+		b -> fn(n);
+		ns_op[index] = double(get_ns() - start_ns) / n;
+	}
+
+	std::sort(&ns_op[0], &ns_op[BENCH_RUNS]);
+
+	double total = 0.0;
+	for(int index=0; index<BENCH_RUNS; index++)
+		total += ns_op[index];
+
+	double avg = total / BENCH_RUNS, sd = 0.0;
+	for(int index=0; index<BENCH_RUNS; index++)
+		sd += (ns_op[index] - avg) * (ns_op[index] - avg);
+
+	sd = sqrt(sd / BENCH_RUNS);
+
+	printf("%-24s %10.2f %10.2f %10.2f %9.1f%% %12llu\n", b -> name, ns_op[0], ns_op[BENCH_RUNS / 2], avg, avg > 0.0 ? sd * 100.0 / avg : 0.0, (unsigned long long)n);
+	fflush(NULL);
+}
+
+int main(int argc, char *argv[])
+{
+	printf("nbd-verify-bench v" VERSION ", (C) 2013 by folkert@vanheusden.com\n\n");
+
+	// optional argument: only run the primitives whose name contains it
+	const char *filter = argc >= 2 ? argv[1] : NULL;
+
+	get_random_bytes(block_a, sizeof block_a);
+	memcpy(block_a + BLOCK_SIZE / 2, block_a, BLOCK_SIZE / 2);
+	memset(block_b, 0x00, sizeof block_b);
+	hist_init(&bench_hist);
+	bench_pool = pool_create(BLOCK_SIZE, 16);
+
+	printf("%d runs per primitive\n\n", BENCH_RUNS);
+	printf("%-24s %10s %10s %10s %10s %12s\n", "ns/op", "min", "median", "avg", "stddev", "ops per run");
+
+	for(int index=0; benches[index].name; index++)
+	{
+		if (filter && strstr(benches[index].name, filter) == NULL)
+			continue;
+
+		run_bench(&benches[index]);
+	}
+
+	return 0;
+}
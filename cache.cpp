@@ -0,0 +1,227 @@
+#include <algorithm>
+#include <iostream>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+
+#include "utils-hist.h"
+#include "load.h"
+#include "cache.h"
+#include "utils-time.h"
+
+#define CACHE_FIRST_SIZE	(1024 * 1024)
+
+// before measuring, the working set is read (with this many requests in
+// flight per session) until it was covered once or for at most this long
+#define CACHE_WARMUP_DEPTH	32
+#define CACHE_WARMUP_MAX	30.0
+#define CACHE_POLL		0.5
+
+// a point is on a slower level (tier) than the one before when its average
+// latency is this factor above that of the level
+#define CACHE_LEVEL_FACTOR	1.5
+
+typedef struct
+{
+	uint64_t working_set;
+	double iops, avg_us, p50_us, p99_us;
+	double warmup;
+} cache_point_t;
+
+typedef struct
+{
+	size_t first, last;
+	double avg_us;
+	int n;
+} cache_level_t;
+
+std::string size_name(uint64_t size)
+{
+	const char *units[] = { "B", "KiB", "MiB", "GiB", "TiB", "PiB" };
+	double v = size;
+	int unit = 0;
+
+	while(v >= 1024.0 && unit < 5)
+	{
+		v /= 1024.0;
+		unit++;
+	}
+
+	char buffer[32];
+	snprintf(buffer, sizeof buffer, v == int(v) ? "%.0f %s" : "%.1f %s", v, units[unit]);
+
+	return buffer;
+}
+
+uint64_t window_stats(load_t *l, size_t n, load_stats_t *all)
+{
+	std::vector<load_stats_t> per_endpoint(n);
+
+	load_snapshot(l, &per_endpoint.at(0));
+
+	load_stats_init(all);
+	for(size_t index=0; index<n; index++)
+		load_stats_merge(all, &per_endpoint.at(index));
+
+	return all -> n_bytes;
+}
+
+int measure_working_set(const std::vector<endpoint_t> & endpoints, const load_config_t *cfg, double measure_duration, cache_point_t *p, uint64_t *export_size)
+{
+	size_t n = endpoints.size();
+
+	load_config_t ws_cfg = *cfg;
+	ws_cfg.do_writes = false;
+	ws_cfg.working_set = p -> working_set;
+	ws_cfg.queue_depth = std::max(cfg -> queue_depth, CACHE_WARMUP_DEPTH);
+
+	load_t *l = load_start(endpoints, &ws_cfg);
+	if (!l)
+		return -1;
+
+	*export_size = load_export_size(l);
+
+	load_stats_t *stats = (load_stats_t *)malloc(sizeof(load_stats_t));
+
+	// warm-up: pull the working set into whatever caches there are
+	double start_ts = get_ts(), now_ts = start_ts;
+	uint64_t covered = 0, target = std::min(p -> working_set, *export_size);
+
+	while(covered < target && now_ts - start_ts < CACHE_WARMUP_MAX && !load_failed(l))
+	{
+		USLEEP(useconds_t(CACHE_POLL * 1000000.0));
+
+		covered += window_stats(l, n, stats);
+
+		now_ts = get_ts();
+	}
+
+	p -> warmup = now_ts - start_ts;
+
+	// measure at the requested depth
+	load_set_depth(l, cfg -> queue_depth);
+	USLEEP(useconds_t(CACHE_POLL * 1000000.0));
+	window_stats(l, n, stats);
+
+	start_ts = get_ts();
+	USLEEP(useconds_t(measure_duration * 1000000.0));
+	window_stats(l, n, stats);
+	now_ts = get_ts();
+
+	p -> iops = stats -> n_ios / (now_ts - start_ts);
+	p -> avg_us = hist_avg(&stats -> latency) / 1000.0;
+	p -> p50_us = hist_percentile(&stats -> latency, 50.0) / 1000.0;
+	p -> p99_us = hist_percentile(&stats -> latency, 99.0) / 1000.0;
+
+	free(stats);
+
+	return load_stop(l);
+}
+
+int nbd_cache(const std::vector<endpoint_t> & endpoints, const load_config_t *cfg, double measure_duration)
+{
+	std::vector<cache_point_t> points;
+	// at least one request's worth, the load engine cannot do less
+	uint64_t first_size = std::max(uint64_t(CACHE_FIRST_SIZE), uint64_t(cfg -> io_size));
+	uint64_t export_size = first_size;
+
+	std::cout << "random reads with " << cfg -> n_conns * endpoints.size() << " session(s), " << cfg -> queue_depth << " request(s) in flight each, " << measure_duration << " seconds per working set size" << std::endl << std::endl;
+
+	printf("%12s %10s %10s %10s %10s %10s\n", "working set", "warm-up s", "IOPS", "avg us", "p50 us", "p99 us");
+
+	for(uint64_t ws=first_size;; ws *= 2)
+	{
+		cache_point_t p = { std::min(ws, export_size), 0.0, 0.0, 0.0, 0.0, 0.0 };
+
+		if (measure_working_set(endpoints, cfg, measure_duration, &p, &export_size))
+		{
+			std::cerr << "session failure while measuring a working set of " << size_name(p.working_set) << std::endl;
+			return 1;
+		}
+
+		// the size is only known after the first connect
+		p.working_set = std::min(p.working_set, export_size);
+
+		printf("%12s %10.1f %10.1f %10.2f %10.2f %10.2f\n", size_name(p.working_set).c_str(), p.warmup, p.iops, p.avg_us, p.p50_us, p.p99_us);
+		fflush(NULL);
+
+		points.push_back(p);
+
+		if (p.working_set >= export_size)
+			break;
+	}
+
+	// runs of points without a clear step up in latency are levels; single
+	// points between two levels are in the transition of a cache filling up
+	std::vector<cache_level_t> levels;
+
+	for(size_t index=0; index<points.size(); index++)
+	{
+		double avg_us = points.at(index).avg_us;
+
+		if (!levels.empty() && avg_us <= levels.back().avg_us * CACHE_LEVEL_FACTOR)
+		{
+			cache_level_t *cur = &levels.back();
+
+			cur -> avg_us = (cur -> avg_us * cur -> n + avg_us) / (cur -> n + 1);
+			cur -> n++;
+			cur -> last = index;
+			continue;
+		}
+
+		// a single point that was passed through is not a level
+		if (levels.size() >= 2 && levels.back().first == levels.back().last)
+			levels.pop_back();
+
+		cache_level_t level = { index, index, avg_us, 1 };
+		levels.push_back(level);
+	}
+
+	std::cout << std::endl;
+
+	if (levels.size() == 1)
+	{
+		printf("one level only (%.2f us): no cache effects seen between %s and %s\n", levels.at(0).avg_us, size_name(points.front().working_set).c_str(), size_name(points.back().working_set).c_str());
+		return 0;
+	}
+
+	for(size_t index=0; index<levels.size(); index++)
+	{
+		const cache_level_t *cur = &levels.at(index);
+
+		if (index == levels.size() - 1)
+		{
+			printf("level %d: %.2f us, beyond that (backing store)\n", int(index + 1), cur -> avg_us);
+			break;
+		}
+
+		const cache_level_t *next = &levels.at(index + 1);
+
+		// with a hit ratio of cache_size/working_set in the transition, the
+		// average latency is a mix of both levels
+		double estimate = 0.0;
+		int n_estimates = 0;
+
+		for(size_t t=cur -> last + 1; t<next -> first; t++)
+		{
+			const cache_point_t *p = &points.at(t);
+
+			if (next -> avg_us > cur -> avg_us && p -> avg_us > cur -> avg_us && p -> avg_us < next -> avg_us)
+			{
+				estimate += p -> working_set * (next -> avg_us - p -> avg_us) / (next -> avg_us - cur -> avg_us);
+				n_estimates++;
+			}
+		}
+
+		uint64_t size = n_estimates ? uint64_t(estimate / n_estimates) : points.at(cur -> last).working_set;
+
+		printf("level %d: %.2f us, %s %s (fits %s, does not fit %s)\n", int(index + 1), cur -> avg_us,
+				n_estimates ? "about" : "at least", size_name(size).c_str(),
+				size_name(points.at(cur -> last).working_set).c_str(), size_name(points.at(next -> first).working_set).c_str());
+	}
+
+	return 0;
+}
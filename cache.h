@@ -0,0 +1,4 @@
+// random reads over a working set that doubles from 1 MiB up to the whole
+// export; from the latency per footprint the cache tiers of the server
+// and their sizes are estimated
+int nbd_cache(const std::vector<endpoint_t> & endpoints, const load_config_t *cfg, double measure_duration);
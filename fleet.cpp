@@ -0,0 +1,136 @@
+#include <algorithm>
+#include <iostream>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+#include "utils-hist.h"
+#include "load.h"
+#include "fleet.h"
+#include "utils-time.h"
+
+#define FLEET_REPORT_INTERVAL	2.0
+
+// an endpoint lags when its IOPS are this fraction below the median of
+// all endpoints, or its p99 latency is this fraction above theirs
+#define FLEET_LAG_FRACTION	0.2
+
+double median(std::vector<double> values)
+{
+	std::sort(values.begin(), values.end());
+
+	size_t n = values.size();
+
+	return n % 2 ? values.at(n / 2) : (values.at(n / 2 - 1) + values.at(n / 2)) / 2.0;
+}
+
+void print_fleet_row(const char *name, const load_stats_t *s, double took, const char *remark)
+{
+	printf("%-28s %10.1f %10.2f %10.2f %10.2f %10.2f %10.2f %8llu %s\n", name,
+			s -> n_ios / took,
+			s -> n_bytes / took / 1000000.0,
+			hist_avg(&s -> latency) / 1000.0,
+			hist_percentile(&s -> latency, 50.0) / 1000.0,
+			hist_percentile(&s -> latency, 99.0) / 1000.0,
+			s -> latency.max / 1000.0,
+			(unsigned long long)s -> n_errors,
+			remark);
+}
+
+int nbd_fleet(const std::vector<endpoint_t> & endpoints, const load_config_t *cfg, double duration)
+{
+	size_t n = endpoints.size();
+
+	std::cout << "starting " << cfg -> n_conns << " session(s) with " << cfg -> queue_depth << " request(s) in flight each on " << n << " endpoint(s)" << std::endl;
+
+	load_t *l = load_start(endpoints, cfg);
+	if (!l)
+		return 1;
+
+	std::vector<load_stats_t> totals(n), window(n);
+	for(size_t index=0; index<n; index++)
+		load_stats_init(&totals.at(index));
+
+	double start_ts = get_ts(), prev_ts = start_ts, now_ts = start_ts;
+
+	do
+	{
+		double left = start_ts + duration - now_ts;
+
+		USLEEP(useconds_t(std::min(left, FLEET_REPORT_INTERVAL) * 1000000.0));
+
+		load_snapshot(l, &window.at(0));
+
+		now_ts = get_ts();
+
+		uint64_t n_ios = 0;
+		for(size_t index=0; index<n; index++)
+		{
+			n_ios += window.at(index).n_ios;
+			load_stats_merge(&totals.at(index), &window.at(index));
+		}
+
+		printf("IOPs (all endpoints): %.1f\r", n_ios / (now_ts - prev_ts));
+		fflush(NULL);
+
+		prev_ts = now_ts;
+	}
+	while(now_ts - start_ts < duration && !load_failed(l));
+
+	bool failed = load_stop(l) != 0;
+
+	double took = now_ts - start_ts;
+
+	std::vector<double> iops, p99;
+	for(size_t index=0; index<n; index++)
+	{
+		iops.push_back(totals.at(index).n_ios / took);
+		p99.push_back(hist_percentile(&totals.at(index).latency, 99.0));
+	}
+
+	double median_iops = median(iops), median_p99 = median(p99);
+
+	printf("\n\n%-28s %10s %10s %10s %10s %10s %10s %8s\n", "endpoint", "IOPS", "MB/s", "avg us", "p50 us", "p99 us", "max us", "errors");
+
+	load_stats_t all;
+	load_stats_init(&all);
+
+	int n_lagging = 0;
+
+	for(size_t index=0; index<n; index++)
+	{
+		std::string remark;
+
+		// only relative to the others
+		if (n > 1 && iops.at(index) < median_iops * (1.0 - FLEET_LAG_FRACTION))
+			remark = "IOPS";
+
+		if (n > 1 && p99.at(index) > median_p99 * (1.0 + FLEET_LAG_FRACTION))
+			remark += remark.empty() ? "p99" : " and p99";
+
+		if (!remark.empty())
+			remark = "<- lags (" + remark + ")";
+
+		if (!remark.empty())
+			n_lagging++;
+
+		print_fleet_row(endpoint_name(endpoints.at(index)).c_str(), &totals.at(index), took, remark.c_str());
+
+		load_stats_merge(&all, &totals.at(index));
+	}
+
+	print_fleet_row("total", &all, took, "");
+
+	if (n > 1)
+		printf("\n%d of %d endpoint(s) lagging (more than %.0f%% worse than the median)\n", n_lagging, int(n), FLEET_LAG_FRACTION * 100.0);
+
+	if (failed)
+	{
+		std::cerr << "one or more sessions failed" << std::endl;
+		return 1;
+	}
+
+	return 0;
+}
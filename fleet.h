@@ -0,0 +1,4 @@
+// the same load on all endpoints at once for 'duration' seconds; shows
+// per endpoint and aggregate IOPS, throughput and latency and which
+// endpoints lag behind the others
+int nbd_fleet(const std::vector<endpoint_t> & endpoints, const load_config_t *cfg, double duration);
@@ -0,0 +1,495 @@
+#include <algorithm>
+#include <errno.h>
+#include <iostream>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <string.h>
+#include <unistd.h>
+#include <vector>
+
+#include "nbd.h"
+#include "utils-data.h"
+#include "utils-hist.h"
+#include "load.h"
+#include "utils-metrics.h"
+#include "utils-net.h"
+#include "utils-pool.h"
+#include "utils-record.h"
+#include "utils-slowest.h"
+#include "utils-time.h"
+
+typedef struct
+{
+	load_t *l;
+	int endpoint, conn;
+
+	int fd;
+	uint64_t size;
+	uint32_t io_size;
+	buffer_pool_t *pool;
+
+	pthread_t tid;
+	bool started;
+	volatile bool failed;
+
+	// what completed since the start: only the session thread writes it
+	// (relaxed atomics, no lock on the completion path), load_snapshot()
+	// reports the difference with what it saw the previous time
+	load_stats_t total, reported;
+} load_conn_t;
+
+struct load_t
+{
+	load_config_t cfg;
+	int n_endpoints;
+
+	std::vector<load_conn_t *> conns;
+
+	volatile int depth;
+	// requests per second per session, 0: no limit
+	volatile double rate;
+	volatile int stop;
+};
+
+int parse_endpoint(std::string in, endpoint_t *e)
+{
+	// unix:/path (no port)
+	if (in.substr(0, 5) == "unix:")
+	{
+		e -> host = in;
+		e -> port = 0;
+		return 0;
+	}
+
+	size_t colon = in.rfind(':');
+	if (colon == std::string::npos || colon == 0)
+	{
+		std::cerr << "endpoint \"" << in << "\" is not host:port" << std::endl;
+		return -1;
+	}
+
+	e -> host = in.substr(0, colon);
+	e -> port = atoi(in.substr(colon + 1).c_str());
+
+	// [::1]:10809
+	if (e -> host.size() > 2 && e -> host[0] == '[' && e -> host[e -> host.size() - 1] == ']')
+		e -> host = e -> host.substr(1, e -> host.size() - 2);
+
+	if (e -> port <= 0 || e -> port > 65535)
+	{
+		std::cerr << "endpoint \"" << in << "\": invalid port" << std::endl;
+		return -1;
+	}
+
+	return 0;
+}
+
+int parse_endpoints(const char *list, std::vector<endpoint_t> *endpoints)
+{
+	std::vector<std::string> items;
+
+	if (list[0] == '@')
+	{
+		FILE *fh = fopen(&list[1], "r");
+		if (!fh)
+		{
+			std::cerr << "cannot open " << &list[1] << ": " << strerror(errno) << std::endl;
+			return -1;
+		}
+
+		char line[4096];
+		while(fgets(line, sizeof line, fh))
+		{
+			char *lf = strchr(line, '\n');
+			if (lf)
+				*lf = 0x00;
+
+			if (line[0] && line[0] != '#')
+				items.push_back(line);
+		}
+
+		fclose(fh);
+	}
+	else
+	{
+		std::string in = list;
+		size_t start = 0;
+
+		for(;;)
+		{
+			size_t comma = in.find(',', start);
+
+			items.push_back(in.substr(start, comma == std::string::npos ? std::string::npos : comma - start));
+
+			if (comma == std::string::npos)
+				break;
+
+			start = comma + 1;
+		}
+	}
+
+	for(size_t index=0; index<items.size(); index++)
+	{
+		endpoint_t e;
+
+		if (parse_endpoint(items.at(index), &e))
+			return -1;
+
+		endpoints -> push_back(e);
+	}
+
+	if (endpoints -> empty())
+	{
+		std::cerr << "no endpoints in " << list << std::endl;
+		return -1;
+	}
+
+	return 0;
+}
+
+std::string endpoint_name(const endpoint_t & e)
+{
+	if (e.port == 0)
+		return e.host;
+
+	if (e.host.find(':') != std::string::npos && e.host.substr(0, 6) != "vsock:")
+		return "[" + e.host + "]:" + std::to_string(e.port);
+
+	return e.host + ":" + std::to_string(e.port);
+}
+
+void load_stats_init(load_stats_t *s)
+{
+	s -> n_ios = s -> n_bytes = s -> n_errors = 0;
+	hist_init(&s -> latency);
+}
+
+void load_stats_merge(load_stats_t *dest, const load_stats_t *src)
+{
+	dest -> n_ios += src -> n_ios;
+	dest -> n_bytes += src -> n_bytes;
+	dest -> n_errors += src -> n_errors;
+	hist_merge(&dest -> latency, &src -> latency);
+}
+
+void * load_thread(void *arg)
+{
+	load_conn_t *lc = (load_conn_t *)arg;
+	load_t *l = lc -> l;
+	int queue_depth = l -> cfg.queue_depth;
+	uint32_t io_size = lc -> io_size;
+
+	uint64_t area = l -> cfg.working_set && l -> cfg.working_set < lc -> size ? l -> cfg.working_set : lc -> size;
+	uint64_t n_blocks = area / io_size;
+
+	unsigned short xsubi[3] = { 0x330e, (unsigned short)lc -> endpoint, (unsigned short)lc -> conn };
+
+	unsigned char *write_data = (unsigned char *)pool_get(lc -> pool, io_size);
+	if (l -> cfg.stamp_writes)
+	{
+		for(uint32_t index=0; index<io_size; index++)
+			write_data[index] = nrand48(xsubi);
+	}
+	else
+	{
+		memset(write_data, 0xa5, io_size);
+	}
+
+	uint64_t n_writes = 0;
+
+	// a read buffer per slot
+	std::vector<unsigned char *> read_data(queue_depth);
+	for(int index=0; index<queue_depth; index++)
+		read_data.at(index) = (unsigned char *)pool_get(lc -> pool, io_size);
+
+	pipeline_t *p = pipeline_create(lc -> fd, queue_depth);
+	uint32_t type = l -> cfg.do_writes ? 1 : 0;
+
+	// when the next request may go out if the rate is limited
+	uint64_t next_ns = 0;
+
+	for(;;)
+	{
+		bool stopping = l -> stop;
+		double rate = l -> rate;
+		uint64_t now_ns = get_ns();
+
+		// no bursts to catch up after a pause
+		if (rate > 0.0 && next_ns < now_ns - std::min(now_ns, uint64_t(1000000000.0 / rate)))
+			next_ns = now_ns - uint64_t(1000000000.0 / rate);
+
+		while(!stopping && p -> in_flight < l -> depth && p -> n_free)
+		{
+			if (rate > 0.0)
+			{
+				if (now_ns < next_ns)
+					break;
+
+				next_ns += uint64_t(1000000000.0 / rate);
+			}
+
+			uint64_t offset = ((uint64_t(nrand48(xsubi)) << 31 | nrand48(xsubi)) % n_blocks) * io_size;
+
+			// pipeline_send() is done with the data when it returns, so one buffer does
+			if (l -> cfg.do_writes && l -> cfg.stamp_writes)
+			{
+				for(uint32_t o=0; o + 16<=io_size; o += 4096)
+				{
+					u64_to_bytes(&write_data[o], offset + o);
+					u64_to_bytes(&write_data[o + 8], n_writes);
+				}
+
+				n_writes++;
+			}
+
+			unsigned char *data = type ? write_data : read_data.at(pipeline_next_slot(p));
+
+			if (pipeline_send(p, type, offset, (char *)data, io_size) == -1)
+			{
+				lc -> failed = true;
+				break;
+			}
+		}
+
+		if (lc -> failed || (p -> in_flight == 0 && stopping))
+			break;
+
+		// held back by the rate limit: wait for a reply or until the next one may go out
+		if (!stopping && rate > 0.0 && p -> in_flight < l -> depth && p -> n_free)
+		{
+			double wait = (next_ns - std::min(next_ns, get_ns())) / 1000000000.0;
+
+			if (p -> in_flight == 0)
+			{
+				USLEEP(useconds_t(wait * 1000000.0));
+				continue;
+			}
+
+			int rc = data_pending_nbd(lc -> fd, wait);
+			if (rc == -1)
+			{
+				lc -> failed = true;
+				break;
+			}
+
+			if (rc == 0)
+				continue;
+		}
+
+		int slot = -1;
+		uint32_t err = 0;
+
+		if (pipeline_receive(p, &slot, &err))
+		{
+			lc -> failed = true;
+			break;
+		}
+
+		now_ns = get_ns();
+
+		uint64_t latency_ns = now_ns - p -> submit_ns[slot];
+
+		if (err)
+			__atomic_store_n(&lc -> total.n_errors, lc -> total.n_errors + 1, __ATOMIC_RELAXED);
+		else
+		{
+			__atomic_store_n(&lc -> total.n_ios, lc -> total.n_ios + 1, __ATOMIC_RELAXED);
+			__atomic_store_n(&lc -> total.n_bytes, lc -> total.n_bytes + io_size, __ATOMIC_RELAXED);
+			hist_add_relaxed(&lc -> total.latency, latency_ns);
+		}
+
+		if (recording)
+			record_request(lc -> conn, type, p -> offset[slot], io_size, p -> submit_ns[slot], now_ns, err);
+
+		if (slowest_n)
+			slowest_add(lc -> conn, type, p -> offset[slot], io_size, p -> submit_ns[slot], now_ns, p -> in_flight_at_submit[slot], err);
+
+		if (metrics_enabled)
+			metrics_add(type, io_size, latency_ns, err);
+	}
+
+	pipeline_free(p);
+
+	for(int index=0; index<queue_depth; index++)
+		pool_put(lc -> pool, read_data.at(index));
+
+	pool_put(lc -> pool, write_data);
+
+	return NULL;
+}
+
+load_t *load_start(const std::vector<endpoint_t> & endpoints, const load_config_t *cfg)
+{
+	load_t *l = new load_t;
+
+	l -> cfg = *cfg;
+	l -> n_endpoints = endpoints.size();
+	l -> depth = cfg -> queue_depth;
+	l -> rate = 0.0;
+	l -> stop = 0;
+
+	// all sessions first so that the load starts everywhere at the same time
+	for(size_t e=0; e<endpoints.size(); e++)
+	{
+		for(int c=0; c<cfg -> n_conns; c++)
+		{
+			load_conn_t *lc = new load_conn_t;
+
+			lc -> l = l;
+			lc -> endpoint = e;
+			lc -> conn = l -> conns.size();
+			lc -> started = lc -> failed = false;
+			lc -> pool = NULL;
+
+			uint32_t flags = -1;
+			lc -> fd = connect_nbd(endpoints.at(e).host, endpoints.at(e).port, &lc -> size, &flags, false);
+			if (lc -> fd == -1)
+			{
+				std::cerr << "failed setting up NBD session " << c << " with " << endpoint_name(endpoints.at(e)) << std::endl;
+				delete lc;
+				load_stop(l);
+				return NULL;
+			}
+
+			l -> conns.push_back(lc);
+
+			// the block size constraints are those of the session that was set up last
+			lc -> io_size = cfg -> io_size ? cfg -> io_size : block_size_preferred;
+
+			if (lc -> io_size % block_size_min || lc -> io_size > block_size_max || lc -> io_size > lc -> size)
+			{
+				std::cerr << endpoint_name(endpoints.at(e)) << " does not accept requests of " << lc -> io_size << " bytes (block sizes " <<
+					block_size_min << "/" << block_size_preferred << "/" << block_size_max << ", size " << lc -> size << ")" << std::endl;
+				load_stop(l);
+				return NULL;
+			}
+
+			// a working set smaller than one request would leave no block to pick
+			if (l -> cfg.working_set && l -> cfg.working_set < lc -> io_size)
+				l -> cfg.working_set = lc -> io_size;
+
+			lc -> pool = pool_create(lc -> io_size, cfg -> queue_depth + 1);
+
+			load_stats_init(&lc -> total);
+			load_stats_init(&lc -> reported);
+		}
+	}
+
+	for(size_t index=0; index<l -> conns.size(); index++)
+	{
+		load_conn_t *lc = l -> conns.at(index);
+
+		if (pthread_create(&lc -> tid, NULL, load_thread, lc))
+		{
+			std::cerr << "cannot start thread for session " << index << std::endl;
+			load_stop(l);
+			return NULL;
+		}
+
+		lc -> started = true;
+	}
+
+	return l;
+}
+
+void load_set_depth(load_t *l, int depth)
+{
+	if (depth < 1)
+		depth = 1;
+
+	if (depth > l -> cfg.queue_depth)
+		depth = l -> cfg.queue_depth;
+
+	l -> depth = depth;
+}
+
+void load_set_rate(load_t *l, double rate)
+{
+	l -> rate = rate > 0.0 ? rate / l -> conns.size() : 0.0;
+}
+
+void load_snapshot(load_t *l, load_stats_t *per_endpoint)
+{
+	for(int index=0; index<l -> n_endpoints; index++)
+		load_stats_init(&per_endpoint[index]);
+
+	load_stats_t *now = (load_stats_t *)malloc(sizeof(load_stats_t));
+	load_stats_t *delta = (load_stats_t *)malloc(sizeof(load_stats_t));
+
+	for(size_t index=0; index<l -> conns.size(); index++)
+	{
+		load_conn_t *lc = l -> conns.at(index);
+
+		load_stats_init(now);
+		now -> n_ios = __atomic_load_n(&lc -> total.n_ios, __ATOMIC_RELAXED);
+		now -> n_bytes = __atomic_load_n(&lc -> total.n_bytes, __ATOMIC_RELAXED);
+		now -> n_errors = __atomic_load_n(&lc -> total.n_errors, __ATOMIC_RELAXED);
+		hist_merge_relaxed(&now -> latency, &lc -> total.latency);
+
+		delta -> n_ios = now -> n_ios - lc -> reported.n_ios;
+		delta -> n_bytes = now -> n_bytes - lc -> reported.n_bytes;
+		delta -> n_errors = now -> n_errors - lc -> reported.n_errors;
+		hist_delta(&delta -> latency, &now -> latency, &lc -> reported.latency);
+
+		load_stats_merge(&per_endpoint[lc -> endpoint], delta);
+
+		lc -> reported = *now;
+	}
+
+	free(delta);
+	free(now);
+}
+
+uint64_t load_export_size(load_t *l)
+{
+	uint64_t size = -1;
+
+	for(size_t index=0; index<l -> conns.size(); index++)
+		size = std::min(size, l -> conns.at(index) -> size);
+
+	return size;
+}
+
+int load_failed(load_t *l)
+{
+	for(size_t index=0; index<l -> conns.size(); index++)
+	{
+		if (l -> conns.at(index) -> failed)
+			return -1;
+	}
+
+	return 0;
+}
+
+int load_stop(load_t *l)
+{
+	l -> stop = 1;
+
+	int rc = 0;
+
+	for(size_t index=0; index<l -> conns.size(); index++)
+	{
+		load_conn_t *lc = l -> conns.at(index);
+
+		if (lc -> started)
+			pthread_join(lc -> tid, NULL);
+
+		if (lc -> failed)
+			rc = -1;
+
+		if (lc -> pool)
+			pool_destroy(lc -> pool);
+
+		close_nbd(lc -> fd);
+
+		delete lc;
+	}
+
+	delete l;
+
+	return rc;
+}
@@ -0,0 +1,57 @@
+// background load on one or more NBD endpoints: n_conns sessions per
+// endpoint, each keeping up to queue_depth random requests in flight
+
+typedef struct
+{
+	std::string host;
+	int port;
+} endpoint_t;
+
+// "host:port,unix:/path,vsock:cid:port" or "@file" with one per line
+int parse_endpoints(const char *list, std::vector<endpoint_t> *endpoints);
+std::string endpoint_name(const endpoint_t & e);
+
+typedef struct
+{
+	int n_conns;
+	int queue_depth;
+	// 0: the preferred block size of the server
+	uint32_t io_size;
+	bool do_writes;
+	// requests go to the first working_set bytes, 0: the whole export
+	uint64_t working_set;
+	// writes carry random data with their offset and a sequence number in
+	// every 4 KiB (nothing to de-duplicate or compress) instead of one
+	// constant pattern
+	bool stamp_writes;
+} load_config_t;
+
+typedef struct
+{
+	uint64_t n_ios, n_bytes, n_errors;
+	histogram_t latency;
+} load_stats_t;
+
+typedef struct load_t load_t;
+
+void load_stats_init(load_stats_t *s);
+void load_stats_merge(load_stats_t *dest, const load_stats_t *src);
+
+// connects all sessions and starts the load; NULL when a session could not be set up
+load_t *load_start(const std::vector<endpoint_t> & endpoints, const load_config_t *cfg);
+
+// requests in flight per session from now on (1...queue_depth)
+void load_set_depth(load_t *l, int depth);
+
+// requests per second of all sessions together from now on, 0: no limit
+void load_set_rate(load_t *l, double rate);
+
+// per endpoint, what completed since the previous snapshot
+void load_snapshot(load_t *l, load_stats_t *per_endpoint);
+
+// of the smallest export
+uint64_t load_export_size(load_t *l);
+
+// -1 when a session failed
+int load_failed(load_t *l);
+int load_stop(load_t *l);
@@ -0,0 +1,132 @@
+#include <iostream>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <string.h>
+#include <unistd.h>
+
+#include "server.h"
+#include "utils-str.h"
+
+void help()
+{
+	std::cerr << "-H x     address to listen on (default: all)" << std::endl;
+	std::cerr << "-P x     port to listen on (default: 10809, 0 lets the kernel pick one)" << std::endl;
+	std::cerr << "-U x     listen on unix domain socket x instead of TCP" << std::endl;
+	std::cerr << "-V       listen on vsock (port set with -P) instead of TCP" << std::endl;
+	std::cerr << "-s x     size of the export, e.g. 6G (default: 1G)" << std::endl;
+	std::cerr << "-f x     store the export in (sparse) file x instead of in RAM" << std::endl;
+	std::cerr << "-t x     number of worker threads, 0 for no pipelining (default: 4)" << std::endl;
+	std::cerr << "-o       use oldstyle negotiation (default: fixed newstyle)" << std::endl;
+	std::cerr << "-N x     name of the export (default: \"\")" << std::endl;
+	std::cerr << "-b x     block sizes to advertise as min/preferred/max (default: 1/4096/33554432)" << std::endl;
+	std::cerr << "-v       verbose" << std::endl;
+}
+
+int main(int argc, char *argv[])
+{
+	server_config_t cfg;
+	init_server_config(&cfg);
+
+	std::cout << "nbd-verify-server v" VERSION ", (C) 2013 by folkert@vanheusden.com" << std::endl << std::endl;
+
+	int c = -1;
+	while((c = getopt(argc, argv, "H:P:U:Vs:f:t:oN:b:vh")) != -1)
+	{
+		switch(c)
+		{
+			case 'H':
+				cfg.listen_addr = optarg;
+				break;
+
+			case 'P':
+				cfg.port = atoi(optarg);
+				if (cfg.port < 0 || cfg.port > 65535)
+				{
+					std::cerr << "port number must be between 0 and 65536" << std::endl;
+					return 1;
+				}
+				break;
+
+			case 'U':
+				cfg.unix_path = optarg;
+				break;
+
+			case 'V':
+				cfg.vsock = true;
+				break;
+
+			case 's':
+				cfg.size = parse_size(optarg);
+				if (cfg.size < 512)
+				{
+					std::cerr << "size must be at least 512 bytes" << std::endl;
+					return 1;
+				}
+				break;
+
+			case 'f':
+				cfg.file = optarg;
+				break;
+
+			case 't':
+				cfg.n_workers = atoi(optarg);
+				if (cfg.n_workers < 0)
+				{
+					std::cerr << "number of threads must be >= 0" << std::endl;
+					return 1;
+				}
+				break;
+
+			case 'o':
+				cfg.oldstyle = true;
+				break;
+
+			case 'N':
+				cfg.export_name = optarg;
+				break;
+
+			case 'b':
+				if (sscanf(optarg, "%u/%u/%u", &cfg.block_size_min, &cfg.block_size_preferred, &cfg.block_size_max) != 3 ||
+					cfg.block_size_min == 0 || cfg.block_size_preferred < cfg.block_size_min || cfg.block_size_max < cfg.block_size_preferred)
+				{
+					std::cerr << "-b requires min/preferred/max with min <= preferred <= max" << std::endl;
+					return 1;
+				}
+				break;
+
+			case 'v':
+				cfg.verbose = true;
+				break;
+
+			case 'h':
+				help();
+				return 0;
+
+			default:
+				help();
+				return 1;
+		}
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+
+	if (start_server(&cfg))
+		return 1;
+
+	if (cfg.unix_path)
+		std::cout << "listening on " << cfg.unix_path;
+	else if (cfg.vsock)
+		std::cout << "listening on vsock port " << cfg.port;
+	else
+		std::cout << "listening on port " << cfg.port;
+
+	std::cout << ", " << (cfg.file ? cfg.file : "RAM") << " backed export of " << cfg.size << " bytes, " << cfg.n_workers << " worker thread(s)" << std::endl;
+
+	for(;;)
+		pause();
+
+	return 0;
+}
@@ -1,4 +1,6 @@
+#include <algorithm>
 #include <assert.h>
+#include <errno.h>
 #include <iostream>
 #include <math.h>
 #include <signal.h>
@@ -7,12 +9,38 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <vector>
+#include <sys/resource.h>
+#include <sys/uio.h>
 
 #include "nbd.h"
+#include "utils-hist.h"
+#include "load.h"
+#include "fleet.h"
+#include "sweep.h"
+#include "slo.h"
+#include "soak.h"
+#include "cache.h"
+#include "prefill.h"
+#include "unaligned.h"
+#include "visibility.h"
+#include "scan.h"
+#include "ordering.h"
+#include "replay.h"
+#include "server.h"
+#include "storm.h"
 #include "utils-data.h"
+#include "utils-metrics.h"
 #include "utils-net.h"
+#include "utils-perf.h"
+#include "utils-phase.h"
+#include "utils-pool.h"
+#include "utils-record.h"
+#include "utils-slowest.h"
 #include "utils-str.h"
+#include "utils-sys.h"
 #include "utils-time.h"
+#include "verify.h"
 
 #define BLOCK_SIZE 4096
 
@@ -24,9 +52,41 @@
 
 #define DATA_CHECK_N_BLOCKS 256
 
-int (*connect_nbd)(std::string host, int port, uint64_t *size, uint32_t *flags, bool verbose);
+#define ORDERING_SESSIONS 4
+#define ORDERING_QUEUE_DEPTH 32
+#define ORDERING_DURATION 10.0
 
-typedef enum { A_VERIFY, A_IOPS, A_LATENCY } action_t;
+#define FLEET_DURATION 10.0
+
+#define SWEEP_MAX_SESSIONS 64
+#define SWEEP_MAX_DEPTH 256
+
+#define SLO_MAX_DEPTH 256
+#define SLO_DURATION 30.0
+
+#define SOAK_DRIFT 20.0
+
+#define CACHE_MEASURE_TIME 3.0
+
+#define UNALIGNED_CELL_TIME 1.0
+
+#define VISIBILITY_READERS 2
+#define VISIBILITY_DURATION 10.0
+
+#define SCAN_SESSIONS 4
+
+// a down server should not make the connect storm hang forever
+#define STORM_CONNECT_ATTEMPTS 3
+
+// read buffers on top of the blocks that are written
+#define VERIFY_READ_BUFFERS 4
+
+int (*connect_nbd)(std::string host, int port, uint64_t *size, uint32_t *flags, bool verbose) = connect_nbd_v1;
+
+typedef enum { A_VERIFY, A_IOPS, A_LATENCY, A_CONNECT, A_ORDERING, A_REPLAY, A_FLEET, A_SWEEP, A_SLO, A_SOAK, A_CACHE, A_UNALIGNED, A_VISIBILITY, A_SCAN } action_t;
+
+// buffers of the running action
+buffer_pool_t *io_pool = NULL;
 
 int verify_device_has_no_data(const char *host, int port)
 {
@@ -44,19 +104,27 @@ int verify_device_has_no_data(const char *host, int port)
 	if (size < n_bytes)
 	{
 		std::cerr << "Device is too small" << std::endl;
-		close(fd);
+		CLOSE(fd);
 		return -1;
 	}
 
 	unsigned char *data = (unsigned char *)malloc(n_bytes);
 
-	int rc = read_nbd(fd, 0, (char *)data, n_bytes);
-	if (rc)
+	// do not send requests larger than the server accepts
+	for(uint64_t offset=0; offset<n_bytes;)
 	{
-		std::cerr << "Failed reading from NBD device (offset 0, " << n_bytes << " bytes)" << std::endl;
-		free(data);
-		close(fd);
-		return rc;
+		uint64_t cur_len = std::min(uint64_t(block_size_max), n_bytes - offset);
+
+		int rc = read_nbd(fd, offset, (char *)&data[offset], cur_len);
+		if (rc)
+		{
+			std::cerr << "Failed reading from NBD device (offset " << offset << ", " << cur_len << " bytes)" << std::endl;
+			free(data);
+			CLOSE(fd);
+			return rc;
+		}
+
+		offset += cur_len;
 	}
 
 	if (close_nbd(fd))
@@ -64,13 +132,11 @@ int verify_device_has_no_data(const char *host, int port)
 		std::cerr << "Problem ending session with NBD server" << std::endl;
 	}
 
-	for(uint64_t index=0; index<n_bytes; index++)
+	if (!is_zero(data, n_bytes))
 	{
-		if (data[index])
-		{
-			std::cerr << "Device contains data!" << std::endl;
-			return -1;
-		}
+		std::cerr << "Device contains data!" << std::endl;
+		free(data);
+		return -1;
 	}
 
 	free(data);
@@ -108,28 +174,58 @@ int verify_block(int fd, uint64_t nr, const unsigned char *data, size_t len)
 {
 	uint64_t offset = nr * BLOCK_SIZE;
 
-	unsigned char *in = (unsigned char *)malloc(len);
+	unsigned char *in = (unsigned char *)pool_get(io_pool, len);
 
 	int rc = read_nbd(fd, offset, (char *)in, len);
 	if (rc)
 	{
 		std::cerr << "Failed reading from offset " << offset << " length " << len << ": " << rc << std::endl;
-		free(in);
+		pool_put(io_pool, in);
 		return rc;
 	}
 
+	uint64_t phase_ns = phase_start();
+
 	if (memcmp(in, data, len))
 	{
 		std::cerr << "Data mismatch while verifying block " << nr << std::endl;
-		free(in);
+		pool_put(io_pool, in);
 		return -1;
 	}
 
-	free(in);
+	phase_end(PH_COMPARE, phase_ns);
+
+	pool_put(io_pool, in);
 
 	return 0;
 }
 
+// can 'len' bytes be sent in one request without the server splitting it
+// up or doing read-modify-write cycles? the preferred size only matters
+// for performance, so correctness tests can skip that part
+bool check_io_size(uint64_t len, bool check_preferred)
+{
+	if (len % block_size_min)
+	{
+		std::cerr << "I/O size " << len << " is not a multiple of the minimum block size (" << block_size_min << ") of the server" << std::endl;
+		return false;
+	}
+
+	if (len > block_size_max)
+	{
+		std::cerr << "I/O size " << len << " is larger than the maximum block size (" << block_size_max << ") of the server" << std::endl;
+		return false;
+	}
+
+	if (check_preferred && len % block_size_preferred)
+	{
+		std::cerr << "I/O size " << len << " is not a multiple of the preferred block size (" << block_size_preferred << ") of the server" << std::endl;
+		return false;
+	}
+
+	return true;
+}
+
 int reconnect(int *fd, std::string host, int port, uint64_t prev_size, uint32_t prev_flags, double sleep_duration)
 {
 	std::cout << "closing & reconnecting to " << host << " " << port << std::endl;
@@ -140,7 +236,7 @@ int reconnect(int *fd, std::string host, int port, uint64_t prev_size, uint32_t
 		return -1;
 	}
 
-	USLEEP(useconds_t(sleep_duration * 1000000.0));
+	USLEEP(useconds_t(backoff_jitter(sleep_duration) * 1000000.0));
 
 	uint32_t flags = -1;
 	uint64_t size = -1;
@@ -173,7 +269,7 @@ void choose_blocks(unsigned char ***random_blocks, uint64_t **nrs, uint64_t n_bl
 
 	for(int index=0; index<N_RANDOM_BLOCKS; index++)
 	{
-		(*random_blocks)[index] = (unsigned char *)malloc(BLOCK_SIZE);
+		(*random_blocks)[index] = (unsigned char *)pool_get(io_pool, BLOCK_SIZE);
 
 		bool ok;
 		do
@@ -195,7 +291,7 @@ void choose_blocks(unsigned char ***random_blocks, uint64_t **nrs, uint64_t n_bl
 	}
 }
 
-int nbd_verify(std::string host, int port, double sleep_duration, bool do_reconnect)
+int nbd_verify_tests(std::string host, int port, double sleep_duration, bool do_reconnect, int verify_depth, int n_verifiers)
 {
 	uint32_t flags = -1;
 	uint64_t size = -1;
@@ -209,7 +305,7 @@ int nbd_verify(std::string host, int port, double sleep_duration, bool do_reconn
 	if (size % BLOCK_SIZE)
 	{
 		std::cerr << "block device not multiple of " << BLOCK_SIZE << std::endl;
-		close(fd);
+		CLOSE(fd);
 		return 1;
 	}
 
@@ -219,7 +315,13 @@ int nbd_verify(std::string host, int port, double sleep_duration, bool do_reconn
 	if (size < b32 + BLOCK_SIZE * 2)
 	{
 		std::cerr << "device too small, must be at least 5GB" << std::endl;
-		close(fd);
+		CLOSE(fd);
+		return 1;
+	}
+
+	if (!check_io_size(BLOCK_SIZE, false))
+	{
+		CLOSE(fd);
 		return 1;
 	}
 
@@ -323,11 +425,8 @@ int nbd_verify(std::string host, int port, double sleep_duration, bool do_reconn
 			return 1;
 	}
 
-	for(int index=0; index<N_RANDOM_BLOCKS; index++)
-	{
-		if (verify_block(fd, nrs[index], random_blocks[index], BLOCK_SIZE))
-			return 1;
-	}
+	if (verify_blocks(fd, io_pool, N_RANDOM_BLOCKS, nrs, random_blocks, BLOCK_SIZE, verify_depth, n_verifiers))
+		return 1;
 
 	std::cout << std::endl << " * TEST0003 fill " << N_RANDOM_BLOCKS << " with the same data (de-duplication test) at random locations and verify that the data is still there after a reconnect..." << std::endl;
 
@@ -359,11 +458,8 @@ int nbd_verify(std::string host, int port, double sleep_duration, bool do_reconn
 			return 1;
 	}
 
-	for(int index=0; index<N_RANDOM_BLOCKS; index++)
-	{
-		if (verify_block(fd, nrs_dd[index], random_blocks_dd[index], BLOCK_SIZE))
-			return 1;
-	}
+	if (verify_blocks(fd, io_pool, N_RANDOM_BLOCKS, nrs_dd, random_blocks_dd, BLOCK_SIZE, verify_depth, n_verifiers))
+		return 1;
 
 	std::cout << std::endl << " * TEST0004 overwrite " << N_RANDOM_BLOCKS << " with the same data (de-duplication test) at random locations and verify that the data is still there after a reconnect..." << std::endl;
 
@@ -390,44 +486,48 @@ int nbd_verify(std::string host, int port, double sleep_duration, bool do_reconn
 			return 1;
 	}
 
-	for(int index=0; index<N_RANDOM_BLOCKS; index++)
+	if (verify_blocks(fd, io_pool, N_RANDOM_BLOCKS, nrs, random_blocks, BLOCK_SIZE, verify_depth, n_verifiers))
+		return 1;
+
+	int rc = -1;
+
+	if (block_size_min > 1)
+		std::cout << std::endl << " - TEST0005 skipping unaligned write test: server requires a minimum block size of " << block_size_min << std::endl;
+	else
 	{
-		if (verify_block(fd, nrs[index], random_blocks[index], BLOCK_SIZE))
-			return 1;
-	}
+		std::cout << std::endl << " * TEST0005 write to an offset (and size) which is not at a multiple of the blocksize" << std::endl; 
 
-	std::cout << std::endl << " * TEST0005 write to an offset (and size) which is not at a multiple of the blocksize" << std::endl; 
+		unsigned char two_blocks[BLOCK_SIZE * 2];
+		memset(two_blocks, 0x12, BLOCK_SIZE * 2);
 
-	unsigned char two_blocks[BLOCK_SIZE * 2];
-	memset(two_blocks, 0x12, BLOCK_SIZE * 2);
+		uint64_t halfway_nr = 9;
+		uint64_t halfway_offset = BLOCK_SIZE * halfway_nr;
+		rc = write_nbd(fd, halfway_offset, (const char *)two_blocks, BLOCK_SIZE * 2);
+		if (rc)
+		{
+			std::cerr << "Failed writing to block " << halfway_nr << " length " << BLOCK_SIZE * 2 << ": " << rc << std::endl;
+			return rc;
+		}
 
-	uint64_t halfway_nr = 9;
-	uint64_t halfway_offset = BLOCK_SIZE * halfway_nr;
-	int rc = write_nbd(fd, halfway_offset, (const char *)two_blocks, BLOCK_SIZE * 2);
-	if (rc)
-	{
-		std::cerr << "Failed writing to block " << halfway_nr << " length " << BLOCK_SIZE * 2 << ": " << rc << std::endl;
-		return rc;
-	}
+		two_blocks[BLOCK_SIZE - 2] = two_blocks[BLOCK_SIZE - 1] =
+		two_blocks[BLOCK_SIZE + 0] = two_blocks[BLOCK_SIZE + 1] = 0xa9;
+		rc = write_nbd(fd, halfway_offset + BLOCK_SIZE - 2, (const char *)&two_blocks[BLOCK_SIZE - 2], 4);
+		if (rc)
+		{
+			std::cerr << "Failed writing to block " << halfway_nr << " length 4: " << rc << std::endl;
+			return rc;
+		}
 
-	two_blocks[BLOCK_SIZE - 2] = two_blocks[BLOCK_SIZE - 1] =
-	two_blocks[BLOCK_SIZE + 0] = two_blocks[BLOCK_SIZE + 1] = 0xa9;
-	rc = write_nbd(fd, halfway_offset + BLOCK_SIZE - 2, (const char *)&two_blocks[BLOCK_SIZE - 2], 4);
-	if (rc)
-	{
-		std::cerr << "Failed writing to block " << halfway_nr << " length 4: " << rc << std::endl;
-		return rc;
-	}
+		if (do_reconnect)
+		{
+			if (reconnect(&fd, host, port, size, flags, sleep_duration))
+				return 1;
+		}
 
-	if (do_reconnect)
-	{
-		if (reconnect(&fd, host, port, size, flags, sleep_duration))
+		if (verify_block(fd, halfway_nr, two_blocks, BLOCK_SIZE * 2))
 			return 1;
 	}
 
-	if (verify_block(fd, halfway_nr, two_blocks, BLOCK_SIZE * 2))
-		return 1;
-
 	if ((flags & 32) == 0)
 		std::cout << std::endl << " - TEST0006 skipping discard test: server indicates that it does not support TRIM" << std::endl;
 	else
@@ -462,11 +562,17 @@ int nbd_verify(std::string host, int port, double sleep_duration, bool do_reconn
 		std::cout << " verifying discard..." << std::endl;
 		unsigned char zero_block[BLOCK_SIZE] = { 0 };
 
+		uint64_t zero_nrs[N_RANDOM_BLOCKS];
+		unsigned char *zero_blocks[N_RANDOM_BLOCKS];
+
 		for(uint64_t index=0; index<N_RANDOM_BLOCKS; index++)
 		{
-			if (verify_block(fd, index, zero_block, BLOCK_SIZE))
-				return 1;
+			zero_nrs[index] = index;
+			zero_blocks[index] = zero_block;
 		}
+
+		if (verify_blocks(fd, io_pool, N_RANDOM_BLOCKS, zero_nrs, zero_blocks, BLOCK_SIZE, verify_depth, n_verifiers))
+			return 1;
 	}
 
 	std::cout << std::endl << " * TEST0007 verify that the nbd-server also sends a response header for a 0-bytes read request..." << std::endl;
@@ -490,8 +596,9 @@ int nbd_verify(std::string host, int port, double sleep_duration, bool do_reconn
 
 	std::cout << std::endl << " * TEST0009 verify that negative offsets are rejected" << std::endl;
 
+	// the payload is sent too: the protocol requires it, also for requests that are rejected
 	uint64_t handle = 1;
-	rc = send_command_nbd(fd, 1, handle, uint64_t(-BLOCK_SIZE / 2), BLOCK_SIZE);
+	rc = send_request_nbd(fd, 1, handle, uint64_t(-BLOCK_SIZE / 2), (const char *)buffer, BLOCK_SIZE);
 	if (rc)
 	{
 		std::cerr << "Problem sending command to server!" << rc << std::endl;
@@ -499,6 +606,12 @@ int nbd_verify(std::string host, int port, double sleep_duration, bool do_reconn
 	}
 
 	rc = verify_ack(fd, handle);
+	if (rc == -1)
+	{
+		std::cerr << "No (valid) reply to a write at a negative offset" << std::endl;
+		return -1;
+	}
+
 	if (rc == 0)
 	{
 		std::cerr << "Server did not reject negative offset!" << rc << std::endl;
@@ -513,7 +626,7 @@ int nbd_verify(std::string host, int port, double sleep_duration, bool do_reconn
 
 	std::cout << std::endl << " * TEST0010 verify that writing past the device end is rejected" << std::endl;
 
-	rc = send_command_nbd(fd, 1, ++handle, size - (BLOCK_SIZE / 2), BLOCK_SIZE);
+	rc = send_request_nbd(fd, 1, ++handle, size - (BLOCK_SIZE / 2), (const char *)buffer, BLOCK_SIZE);
 	if (rc)
 	{
 		std::cerr << "Problem sending command to server!" << rc << std::endl;
@@ -521,6 +634,12 @@ int nbd_verify(std::string host, int port, double sleep_duration, bool do_reconn
 	}
 
 	rc = verify_ack(fd, handle);
+	if (rc == -1)
+	{
+		std::cerr << "No (valid) reply to a write past the device end" << std::endl;
+		return -1;
+	}
+
 	if (rc == 0)
 	{
 		std::cerr << "Server did not reject writing past device end!" << rc << std::endl;
@@ -543,32 +662,34 @@ int nbd_verify(std::string host, int port, double sleep_duration, bool do_reconn
 
 	printf("\n ***** all fine! *****\n");
 
+	std::cout << std::endl;
+	pool_print("verify", io_pool);
+
 	return 0;
 }
 
-int nbd_latency(const char *host, int port, bool do_writes)
+// verify_depth reads are kept in flight and compared by n_verifiers threads
+int nbd_verify(std::string host, int port, double sleep_duration, bool do_reconnect, int verify_depth, int n_verifiers)
 {
-	uint32_t flags = -1;
-	uint64_t size = -1;
-	int fd = connect_nbd(host, port, &size, &flags, true);
-	if (fd == -1)
-	{
-		std::cerr << "failed setting up NBD session" << std::endl;
-		return 1;
-	}
+	// the two sets of random blocks and what is read back (also what
+	// waits for a verifier thread); freed whichever way the tests end
+	io_pool = pool_create(BLOCK_SIZE, N_RANDOM_BLOCKS * 2 + VERIFY_READ_BUFFERS + verify_depth + verify_queue_size(verify_depth));
 
-	double start_ts = get_ts(), now_ts = -1.0;
-	int count = 0;
+	int rc = nbd_verify_tests(host, port, sleep_duration, do_reconnect, verify_depth, n_verifiers);
 
-	std::cout << "Please wait " << LATENCY_MEASURE_TIME << " seconds..." << std::endl;
+	pool_destroy(io_pool);
+	io_pool = NULL;
 
-	if (do_writes)
-		std::cerr << "measuring latency for WRITE actions" << std::endl;
-	else
-		std::cerr << "measuring latency for read actions" << std::endl;
+	return rc;
+}
 
+// 0-byte requests, one at a time, for 'duration' seconds
+int measure_latency(int fd, bool do_writes, double duration, histogram_t *h)
+{
 	unsigned char buffer[BLOCK_SIZE];
 
+	uint64_t start_ns = get_ns(), now_ns = start_ns;
+
 	do
 	{
 		int rc = -1;
@@ -584,12 +705,129 @@ int nbd_latency(const char *host, int port, bool do_writes)
 			return -1;
 		}
 
-		count++;
+		uint64_t prev_ns = now_ns;
+		now_ns = get_ns();
 
-		now_ts = get_ts();
-	} while(now_ts - start_ts < LATENCY_MEASURE_TIME);
+		hist_add(h, now_ns - prev_ns);
+
+		if (recording)
+			record_request(0, do_writes ? 1 : 0, 0, 0, prev_ns, now_ns, rc);
+
+		if (slowest_n)
+			slowest_add(0, do_writes ? 1 : 0, 0, 0, prev_ns, now_ns, 1, rc);
+
+		if (metrics_enabled)
+			metrics_add(do_writes ? 1 : 0, 0, now_ns - prev_ns, rc);
+	} while(now_ns - start_ns < uint64_t(duration * 1000000000.0));
+
+	return 0;
+}
+
+// low_latency: measure blocking and then busy polling, both pinned to 'cpu' (if >= 0)
+int nbd_latency(const char *host, int port, bool do_writes, double duration, bool low_latency, int cpu)
+{
+	if (cpu >= 0 && pin_to_cpu(cpu))
+		return 1;
+
+	if (low_latency)
+		lock_memory();
+
+	uint32_t flags = -1;
+	uint64_t size = -1;
+	int fd = connect_nbd(host, port, &size, &flags, true);
+	if (fd == -1)
+	{
+		std::cerr << "failed setting up NBD session" << std::endl;
+		return 1;
+	}
+
+	if (duration <= 0.0)
+		duration = LATENCY_MEASURE_TIME;
+
+	std::cout << "Please wait " << duration * (low_latency ? 2 : 1) << " seconds..." << std::endl;
+
+	if (do_writes)
+		std::cerr << "measuring latency for WRITE actions over " << transport_name(host) << std::endl;
+	else
+		std::cerr << "measuring latency for read actions over " << transport_name(host) << std::endl;
+
+	histogram_t *h_blocking = (histogram_t *)malloc(sizeof(histogram_t));
+	hist_init(h_blocking);
+
+	histogram_t *h_busy = (histogram_t *)malloc(sizeof(histogram_t));
+	hist_init(h_busy);
+
+	if (low_latency)
+	{
+		// no page faults in the measurement loop
+		prefault(h_blocking, sizeof(histogram_t));
+		prefault(h_busy, sizeof(histogram_t));
+	}
+
+	perf_counters_t pc_blocking, pc_busy;
+
+	if (perf_enabled)
+		perf_start(&pc_blocking);
+
+	if (measure_latency(fd, do_writes, duration, h_blocking))
+		return -1;
+
+	if (perf_enabled)
+		perf_stop(&pc_blocking);
+
+	if (low_latency)
+	{
+		if (set_busy_poll(fd, 50))
+			std::cerr << "SO_BUSY_POLL not available (" << strerror(errno) << "), spinning in user space only" << std::endl;
+
+		busy_poll = true;
+
+		if (perf_enabled)
+			perf_start(&pc_busy);
+
+		int rc = measure_latency(fd, do_writes, duration, h_busy);
+
+		if (perf_enabled)
+			perf_stop(&pc_busy);
+
+		busy_poll = false;
+
+		if (rc)
+			return -1;
+	}
+
+	std::cout << "Latency is " << hist_avg(h_blocking) / 1000000.0 << "ms (transport: " << transport_name(host) << ")" << std::endl;
+	std::cout << std::endl;
+
+	hist_print_header("latency (us)");
+	hist_print("blocking", h_blocking);
+
+	if (low_latency)
+	{
+		hist_print("busy-poll", h_busy);
+
+		printf("%-20s %10s %10.2f %10.2f %10.2f %10.2f %10.2f %10.2f %10.2f\n", "difference", "",
+				(double(h_busy -> min) - double(h_blocking -> min)) / 1000.0,
+				(hist_avg(h_busy) - hist_avg(h_blocking)) / 1000.0,
+				(double(hist_percentile(h_busy, 50.0)) - double(hist_percentile(h_blocking, 50.0))) / 1000.0,
+				(double(hist_percentile(h_busy, 90.0)) - double(hist_percentile(h_blocking, 90.0))) / 1000.0,
+				(double(hist_percentile(h_busy, 99.0)) - double(hist_percentile(h_blocking, 99.0))) / 1000.0,
+				(double(hist_percentile(h_busy, 99.9)) - double(hist_percentile(h_blocking, 99.9))) / 1000.0,
+				(double(h_busy -> max) - double(h_blocking -> max)) / 1000.0);
+	}
 
-	std::cout << "Latency is " << (now_ts - start_ts) * 1000.0 / double(count) << "ms" << std::endl;
+	if (perf_enabled)
+	{
+		std::cout << std::endl;
+		perf_print_header();
+		perf_print("blocking", &pc_blocking, h_blocking -> n);
+
+		if (low_latency)
+			perf_print("busy-poll", &pc_busy, h_busy -> n);
+	}
+
+	free(h_busy);
+	free(h_blocking);
 
 	if (close_nbd(fd))
 	{
@@ -600,7 +838,19 @@ int nbd_latency(const char *host, int port, bool do_writes)
 	return 0;
 }
 
-int nbd_iops(const char *host, int port, double dd_perc, bool do_writes)
+volatile sig_atomic_t stop_flag = 0;
+
+void sigint_handler(int sig)
+{
+	stop_flag = 1;
+
+	// a second ctrl+c aborts
+	signal(SIGINT, SIG_DFL);
+}
+
+// io_size 0 selects the preferred block size of the server
+// queue_depth requests are kept in flight; runs until ctrl+c or for 'duration' seconds (if > 0)
+int nbd_iops(const char *host, int port, double dd_perc, bool do_writes, uint32_t io_size, int queue_depth, double duration)
 {
 	uint32_t flags = -1;
 	uint64_t size = -1;
@@ -611,71 +861,213 @@ int nbd_iops(const char *host, int port, double dd_perc, bool do_writes)
 		return 1;
 	}
 
-	if (size < BLOCK_SIZE)
+	if (io_size == 0)
+		io_size = block_size_preferred;
+
+	if (!check_io_size(io_size, true))
 	{
-		std::cerr << "device too small (" << size << "), must be at least " << BLOCK_SIZE << std::endl;
+		CLOSE(fd);
 		return 1;
 	}
 
-	uint64_t n_blocks = size / BLOCK_SIZE;
+	if (size < io_size)
+	{
+		std::cerr << "device too small (" << size << "), must be at least " << io_size << std::endl;
+		CLOSE(fd);
+		return 1;
+	}
+
+	uint64_t n_blocks = size / io_size;
+
+	std::cout << "press ctrl+c to stop" << std::endl;
 
-	std::cout << "press ctrl+c to abort" << std::endl;
+	std::cout << "I/O size: " << io_size << " bytes, queue depth: " << queue_depth << std::endl;
 
-	unsigned char block_dd[BLOCK_SIZE];
-	memset(block_dd, 0xfe, sizeof block_dd);
+	io_pool = pool_create(io_size, queue_depth + 1);
 
-	unsigned char block_ndd[BLOCK_SIZE];
+	unsigned char *block_dd = (unsigned char *)pool_get(io_pool, io_size);
+	memset(block_dd, 0xfe, io_size);
+
+	// one buffer per request in flight; the handle is the index
+	unsigned char **blocks_ndd = (unsigned char **)malloc(sizeof(unsigned char *) * queue_depth);
+	for(int index=0; index<queue_depth; index++)
+	{
+		blocks_ndd[index] = (unsigned char *)pool_get(io_pool, io_size);
+		memset(blocks_ndd[index], 0x00, io_size);
+	}
 
-	double start_ts = get_ts(), prev_ts = start_ts;
+	// for the recorder
+	uint64_t *slot_submit_ns = (uint64_t *)calloc(queue_depth, sizeof(uint64_t));
+	uint64_t *slot_offset = (uint64_t *)calloc(queue_depth, sizeof(uint64_t));
+	int *slot_in_flight = (int *)calloc(queue_depth, sizeof(int));
 
-	uint64_t nr = 0;
+	double start_ts = get_ts(), prev_ts = start_ts, now_ts = start_ts;
+
+	uint64_t nr = 0, submitted = 0;
+	uint64_t syscalls_start = n_syscalls;
 
 	if (do_writes)
-		std::cerr << "measuring IOPS for WRITE actions" << std::endl;
+		std::cerr << "measuring IOPS for WRITE actions over " << transport_name(host) << std::endl;
 	else
-		std::cerr << "measuring IOPS for read actions" << std::endl;
+		std::cerr << "measuring IOPS for read actions over " << transport_name(host) << std::endl;
 
-	for(;;)
-	{
-		unsigned char *p = NULL;
+	signal(SIGINT, sigint_handler);
 
-		double d = drand48() * 100.0;
-		if (d < dd_perc)
-			p = block_dd;
-		else
+	perf_counters_t pc;
+
+	if (perf_enabled)
+		perf_start(&pc);
+
+	int in_flight = 0;
+
+	for(uint64_t slot=0; slot<uint64_t(queue_depth) || in_flight > 0;)
+	{
+		// (re-)submit 'slot'
+		if (slot < uint64_t(queue_depth))
 		{
-			uint64_t *bn = (uint64_t *)block_ndd;
-			*bn = nr;
+			unsigned char *p = blocks_ndd[slot];
+
+			if (do_writes)
+			{
+				double d = drand48() * 100.0;
+				if (d < dd_perc)
+					p = block_dd;
+				else
+				{
+					uint64_t *bn = (uint64_t *)p;
+					*bn = submitted;
+				}
+			}
 
-			p = block_ndd;
+			uint64_t b_nr = get_random_block_offset(n_blocks);
+
+			if (recording || slowest_n || metrics_enabled)
+			{
+				slot_submit_ns[slot] = get_ns();
+				slot_offset[slot] = b_nr * io_size;
+			}
+
+			if (send_request_nbd(fd, do_writes ? 1 : 0, slot, b_nr * io_size, do_writes ? (const char *)p : NULL, io_size))
+			{
+				std::cerr << "Failed to send request to server" << std::endl;
+				return 1;
+			}
+
+			submitted++;
+			in_flight++;
+			slot_in_flight[slot] = in_flight;
+
+			// fill the queue first
+			if (submitted < uint64_t(queue_depth))
+			{
+				slot++;
+				continue;
+			}
 		}
 
-		uint64_t b_nr = get_random_block_offset(n_blocks);
+		uint64_t handle = -1;
+		uint32_t err = 0;
 
-		int rc = -1;
+		if (receive_reply_nbd(fd, &handle, &err))
+			return 1;
 
-		if (do_writes)
-			rc = write_nbd(fd, b_nr * BLOCK_SIZE, (const char *)p, BLOCK_SIZE);
-		else
-			rc = read_nbd(fd, b_nr * BLOCK_SIZE, (char *)p, BLOCK_SIZE);
+		if (handle >= uint64_t(queue_depth))
+		{
+			std::cerr << "reply for unknown handle " << handle << std::endl;
+			return 1;
+		}
 
-		if (rc)
+		if (recording || slowest_n || metrics_enabled)
 		{
-			std::cerr << "Failed to " << (do_writes ? "write to" : "read from") << " server " << rc << std::endl;
-			return rc;
+			uint64_t now_ns = get_ns();
+
+			if (recording)
+				record_request(0, do_writes ? 1 : 0, slot_offset[handle], io_size, slot_submit_ns[handle], now_ns, err);
+
+			if (slowest_n)
+				slowest_add(0, do_writes ? 1 : 0, slot_offset[handle], io_size, slot_submit_ns[handle], now_ns, slot_in_flight[handle], err);
+
+			if (metrics_enabled)
+				metrics_add(do_writes ? 1 : 0, io_size, now_ns - slot_submit_ns[handle], err);
+		}
+
+		if (err)
+		{
+			std::cerr << "Failed to " << (do_writes ? "write to" : "read from") << " server " << err << std::endl;
+			return err;
 		}
 
+		if (!do_writes)
+		{
+			uint64_t phase_ns = phase_start();
+
+			if (READ_BUFFERED(fd, blocks_ndd[handle], io_size) != ssize_t(io_size))
+			{
+				std::cerr << "short read retrieving data for read-command" << std::endl;
+				return 1;
+			}
+
+			phase_end(PH_PAYLOAD, phase_ns);
+		}
+
+		in_flight--;
 		nr++;
 
-		double now_ts = get_ts();
+		slot = handle;
+
+		now_ts = get_ts();
 		if (now_ts - prev_ts >= 2.0)
 		{
 			double diff_ts = now_ts - start_ts;
-			printf("IOPs: %f\r", double(nr) / diff_ts);
+			printf("IOPs (%s): %f, system calls per I/O: %.2f\r", transport_name(host).c_str(), double(nr) / diff_ts, double(n_syscalls - syscalls_start) / nr);
 			fflush(NULL);
 
 			prev_ts = now_ts;
 		}
+
+		// stop: let the requests in flight finish
+		if (stop_flag || (duration > 0.0 && now_ts - start_ts >= duration))
+			slot = queue_depth;
+	}
+
+	if (perf_enabled)
+		perf_stop(&pc);
+
+	signal(SIGINT, SIG_DFL);
+
+	double diff_ts = now_ts - start_ts;
+
+	// stopped before anything completed
+	if (nr == 0)
+		printf("\nno I/Os completed in %.3fs\n", diff_ts);
+	else
+		printf("\n%llu I/Os in %.3fs: %f IOPs (%s), %.2f system calls per I/O (receive buffering %s)\n", (unsigned long long)nr, diff_ts, double(nr) / diff_ts, transport_name(host).c_str(), double(n_syscalls - syscalls_start) / nr, rx_buffer_size ? "on" : "off");
+
+	if (perf_enabled)
+	{
+		std::cout << std::endl;
+		perf_print_header();
+		perf_print(do_writes ? "write" : "read", &pc, nr);
+	}
+
+	std::cout << std::endl;
+	pool_print("iops", io_pool);
+
+	for(int index=0; index<queue_depth; index++)
+		pool_put(io_pool, blocks_ndd[index]);
+	free(blocks_ndd);
+	pool_put(io_pool, block_dd);
+	free(slot_in_flight);
+	free(slot_offset);
+	free(slot_submit_ns);
+
+	pool_destroy(io_pool);
+	io_pool = NULL;
+
+	if (close_nbd(fd))
+	{
+		std::cerr << "Failed to close session with server" << std::endl;
+		return 1;
 	}
 
 	return 0;
@@ -685,18 +1077,89 @@ void help()
 {
 	std::cerr << "-H x     host to connect to" << std::endl;
 	std::cerr << "-P x     port to connect to" << std::endl;
-	std::cerr << "-a x     action, must be either \"iops\", \"latency\" or \"verify\"" << std::endl;
+	std::cerr << "-U x     connect to unix domain socket x instead of TCP" << std::endl;
+	std::cerr << "-V x     connect to vsock context id x (port set with -P) instead of TCP" << std::endl;
+	std::cerr << "-N x     use fixed-newstyle negotiation and select export x (\"\" for the default export)" << std::endl;
+	std::cerr << "-L       list the exports (with their size and block size constraints) and exit" << std::endl;
+	std::cerr << "-a x     action, one of: verify, iops, latency, connect, ordering, replay, fleet, sweep, slo, soak, cache," << std::endl;
+	std::cerr << "         unaligned, visibility or scan" << std::endl;
+	std::cerr << "         connect: open many sessions and measure connect/handshake times (not destructive)" << std::endl;
+	std::cerr << "         ordering: several sessions overwrite the same blocks with FUA writes and flushes, then check" << std::endl;
+	std::cerr << "         after a reconnect that no write that was made durable got lost or overtaken by an older one" << std::endl;
+	std::cerr << "         replay: replay the block trace given with -T" << std::endl;
+	std::cerr << "         fleet: iops on all endpoints given with -m at once, per endpoint and in total, and which ones lag" << std::endl;
+	std::cerr << "         sweep: find the number of sessions (up to -c, " << SWEEP_MAX_SESSIONS << ") and requests in flight per session (up" << std::endl;
+	std::cerr << "         to -q, " << SWEEP_MAX_DEPTH << ") where IOPS stop growing and only latency does (the knee)" << std::endl;
+	std::cerr << "         slo: the highest IOPS for which the p99 latency stays below -s; adjusts the requests in flight" << std::endl;
+	std::cerr << "         (up to -q, " << SLO_MAX_DEPTH << ") and the request rate while running and logs each step" << std::endl;
+	std::cerr << "         soak: random I/O for -d seconds (default: until ctrl+c, days are fine: memory use is fixed), alerting" << std::endl;
+	std::cerr << "         when IOPS or p99 latency drift away from those at the start" << std::endl;
+	std::cerr << "         cache: random reads over a working set from 1 MiB up to the whole export (doubling), showing" << std::endl;
+	std::cerr << "         the latency per size and the levels of caching of the server with their estimated size" << std::endl;
+	std::cerr << "         unaligned: IOPS and latency of each combination of offset misalignment (0, 512, 2048, 1) and" << std::endl;
+	std::cerr << "         request length (1 byte to 64 KiB, aligned or not), also where the server asks for larger blocks" << std::endl;
+	std::cerr << "         visibility: one session writes new versions of a block, -c others keep reading it: how long" << std::endl;
+	std::cerr << "         after the ack of a write the other sessions see it, and whether they read older versions after that" << std::endl;
+	std::cerr << "         scan: sample the latency of reads (and writes, unless -r) in each region of the export and show" << std::endl;
+	std::cerr << "         a heatmap and the regions that are slower than the rest" << std::endl;
+	std::cerr << "-G x     for scan: size of a region, e.g. 1G (default: 1/256th of the export)" << std::endl;
+	std::cerr << "-o x     for soak: write the timeline (one CSV line per window) to file x, for scan: the latency per region" << std::endl;
+	std::cerr << "-D x     for soak: drift in percent that is alerted on (" << SOAK_DRIFT << ")" << std::endl;
+	std::cerr << "-s x     for slo: the latency objective in milliseconds (e.g. 2 or 0.5)" << std::endl;
+	std::cerr << "-m x     endpoints: host:port,unix:/path,vsock:cid:port,... or @file with one per line" << std::endl;
+	std::cerr << "         (other actions use the first one)" << std::endl;
+	std::cerr << "-T x     for replay: trace file, blkparse output (Q events) or CSV lines of timestamp,op,offset,length" << std::endl;
+	std::cerr << "         (op: r, w, f or t; timestamp in seconds, offset and length in bytes)" << std::endl;
+	std::cerr << "-A       for replay: as fast as possible (within -q) instead of with the recorded timing" << std::endl;
+	std::cerr << "-b x     for iops: I/O size in bytes (default: preferred block size of the server)" << std::endl;
 	std::cerr << "-p x     for iops: de-duplication percentage (how much will be de-dupable)" << std::endl;
-	std::cerr << "-r       for iops/latency: do reads instead of writes (writes are the default! be warned!)" << std::endl;
+	std::cerr << "-q x     for iops/verify/ordering/replay/fleet/soak/cache/unaligned: number of requests to keep in flight (1, for ordering " << ORDERING_QUEUE_DEPTH << ")," << std::endl;
+	std::cerr << "         for sweep/slo: the most to keep in flight per session" << std::endl;
+	std::cerr << "-w x     for verify: number of threads comparing what was read while the next blocks are read (1)" << std::endl;
+	std::cerr << "-d x     for iops: stop after x seconds (default: run until ctrl+c), for latency: measure for x seconds (" << LATENCY_MEASURE_TIME << ")," << std::endl;
+	std::cerr << "         for ordering/fleet/slo: run for x seconds (" << ORDERING_DURATION << ", for slo " << SLO_DURATION << ")," << std::endl;
+	std::cerr << "         for cache: measure each working set size for x seconds (" << CACHE_MEASURE_TIME << ")," << std::endl;
+	std::cerr << "         for unaligned: measure each combination for x seconds (" << UNALIGNED_CELL_TIME << ")," << std::endl;
+	std::cerr << "         for visibility: run for x seconds (" << VISIBILITY_DURATION << ")" << std::endl;
+	std::cerr << "-l       for latency: low-latency mode; measure with blocking waits and then with busy polling" << std::endl;
+	std::cerr << "         (SO_BUSY_POLL where possible), with all memory locked and pre-faulted, and show the difference" << std::endl;
+	std::cerr << "-C x     for latency: pin the measuring thread to cpu x" << std::endl;
+	std::cerr << "-E       for iops/latency: show what the client costs per I/O (cycles, instructions, cache misses," << std::endl;
+	std::cerr << "         context switches, system calls, cpu time) using perf_event_open and getrusage" << std::endl;
+	std::cerr << "-W x     record every request (times, type, offset, length, error, session) of iops, latency, ordering" << std::endl;
+	std::cerr << "         and replay in binary file x; see nbd-verify-trace for reading it" << std::endl;
+	std::cerr << "-k x     keep the x slowest requests (per thread, without locks) and show them at the end with when they" << std::endl;
+	std::cerr << "         were sent (wall clock), type, offset, length, session and the requests in flight at the time" << std::endl;
+	std::cerr << "-M x     publish request counts and latency histograms every second in shared memory segment x" << std::endl;
+	std::cerr << "         (/dev/shm/x, layout in utils-metrics.h) while running" << std::endl;
+	std::cerr << "-O x     serve the same in the Prometheus text format on http://127.0.0.1:x/metrics" << std::endl;
+	std::cerr << "-I       time the phases of each request (header build, send, wait for the reply, payload receive," << std::endl;
+	std::cerr << "         compare) and show their distribution at the end; SIGUSR1 switches this on/off while running" << std::endl;
+	std::cerr << "-u       do not buffer received data (one read() per reply header/payload)" << std::endl;
+	std::cerr << "-r       for iops/latency/fleet/unaligned/scan: do reads instead of writes (writes are the default! be warned!)" << std::endl;
 	std::cerr << "-i x     how long to sleep during a disconnect/connect cycle" << std::endl;
+	std::cerr << "-F x     before the action, write the whole export sequentially and then x times its size in random" << std::endl;
+	std::cerr << "         writes (0 for none), continued until the IOPS are steady (destroys all data)" << std::endl;
 	std::cerr << "-f       ignore check which verifies that the device does not contain data (this is a safety check)" << std::endl;
 	std::cerr << "-t x     time-out for networking and command processing (" << read_timeout << ")" << std::endl;
 	std::cerr << "-n       do not disconnect/connect" << std::endl;
+	std::cerr << "-c x     for connect/ordering/fleet/slo/soak/cache: number of sessions (100, for ordering " << ORDERING_SESSIONS << ", for the load actions 1 per endpoint)," << std::endl;
+	std::cerr << "         for sweep: the most sessions per endpoint, for visibility: number of readers (" << VISIBILITY_READERS << ")," << std::endl;
+	std::cerr << "         for scan: sessions sampling in parallel (" << SCAN_SESSIONS << ")" << std::endl;
+	std::cerr << "-R x     for connect: open this many sessions per second instead of all at once" << std::endl;
+	std::cerr << "-B x     connect retry back-off: initial[,max[,jitter[,attempts]]], delays in seconds," << std::endl;
+	std::cerr << "         jitter as fraction, attempts 0 is forever (" << connect_retry_delay << "," << connect_retry_max_delay << "," << connect_retry_jitter << "," << connect_max_attempts << ", for connect: " << STORM_CONNECT_ATTEMPTS << ")" << std::endl;
+	std::cerr << "         the jitter is also applied to -i" << std::endl;
+	std::cerr << "-S x     start a built-in RAM backed NBD server of x bytes (e.g. 6G) in-process and test that" << std::endl;
+	std::cerr << "         (on the socket given with -U, else on TCP loopback); this gives the ceiling of what" << std::endl;
+	std::cerr << "         the client itself can do" << std::endl;
 }
 
 int main(int argc, char *argv[])
 {
 	const char *host = NULL;
+	std::string host_buffer;
+	const char *unix_path = NULL;
 	int port = -1;
 	action_t action = A_VERIFY;
 	double dd_perc = 7.0;
@@ -704,11 +1167,33 @@ int main(int argc, char *argv[])
 	bool do_reconnect = true;
 	bool do_writes = true;
 	bool ignore_has_data = false;
+	bool list_exports = false;
+	uint32_t io_size = 0;
+	uint64_t builtin_size = 0;
+	int n_sessions = -1;
+	double session_rate = 0.0;
+	int n_backoff_fields = 0;
+	int queue_depth = -1;
+	int n_verifiers = 1;
+	const char *trace_file = NULL;
+	bool replay_asap = false;
+	const char *record_file = NULL;
+	std::vector<endpoint_t> endpoints;
+	bool low_latency = false;
+	int cpu = -1;
+	double duration = 0.0;
+	uint64_t slo_ns = 0;
+	const char *timeline_file = NULL;
+	double drift = SOAK_DRIFT;
+	int prefill_passes = -1;
+	uint64_t region_size = 0;
+	const char *metrics_shm = NULL;
+	int metrics_port = 0;
 
 	std::cout << "nbd_verify v" VERSION ", (C) 2013 by folkert@vanheusden.com" << std::endl << std::endl;
 
 	int c = -1;
-	while((c = getopt(argc, argv, "H:P:a:p:i:nrft:")) != -1)
+	while((c = getopt(argc, argv, "H:P:U:V:a:p:i:nrft:N:Lb:S:c:R:B:q:d:ulC:IEw:T:AW:m:s:o:D:F:G:k:M:O:")) != -1)
 	{
 		switch(c)
 		{
@@ -730,6 +1215,17 @@ int main(int argc, char *argv[])
 				}
 				break;
 
+			case 'U':
+				unix_path = optarg;
+				host_buffer = std::string("unix:") + optarg;
+				host = host_buffer.c_str();
+				break;
+
+			case 'V':
+				host_buffer = std::string("vsock:") + optarg;
+				host = host_buffer.c_str();
+				break;
+
 			case 'a':
 				if (strcasecmp(optarg, "verify") == 0)
 					action = A_VERIFY;
@@ -737,6 +1233,28 @@ int main(int argc, char *argv[])
 					action = A_IOPS;
 				else if (strcasecmp(optarg, "latency") == 0)
 					action = A_LATENCY;
+				else if (strcasecmp(optarg, "connect") == 0)
+					action = A_CONNECT;
+				else if (strcasecmp(optarg, "ordering") == 0)
+					action = A_ORDERING;
+				else if (strcasecmp(optarg, "replay") == 0)
+					action = A_REPLAY;
+				else if (strcasecmp(optarg, "fleet") == 0)
+					action = A_FLEET;
+				else if (strcasecmp(optarg, "sweep") == 0)
+					action = A_SWEEP;
+				else if (strcasecmp(optarg, "slo") == 0)
+					action = A_SLO;
+				else if (strcasecmp(optarg, "soak") == 0)
+					action = A_SOAK;
+				else if (strcasecmp(optarg, "cache") == 0)
+					action = A_CACHE;
+				else if (strcasecmp(optarg, "unaligned") == 0)
+					action = A_UNALIGNED;
+				else if (strcasecmp(optarg, "visibility") == 0)
+					action = A_VISIBILITY;
+				else if (strcasecmp(optarg, "scan") == 0)
+					action = A_SCAN;
 				else
 				{
 					std::cerr << "-a " << optarg << " is not understood" << std::endl;
@@ -783,6 +1301,196 @@ int main(int argc, char *argv[])
 				}
 				break;
 
+			case 'N':
+				export_name = optarg;
+				connect_nbd = connect_nbd_v2;
+				break;
+
+			case 'L':
+				list_exports = true;
+				break;
+
+			case 'b':
+				io_size = atoi(optarg);
+				if (io_size == 0)
+				{
+					std::cerr << "I/O size must be > 0" << std::endl;
+					return 1;
+				}
+				break;
+
+			case 'S':
+				builtin_size = parse_size(optarg);
+				if (builtin_size < 512)
+				{
+					std::cerr << "size of the built-in server must be at least 512 bytes" << std::endl;
+					return 1;
+				}
+				break;
+
+			case 'c':
+				n_sessions = atoi(optarg);
+				if (n_sessions <= 0)
+				{
+					std::cerr << "number of sessions must be > 0" << std::endl;
+					return 1;
+				}
+				break;
+
+			case 'R':
+				session_rate = atof(optarg);
+				if (session_rate <= 0.0)
+				{
+					std::cerr << "session rate must be > 0" << std::endl;
+					return 1;
+				}
+				break;
+
+			case 'B':
+				connect_retry_max_delay = -1.0;
+				n_backoff_fields = sscanf(optarg, "%lf,%lf,%lf,%d", &connect_retry_delay, &connect_retry_max_delay, &connect_retry_jitter, &connect_max_attempts);
+				if (n_backoff_fields < 1 ||
+					connect_retry_delay <= 0.0 || connect_retry_jitter < 0.0 || connect_retry_jitter > 1.0 || connect_max_attempts < 0)
+				{
+					std::cerr << "-B requires initial[,max[,jitter[,attempts]]] with initial > 0, jitter between 0 and 1 and attempts >= 0" << std::endl;
+					return 1;
+				}
+
+				if (connect_retry_max_delay < connect_retry_delay)
+					connect_retry_max_delay = connect_retry_delay;
+				break;
+
+			case 'q':
+				queue_depth = atoi(optarg);
+				if (queue_depth <= 0)
+				{
+					std::cerr << "queue depth must be > 0" << std::endl;
+					return 1;
+				}
+				break;
+
+			case 'd':
+				duration = atof(optarg);
+				if (duration <= 0.0)
+				{
+					std::cerr << "duration must be > 0" << std::endl;
+					return 1;
+				}
+				break;
+
+			case 's':
+				slo_ns = uint64_t(atof(optarg) * 1000000.0);
+				if (slo_ns == 0)
+				{
+					std::cerr << "latency objective must be > 0" << std::endl;
+					return 1;
+				}
+				break;
+
+			case 'o':
+				timeline_file = optarg;
+				break;
+
+			case 'D':
+				drift = atof(optarg);
+				if (drift <= 0.0)
+				{
+					std::cerr << "drift must be > 0" << std::endl;
+					return 1;
+				}
+				break;
+
+			case 'F':
+				prefill_passes = atoi(optarg);
+				if (prefill_passes < 0)
+				{
+					std::cerr << "number of random passes must be >= 0" << std::endl;
+					return 1;
+				}
+				break;
+
+			case 'M':
+				metrics_shm = optarg;
+				break;
+
+			case 'O':
+				metrics_port = atoi(optarg);
+				if (metrics_port <= 0 || metrics_port > 65535)
+				{
+					std::cerr << "port number must be between 1 and 65535" << std::endl;
+					return 1;
+				}
+				break;
+
+			case 'k':
+				slowest_n = atoi(optarg);
+				if (slowest_n <= 0)
+				{
+					std::cerr << "number of slowest requests to keep must be > 0" << std::endl;
+					return 1;
+				}
+				break;
+
+			case 'G':
+				region_size = parse_size(optarg);
+				if (region_size == 0)
+				{
+					std::cerr << "region size must be > 0" << std::endl;
+					return 1;
+				}
+				break;
+
+			case 'u':
+				rx_buffer_size = 0;
+				break;
+
+			case 'l':
+				low_latency = true;
+				break;
+
+			case 'C':
+				cpu = atoi(optarg);
+				if (cpu < 0)
+				{
+					std::cerr << "cpu number must be >= 0" << std::endl;
+					return 1;
+				}
+				break;
+
+			case 'I':
+				phase_timing = 1;
+				break;
+
+			case 'E':
+				perf_enabled = true;
+				break;
+
+			case 'T':
+				trace_file = optarg;
+				break;
+
+			case 'A':
+				replay_asap = true;
+				break;
+
+			case 'W':
+				record_file = optarg;
+				break;
+
+			case 'm':
+				if (parse_endpoints(optarg, &endpoints))
+					return 1;
+				break;
+
+			case 'w':
+				n_verifiers = atoi(optarg);
+				if (n_verifiers <= 0)
+				{
+					std::cerr << "number of verifier threads must be > 0" << std::endl;
+					return 1;
+				}
+				break;
+
 			case 'h':
 				help();
 				return 0;
@@ -793,12 +1501,112 @@ int main(int argc, char *argv[])
 		}
 	}
 
+	if (action == A_REPLAY && trace_file == NULL)
+	{
+		std::cerr << "replay requires a trace file (-T)" << std::endl;
+		return 1;
+	}
+
+	// defaults that depend on the action
+	if (n_sessions == -1)
+	{
+		if (action == A_ORDERING)
+			n_sessions = ORDERING_SESSIONS;
+		else if (action == A_FLEET || action == A_SLO || action == A_SOAK || action == A_CACHE)
+			n_sessions = 1;
+		else if (action == A_VISIBILITY)
+			n_sessions = VISIBILITY_READERS;
+		else if (action == A_SCAN)
+			n_sessions = SCAN_SESSIONS;
+		else if (action == A_SWEEP)
+			n_sessions = SWEEP_MAX_SESSIONS;
+		else
+			n_sessions = 100;
+	}
+
+	if (queue_depth == -1)
+	{
+		if (action == A_ORDERING)
+			queue_depth = ORDERING_QUEUE_DEPTH;
+		else if (action == A_SWEEP)
+			queue_depth = SWEEP_MAX_DEPTH;
+		else if (action == A_SLO)
+			queue_depth = SLO_MAX_DEPTH;
+		else
+			queue_depth = 1;
+	}
+
+	if (action == A_CONNECT && n_backoff_fields < 4)
+		connect_max_attempts = STORM_CONNECT_ATTEMPTS;
+
+	if (duration <= 0.0 && action == A_ORDERING)
+		duration = ORDERING_DURATION;
+
+	if (duration <= 0.0 && action == A_FLEET)
+		duration = FLEET_DURATION;
+
+	if (duration <= 0.0 && action == A_SLO)
+		duration = SLO_DURATION;
+
+	if (duration <= 0.0 && action == A_CACHE)
+		duration = CACHE_MEASURE_TIME;
+
+	if (duration <= 0.0 && action == A_UNALIGNED)
+		duration = UNALIGNED_CELL_TIME;
+
+	if (duration <= 0.0 && action == A_VISIBILITY)
+		duration = VISIBILITY_DURATION;
+
+	if (action == A_SLO && slo_ns == 0)
+	{
+		std::cerr << "slo requires a latency objective (-s)" << std::endl;
+		return 1;
+	}
+
+	if (builtin_size)
+	{
+		server_config_t cfg;
+		init_server_config(&cfg);
+
+		cfg.listen_addr = "127.0.0.1";
+		cfg.port = 0;
+		cfg.unix_path = unix_path;
+		cfg.size = builtin_size;
+		cfg.oldstyle = connect_nbd == connect_nbd_v1;
+		cfg.export_name = export_name;
+
+		if (start_server(&cfg))
+			return 1;
+
+		if (unix_path)
+		{
+			std::cout << "started built-in server on " << unix_path << " (" << cfg.n_workers << " worker threads)" << std::endl;
+			port = 0;
+		}
+		else
+		{
+			std::cout << "started built-in server on port " << cfg.port << " (" << cfg.n_workers << " worker threads)" << std::endl;
+
+			host = cfg.listen_addr;
+			port = cfg.port;
+		}
+	}
+
+	if (!endpoints.empty())
+	{
+		host = endpoints.at(0).host.c_str();
+		port = endpoints.at(0).port;
+	}
+
 	if (host == NULL)
 	{
 		std::cerr << "No host to connect to given" << std::endl;
 		return 1;
 	}
 
+	if (unix_path)
+		port = 0;
+
 	if (port == -1)
 	{
 		std::cerr << "No port to connect to given" << std::endl;
@@ -806,25 +1614,100 @@ int main(int argc, char *argv[])
 	}
 
 	signal(SIGPIPE, SIG_IGN);
+	signal(SIGUSR1, phase_toggle_handler);
+
+	if (list_exports)
+		return list_exports_nbd(host, port) ? 1 : 0;
+
+	if (action == A_CONNECT)
+		return nbd_connect_storm(host, port, n_sessions, session_rate);
+
+	if (endpoints.empty())
+	{
+		endpoint_t e = { host, port };
+		endpoints.push_back(e);
+	}
 
 	std::cout << "Verifying that the NBD server does not contain any data..." << std::endl;
-	connect_nbd = connect_nbd_v1;
-	if (verify_device_has_no_data(host, port) && ignore_has_data == false)
+	for(size_t index=0; index<endpoints.size(); index++)
 	{
-		std::cerr << "Aborted! (use -f to override this check)" << std::endl;
-		return 1;
+		if (verify_device_has_no_data(endpoints.at(index).host.c_str(), endpoints.at(index).port) && ignore_has_data == false)
+		{
+			std::cerr << "Aborted! (use -f to override this check)" << std::endl;
+			return 1;
+		}
 	}
 
 	USLEEP(useconds_t(sleep_duration * 1000000.0));
 
+	if (prefill_passes >= 0 && nbd_prefill(endpoints, prefill_passes))
+	{
+		std::cerr << "Preconditioning failed" << std::endl;
+		return 1;
+	}
+
+	if (record_file && recorder_start(record_file))
+		return 1;
+
+	if ((metrics_shm || metrics_port) && metrics_start(metrics_shm, metrics_port))
+		return 1;
+
+	int rc = 1;
+
 	if (action == A_VERIFY)
-		return nbd_verify(host, port, sleep_duration, do_reconnect);
+		rc = nbd_verify(host, port, sleep_duration, do_reconnect, queue_depth, n_verifiers);
+	else if (action == A_IOPS)
+		rc = nbd_iops(host, port, dd_perc, do_writes, io_size, queue_depth, duration);
+	else if (action == A_LATENCY)
+		rc = nbd_latency(host, port, do_writes, duration, low_latency, cpu);
+	else if (action == A_ORDERING)
+		rc = nbd_ordering(host, port, n_sessions, queue_depth, duration, sleep_duration);
+	else if (action == A_REPLAY)
+		rc = nbd_replay(host, port, trace_file, queue_depth, replay_asap);
+	else if (action == A_FLEET)
+	{
+		load_config_t cfg = { n_sessions, queue_depth, io_size, do_writes, 0, false };
+
+		rc = nbd_fleet(endpoints, &cfg, duration);
+	}
+	else if (action == A_SWEEP)
+	{
+		load_config_t cfg = { 1, queue_depth, io_size, do_writes, 0, false };
+
+		rc = nbd_sweep(endpoints, &cfg, n_sessions, queue_depth);
+	}
+	else if (action == A_SLO)
+	{
+		load_config_t cfg = { n_sessions, queue_depth, io_size, do_writes, 0, false };
+
+		rc = nbd_slo(endpoints, &cfg, slo_ns, duration);
+	}
+	else if (action == A_SOAK)
+	{
+		load_config_t cfg = { n_sessions, queue_depth, io_size, do_writes, 0, false };
+
+		rc = nbd_soak(endpoints, &cfg, duration, timeline_file, drift / 100.0);
+	}
+	else if (action == A_UNALIGNED)
+		rc = nbd_unaligned(host, port, do_writes, queue_depth, duration);
+	else if (action == A_VISIBILITY)
+		rc = nbd_visibility(host, port, n_sessions, duration);
+	else if (action == A_SCAN)
+		rc = nbd_scan(host, port, do_writes, n_sessions, region_size, timeline_file);
+	else if (action == A_CACHE)
+	{
+		load_config_t cfg = { n_sessions, queue_depth, io_size, false, 0, false };
+
+		rc = nbd_cache(endpoints, &cfg, duration);
+	}
+
+	recorder_stop();
+
+	metrics_stop();
 
-	if (action == A_IOPS)
-		return nbd_iops(host, port, dd_perc, do_writes);
+	phase_print();
 
-	if (action == A_LATENCY)
-		return nbd_latency(host, port, do_writes);
+	slowest_print();
 
-	return 1;
+	return rc;
 }
@@ -1,22 +1,74 @@
+#include <algorithm>
 #include <errno.h>
 #include <iostream>
+#include <signal.h>
 #include <stdint.h>
 #include <string>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <sys/select.h>
+#include <sys/uio.h>
+#include <vector>
 
+#include "nbd.h"
 #include "utils-data.h"
 #include "utils-net.h"
+#include "utils-phase.h"
 #include "utils-str.h"
 #include "utils-time.h"
 
-extern int (*connect_nbd)(std::string host, int port, uint64_t *size, uint32_t *flags, bool verbose);
-
 double read_timeout = 5.0;
 
+uint32_t block_size_min = 1, block_size_preferred = 4096, block_size_max = 32 * 1024 * 1024;
+
+std::string export_name;
+
+// by default retry every 100ms, forever
+double connect_retry_delay = 0.1, connect_retry_max_delay = 0.1, connect_retry_jitter = 0.0;
+int connect_max_attempts = 0;
+
+__thread uint64_t n_timeouts = 0;
+
+bool busy_poll = false;
+
+// spin on non-blocking receives instead of sleeping in select()
+int spin_for_data(int fd)
+{
+	uint64_t deadline = get_ns() + uint64_t(read_timeout * 1000000000.0);
+
+	for(uint64_t loop=1;; loop++)
+	{
+		ssize_t rc = rx_poll(fd);
+
+		// data or EOF: the read that follows handles it
+		if (rc >= 0)
+			return 0;
+
+		if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+		{
+			std::cerr << "recv() failed because of " << strerror(errno) << std::endl;
+			return -1;
+		}
+
+		if ((loop & 1023) == 0 && get_ns() > deadline)
+		{
+			std::cerr << "timeout while waiting for ack from nbd-server: nbd-server hanging or not sending ack?" << std::endl;
+			n_timeouts++;
+			return -2;
+		}
+	}
+}
+
 int wait_for_data(int fd)
 {
+	// no need to wait if a previous read() already got it
+	if (buffered_bytes(fd))
+		return 0;
+
+	if (busy_poll)
+		return spin_for_data(fd);
+
 	for(;;)
 	{
 		fd_set rfds;
@@ -26,6 +78,7 @@ int wait_for_data(int fd)
 		struct timeval tv = { time_t(read_timeout), suseconds_t((read_timeout - int(read_timeout)) * 1000000) };
 
 		int rc = select(fd + 1, &rfds, NULL, NULL, &tv);
+		n_syscalls++;
 		if (rc == -1)
 		{
 			if (errno == EINTR)
@@ -38,6 +91,7 @@ int wait_for_data(int fd)
 		if (rc == 0)
 		{
 			std::cerr << "timeout while waiting for ack from nbd-server: nbd-server hanging or not sending ack?" << std::endl;
+			n_timeouts++;
 			return -2;
 		}
 
@@ -50,25 +104,116 @@ int wait_for_data(int fd)
 	return -1;
 }
 
-int connect_nbd_v1(std::string host, int port, uint64_t *size, uint32_t *flags, bool verbose)
+// for callers that have something else to do: 1 when data came in
+// within 'timeout' seconds, 0 if not
+int data_pending_nbd(int fd, double timeout)
 {
-	int fd = -1;
+	if (buffered_bytes(fd))
+		return 1;
 
-	*flags = -1;
-	*size = -1;
+	fd_set rfds;
+	FD_ZERO(&rfds);
+	FD_SET(fd, &rfds);
+
+	struct timeval tv = { time_t(timeout), suseconds_t((timeout - int(timeout)) * 1000000) };
+
+	int rc = select(fd + 1, &rfds, NULL, NULL, &tv);
+	n_syscalls++;
+	if (rc == -1)
+	{
+		if (errno == EINTR)
+			return 0;
+
+		std::cerr << "select() failed because of " << strerror(errno) << std::endl;
+		return -1;
+	}
+
+	return rc == 1 && FD_ISSET(fd, &rfds) ? 1 : 0;
+}
+
+// +/- connect_retry_jitter (fraction) of 'delay' so that clients that
+// lost their connection at the same moment do not all come back at once
+double backoff_jitter(double delay)
+{
+	static __thread unsigned short xsubi[3] = { 0, 0, 0 };
+
+	if (xsubi[0] == 0 && xsubi[1] == 0 && xsubi[2] == 0)
+	{
+		uint64_t seed = uint64_t(getpid()) ^ uint64_t(get_ts() * 1000000.0) ^ uint64_t(&xsubi);
+
+		xsubi[0] = seed | 1;
+		xsubi[1] = seed >> 16;
+		xsubi[2] = seed >> 32;
+	}
+
+	return delay * (1.0 + connect_retry_jitter * (erand48(xsubi) * 2.0 - 1.0));
+}
+
+// n_attempts (when not NULL) is set to the number of connect() calls it took,
+// attempt_ts (when not NULL) to when the last of them started
+int connect_retry(std::string host, int port, bool verbose, int *n_attempts, double *attempt_ts)
+{
+	int fd = -1;
+	double delay = connect_retry_delay;
 
 	if (verbose)
 		std::cout << "connecting to " << host << " " << port << std::endl;
 
-	for(;;)
+	for(int attempt=1;; attempt++)
 	{
+		if (attempt_ts)
+			*attempt_ts = get_ts();
+
 		fd = connect_to(host, port);
+
+		if (n_attempts)
+			*n_attempts = attempt;
+
 		if (fd != -1)
 			break;
 
-		USLEEP(100000);
+		if (connect_max_attempts > 0 && attempt >= connect_max_attempts)
+		{
+			std::cerr << "giving up connecting to " << host << " " << port << " after " << attempt << " attempts" << std::endl;
+			break;
+		}
+
+		USLEEP(useconds_t(backoff_jitter(delay) * 1000000.0));
+
+		delay = std::min(delay * 2.0, connect_retry_max_delay);
 	}
 
+	return fd;
+}
+
+void print_flags(uint32_t flags)
+{
+	if (flags)
+		std::cout << "Flags:" << std::endl;
+	if (flags & 1)
+		std::cout << "\thas flags" << std::endl;
+	if (flags & 2)
+		std::cout << "\tis R/O" << std::endl;
+	if (flags & 4)
+		std::cout << "\tsupports flush" << std::endl;
+	if (flags & 8)
+		std::cout << "\tsupports fua" << std::endl;
+	if (flags & 16)
+		std::cout << "\tis rotational media" << std::endl;
+	if (flags & 32)
+		std::cout << "\tsupports trim" << std::endl;
+}
+
+// magic_ts (when not NULL) is set to the moment NBDMAGIC came in
+int handshake_nbd_v1(int fd, uint64_t *size, uint32_t *flags, bool verbose, double *magic_ts)
+{
+	*flags = -1;
+	*size = -1;
+
+	block_size_min = 1;
+	block_size_preferred = 4096;
+	block_size_max = 32 * 1024 * 1024;
+
 	if (wait_for_data(fd))
 	{
 		std::cerr << "timeout waiting for password" << std::endl;
@@ -77,17 +222,18 @@ int connect_nbd_v1(std::string host, int port, uint64_t *size, uint32_t *flags,
 
 	int rc = -1;
 	char password[8 + 1] = { 0 };
-	if ((rc = READ(fd, (unsigned char *)password, 8)) != 8)
+	if ((rc = READ_BUFFERED(fd, (unsigned char *)password, 8)) != 8)
 	{
 		std::cerr << "read error waiting for password (" << rc << " bytes out of 8 received)" << std::endl;
-		close(fd);
 		return -1;
 	}
 
+	if (magic_ts)
+		*magic_ts = get_ts();
+
 	if (strcmp(password, "NBDMAGIC"))
 	{
 		std::cerr << "password mismatch " << password << std::endl;
-		close(fd);
 		return -1;
 	}
 
@@ -99,17 +245,21 @@ int connect_nbd_v1(std::string host, int port, uint64_t *size, uint32_t *flags,
 
 	unsigned char magic[8] = { 0 };
 	unsigned char oldstyle_magic[8] = { 0x00, 0x00, 0x42, 0x02, 0x81, 0x86, 0x12, 0x53 };
-	if ((rc = READ(fd, magic, 8)) != 8)
+	if ((rc = READ_BUFFERED(fd, magic, 8)) != 8)
 	{
 		std::cerr << "read error waiting for magic (" << rc << " bytes out of 8 received)" << std::endl;
-		close(fd);
+		return -1;
+	}
+
+	if (memcmp(magic, "IHAVEOPT", 8) == 0)
+	{
+		std::cerr << "server uses newstyle negotiation (select an export with -N)" << std::endl;
 		return -1;
 	}
 
 	if (memcmp(magic, oldstyle_magic, 8))
 	{
 		std::cerr << "magic mismatch " << std::endl;
-		close(fd);
 		return -1;
 	}
 
@@ -120,10 +270,9 @@ int connect_nbd_v1(std::string host, int port, uint64_t *size, uint32_t *flags,
 	}
 
 	unsigned char size_in[8] = { 0 };
-	if ((rc = READ(fd, size_in, 8)) != 8)
+	if ((rc = READ_BUFFERED(fd, size_in, 8)) != 8)
 	{
 		std::cerr << "read error waiting for size (" << rc << " bytes out of 8 received)" << std::endl;
-		close(fd);
 		return -1;
 	}
 
@@ -135,7 +284,6 @@ int connect_nbd_v1(std::string host, int port, uint64_t *size, uint32_t *flags,
 	if (*size < 512)
 	{
 		std::cerr << "strange device size" << std::endl;
-		close(fd);
 		return -1;
 	}
 
@@ -146,37 +294,20 @@ int connect_nbd_v1(std::string host, int port, uint64_t *size, uint32_t *flags,
 	}
 
 	unsigned char flags_in[4] = { 0 };
-	if ((rc = READ(fd, flags_in, 4)) != 4)
+	if ((rc = READ_BUFFERED(fd, flags_in, 4)) != 4)
 	{
 		std::cerr << "read error waiting for flags (" << rc << " bytes out of 4 received)" << std::endl;
-		close(fd);
 		return -1;
 	}
 
 	*flags = bytes_to_u32(flags_in);
 
 	if (verbose)
-	{
-		if (*flags)
-			std::cout << "Flags:" << std::endl;
-		if (*flags & 1)
-			std::cout << "\thas flags" << std::endl;
-		if (*flags & 2)
-			std::cout << "\tis R/O" << std::endl;
-		if (*flags & 4)
-			std::cout << "\tsupports flush" << std::endl;
-		if (*flags & 8)
-			std::cout << "\tsupports fua" << std::endl;
-		if (*flags & 16)
-			std::cout << "\tis rotational media" << std::endl;
-		if (*flags & 32)
-			std::cout << "\tsupports trim" << std::endl;
-	}
+		print_flags(*flags);
 
 	if (*flags >= 0x40 || ((*flags & 1) == 0 && *flags > 0))
 	{
 		std::cerr << "invalid value for flags " << format("%04x", flags) << std::endl;
-		close(fd);
 		return -1;
 	}
 
@@ -187,10 +318,9 @@ int connect_nbd_v1(std::string host, int port, uint64_t *size, uint32_t *flags,
 	}
 
 	unsigned char filler[124] = { 0 };
-	if ((rc = READ(fd, filler, sizeof filler)) != sizeof filler)
+	if ((rc = READ_BUFFERED(fd, filler, sizeof filler)) != sizeof filler)
 	{
 		std::cerr << "read error waiting for filler (" << rc << " bytes out of " << sizeof filler << " received)" << std::endl;
-		close(fd);
 		return -1;
 	}
 
@@ -199,23 +329,460 @@ int connect_nbd_v1(std::string host, int port, uint64_t *size, uint32_t *flags,
 		if (filler[index])
 		{
 			std::cerr << "encountered != 0 value in filler " << format("%02x", filler[index]) << std::endl;
-			close(fd);
 			return -1;
 		}
 	}
 
+	return 0;
+}
+
+int connect_nbd_v1(std::string host, int port, uint64_t *size, uint32_t *flags, bool verbose)
+{
+	int fd = connect_retry(host, port, verbose, NULL, NULL);
+	if (fd == -1)
+		return -1;
+
+	if (handshake_nbd_v1(fd, size, flags, verbose, NULL))
+	{
+		CLOSE(fd);
+		return -1;
+	}
+
 	return fd;
 }
 
-int send_command_nbd(int fd, uint32_t type, uint64_t handle, uint64_t offset, uint32_t len)
+int send_option_nbd(int fd, uint32_t option, const unsigned char *data, uint32_t len)
+{
+	unsigned char hdr[16] = { 0 };
+
+	memcpy(&hdr[0], "IHAVEOPT", 8);
+	u32_to_bytes(&hdr[8], option);
+	u32_to_bytes(&hdr[12], len);
+
+	if (WRITE(fd, (const char *)hdr, sizeof hdr) != sizeof hdr)
+	{
+		std::cerr << "short write sending option header" << std::endl;
+		return -1;
+	}
+
+	if (len > 0 && WRITE(fd, (const char *)data, len) != (ssize_t)len)
+	{
+		std::cerr << "short write sending option data" << std::endl;
+		return -1;
+	}
+
+	return 0;
+}
+
+// returns the reply type, the reply data is stored in 'data'
+// (which is allocated and must be freed by the caller)
+int64_t receive_option_reply_nbd(int fd, uint32_t option, unsigned char **data, uint32_t *len)
+{
+	*data = NULL;
+	*len = 0;
+
+	if (wait_for_data(fd))
+	{
+		std::cerr << "timeout waiting for option reply" << std::endl;
+		return -1;
+	}
+
+	int rc = -1;
+	unsigned char hdr[20] = { 0 };
+	if ((rc = READ_BUFFERED(fd, hdr, sizeof hdr)) != sizeof hdr)
+	{
+		std::cerr << "read error waiting for option reply (" << rc << " bytes out of " << sizeof hdr << " received)" << std::endl;
+		return -1;
+	}
+
+	if (bytes_to_u64(&hdr[0]) != 0x3e889045565a9ll)
+	{
+		std::cerr << "option reply magic mismatch" << std::endl;
+		return -1;
+	}
+
+	if (bytes_to_u32(&hdr[8]) != option)
+	{
+		std::cerr << "reply for option " << bytes_to_u32(&hdr[8]) << " while expecting one for " << option << std::endl;
+		return -1;
+	}
+
+	*len = bytes_to_u32(&hdr[16]);
+
+	if (*len > 16 * 1024 * 1024)
+	{
+		std::cerr << "option reply too large (" << *len << " bytes)" << std::endl;
+		return -1;
+	}
+
+	// always allocate (and 0-terminate) so that string replies can be printed as-is
+	*data = (unsigned char *)calloc(1, *len + 1);
+
+	if (*len > 0)
+	{
+		if (wait_for_data(fd))
+		{
+			std::cerr << "timeout waiting for option reply data" << std::endl;
+			free(*data);
+			*data = NULL;
+			return -1;
+		}
+
+		if ((rc = READ_BUFFERED(fd, *data, *len)) != (ssize_t)*len)
+		{
+			std::cerr << "read error waiting for option reply data (" << rc << " bytes out of " << *len << " received)" << std::endl;
+			free(*data);
+			*data = NULL;
+			return -1;
+		}
+	}
+
+	return bytes_to_u32(&hdr[12]);
+}
+
+// NBDMAGIC, IHAVEOPT, handshake flags and the client flags
+int handshake_newstyle_nbd(int fd, bool *fixed, bool *no_zeroes, double *magic_ts)
+{
+	if (wait_for_data(fd))
+	{
+		std::cerr << "timeout waiting for password" << std::endl;
+		return -1;
+	}
+
+	int rc = -1;
+	unsigned char hello[18] = { 0 };
+	if ((rc = READ_BUFFERED(fd, hello, sizeof hello)) != sizeof hello)
+	{
+		std::cerr << "read error waiting for newstyle greeting (" << rc << " bytes out of " << sizeof hello << " received)" << std::endl;
+		return -1;
+	}
+
+	if (magic_ts)
+		*magic_ts = get_ts();
+
+	if (memcmp(&hello[0], "NBDMAGIC", 8))
+	{
+		std::cerr << "password mismatch" << std::endl;
+		return -1;
+	}
+
+	if (memcmp(&hello[8], "IHAVEOPT", 8))
+	{
+		std::cerr << "server does not do newstyle negotiation (leave out -N)" << std::endl;
+		return -1;
+	}
+
+	uint16_t hs_flags = bytes_to_u16(&hello[16]);
+
+	*fixed = hs_flags & NBD_FLAG_FIXED_NEWSTYLE;
+	*no_zeroes = hs_flags & NBD_FLAG_NO_ZEROES;
+
+	unsigned char client_flags[4] = { 0 };
+	u32_to_bytes(client_flags, (*fixed ? NBD_FLAG_FIXED_NEWSTYLE : 0) | (*no_zeroes ? NBD_FLAG_NO_ZEROES : 0));
+
+	if (WRITE(fd, (const char *)client_flags, sizeof client_flags) != sizeof client_flags)
+	{
+		std::cerr << "short write sending client flags" << std::endl;
+		return -1;
+	}
+
+	return 0;
+}
+
+// NBD_OPT_INFO or NBD_OPT_GO for 'name', asking for the block size constraints
+// returns NBD_REP_ACK, NBD_REP_ERR_UNSUP or -1
+int64_t export_info_nbd(int fd, uint32_t option, std::string name, uint64_t *size, uint32_t *flags, uint32_t *bs_min, uint32_t *bs_pref, uint32_t *bs_max)
+{
+	uint32_t len = 4 + name.size() + 2 + 2;
+	unsigned char *req = (unsigned char *)malloc(len);
+
+	u32_to_bytes(&req[0], name.size());
+	memcpy(&req[4], name.c_str(), name.size());
+	u16_to_bytes(&req[4 + name.size()], 1);
+	u16_to_bytes(&req[4 + name.size() + 2], NBD_INFO_BLOCK_SIZE);
+
+	int rc = send_option_nbd(fd, option, req, len);
+	free(req);
+
+	if (rc)
+		return -1;
+
+	bool got_export = false;
+
+	for(;;)
+	{
+		unsigned char *data = NULL;
+		uint32_t data_len = 0;
+
+		int64_t type = receive_option_reply_nbd(fd, option, &data, &data_len);
+		if (type == -1)
+			return -1;
+
+		if (type == NBD_REP_ACK)
+		{
+			free(data);
+
+			if (!got_export)
+			{
+				std::cerr << "server did not send NBD_INFO_EXPORT" << std::endl;
+				return -1;
+			}
+
+			return type;
+		}
+
+		if (type == NBD_REP_ERR_UNSUP)
+		{
+			free(data);
+			return type;
+		}
+
+		if (type & NBD_REP_FLAG_ERROR)
+		{
+			std::cerr << "server refused export \"" << name << "\": " << format("%08x", uint32_t(type)) << " " << (const char *)data << std::endl;
+			free(data);
+			return -1;
+		}
+
+		if (type != NBD_REP_INFO || data_len < 2)
+		{
+			free(data);
+			continue;
+		}
+
+		uint16_t info = bytes_to_u16(&data[0]);
+
+		if (info == NBD_INFO_EXPORT && data_len >= 12)
+		{
+			*size = bytes_to_u64(&data[2]);
+			*flags = bytes_to_u16(&data[10]);
+			got_export = true;
+		}
+		else if (info == NBD_INFO_BLOCK_SIZE && data_len >= 14)
+		{
+			*bs_min = bytes_to_u32(&data[2]);
+			*bs_pref = bytes_to_u32(&data[6]);
+			*bs_max = bytes_to_u32(&data[10]);
+		}
+
+		free(data);
+	}
+}
+
+int export_name_nbd(int fd, std::string name, bool no_zeroes, uint64_t *size, uint32_t *flags)
+{
+	if (send_option_nbd(fd, NBD_OPT_EXPORT_NAME, (const unsigned char *)name.c_str(), name.size()))
+		return -1;
+
+	if (wait_for_data(fd))
+	{
+		std::cerr << "timeout waiting for export details" << std::endl;
+		return -1;
+	}
+
+	int rc = -1;
+	unsigned char details[8 + 2 + 124] = { 0 };
+	size_t details_len = no_zeroes ? 8 + 2 : sizeof details;
+	if ((rc = READ_BUFFERED(fd, details, details_len)) != (ssize_t)details_len)
+	{
+		std::cerr << "read error waiting for export details (" << rc << " bytes out of " << details_len << " received; does export \"" << name << "\" exist?)" << std::endl;
+		return -1;
+	}
+
+	*size = bytes_to_u64(&details[0]);
+	*flags = bytes_to_u16(&details[8]);
+
+	return 0;
+}
+
+int handshake_nbd_v2(int fd, uint64_t *size, uint32_t *flags, bool verbose, double *magic_ts)
+{
+	*flags = -1;
+	*size = -1;
+
+	block_size_min = 1;
+	block_size_preferred = 4096;
+	block_size_max = 32 * 1024 * 1024;
+
+	bool fixed = false, no_zeroes = false;
+	if (handshake_newstyle_nbd(fd, &fixed, &no_zeroes, magic_ts))
+		return -1;
+
+	int64_t rc = NBD_REP_ERR_UNSUP;
+
+	if (fixed)
+		rc = export_info_nbd(fd, NBD_OPT_GO, export_name, size, flags, &block_size_min, &block_size_preferred, &block_size_max);
+	else if (verbose)
+		std::cout << "server does not support fixed newstyle negotiation" << std::endl;
+
+	if (rc == NBD_REP_ERR_UNSUP)
+	{
+		if (verbose && fixed)
+			std::cout << "server does not support NBD_OPT_GO, falling back to NBD_OPT_EXPORT_NAME" << std::endl;
+
+		rc = export_name_nbd(fd, export_name, no_zeroes, size, flags) == 0 ? NBD_REP_ACK : -1;
+	}
+
+	if (rc != NBD_REP_ACK)
+	{
+		return -1;
+	}
+
+	if (verbose)
+	{
+		std::cout << "export: \"" << export_name << "\"" << std::endl;
+		std::cout << "device size: " << *size << std::endl;
+		std::cout << "block sizes: minimum " << block_size_min << ", preferred " << block_size_preferred << ", maximum " << block_size_max << std::endl;
+
+		print_flags(*flags);
+	}
+
+	if (*size < 512)
+	{
+		std::cerr << "strange device size" << std::endl;
+		return -1;
+	}
+
+	if ((*flags & 1) == 0)
+	{
+		std::cerr << "invalid value for flags " << format("%04x", *flags) << std::endl;
+		return -1;
+	}
+
+	if (block_size_min == 0 || block_size_preferred < block_size_min || block_size_max < block_size_preferred)
+	{
+		std::cerr << "server advertises inconsistent block sizes" << std::endl;
+		return -1;
+	}
+
+	return 0;
+}
+
+int connect_nbd_v2(std::string host, int port, uint64_t *size, uint32_t *flags, bool verbose)
+{
+	int fd = connect_retry(host, port, verbose, NULL, NULL);
+	if (fd == -1)
+		return -1;
+
+	if (handshake_nbd_v2(fd, size, flags, verbose, NULL))
+	{
+		CLOSE(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+int list_exports_nbd(std::string host, int port)
 {
-	unsigned char cmd[28] = { 0 };
+	int fd = connect_retry(host, port, true, NULL, NULL);
+	if (fd == -1)
+		return -1;
+
+	bool fixed = false, no_zeroes = false;
+	if (handshake_newstyle_nbd(fd, &fixed, &no_zeroes, NULL))
+	{
+		CLOSE(fd);
+		return -1;
+	}
+
+	if (!fixed)
+	{
+		std::cerr << "server does not support fixed newstyle negotiation: cannot list exports" << std::endl;
+		CLOSE(fd);
+		return -1;
+	}
+
+	if (send_option_nbd(fd, NBD_OPT_LIST, NULL, 0))
+	{
+		CLOSE(fd);
+		return -1;
+	}
+
+	std::vector<std::string> names;
+
+	for(;;)
+	{
+		unsigned char *data = NULL;
+		uint32_t data_len = 0;
+
+		int64_t type = receive_option_reply_nbd(fd, NBD_OPT_LIST, &data, &data_len);
+		if (type == -1)
+		{
+			CLOSE(fd);
+			return -1;
+		}
 
+		if (type == NBD_REP_SERVER && data_len >= 4)
+		{
+			uint32_t name_len = bytes_to_u32(&data[0]);
+
+			if (name_len <= data_len - 4)
+				names.push_back(std::string((const char *)&data[4], name_len));
+		}
+
+		free(data);
+
+		if (type == NBD_REP_ACK)
+			break;
+
+		if (type & NBD_REP_FLAG_ERROR)
+		{
+			std::cerr << "server refused to list exports: " << format("%08x", uint32_t(type)) << std::endl;
+			CLOSE(fd);
+			return -1;
+		}
+	}
+
+	std::cout << names.size() << " export(s):" << std::endl;
+
+	for(size_t index=0; index<names.size(); index++)
+	{
+		uint64_t size = 0;
+		uint32_t flags = 0, bs_min = 1, bs_pref = 4096, bs_max = 32 * 1024 * 1024;
+
+		std::cout << "\"" << names.at(index) << "\"";
+
+		int64_t rc = export_info_nbd(fd, NBD_OPT_INFO, names.at(index), &size, &flags, &bs_min, &bs_pref, &bs_max);
+
+		if (rc == NBD_REP_ACK)
+			std::cout << format(": %llu bytes, flags %04x, block sizes %u/%u/%u (min/preferred/max)", (unsigned long long)size, flags, bs_min, bs_pref, bs_max);
+		else if (rc == -1)
+		{
+			CLOSE(fd);
+			return -1;
+		}
+
+		std::cout << std::endl;
+	}
+
+	send_option_nbd(fd, NBD_OPT_ABORT, NULL, 0);
+
+	CLOSE(fd);
+
+	return 0;
+}
+
+// the 28 byte request header
+void encode_request_nbd(unsigned char *cmd, uint32_t type, uint64_t handle, uint64_t offset, uint32_t len)
+{
 	u32_to_bytes(&cmd[0], 0x25609513);
 	u32_to_bytes(&cmd[4], type);
 	memcpy(&cmd[8], &handle, 8);
 	u64_to_bytes(&cmd[16], offset);
 	u32_to_bytes(&cmd[24], len);
+}
+
+int send_command_nbd(int fd, uint32_t type, uint64_t handle, uint64_t offset, uint32_t len)
+{
+	uint64_t phase_ns = phase_start();
+
+	unsigned char cmd[28];
+
+	encode_request_nbd(cmd, type, handle, offset, len);
+
+	phase_end(PH_BUILD, phase_ns);
+	phase_ns = phase_start();
 
 	if (WRITE(fd, (const char *)cmd, sizeof cmd) != sizeof cmd)
 	{
@@ -223,11 +790,15 @@ int send_command_nbd(int fd, uint32_t type, uint64_t handle, uint64_t offset, ui
 		return -1;
 	}
 
+	phase_end(PH_SEND, phase_ns);
+
 	return 0;
 }
 
 uint32_t verify_ack(int fd, off64_t handle)
 {
+	uint64_t phase_ns = phase_start();
+
 	if (wait_for_data(fd))
 	{
 		std::cerr << "timeout waiting for ack" << std::endl;
@@ -237,12 +808,14 @@ uint32_t verify_ack(int fd, off64_t handle)
 	int rc = -1;
 
 	unsigned char ack[16] = { 0 };
-	if ((rc = READ(fd, ack, sizeof ack)) != sizeof ack)
+	if ((rc = READ_BUFFERED(fd, ack, sizeof ack)) != sizeof ack)
 	{
 		std::cerr << "short read during ack retrieval (" << rc << " bytes out of " << sizeof ack << " received)" << std::endl;
 		return -1;
 	}
 
+	phase_end(PH_WAIT, phase_ns);
+
 	uint32_t magic_expected = 0x67446698;
 	uint32_t magic = bytes_to_u32(&ack[0]);
 	if (magic != 0x67446698)
@@ -266,21 +839,194 @@ uint32_t verify_ack(int fd, off64_t handle)
 	return bytes_to_u32(&ack[4]);
 }
 
-uint32_t write_nbd(int fd, off64_t offset, const char *data, size_t len)
+const char *nbd_cmd_name(uint32_t type)
 {
-	uint64_t handle;
+	switch(type)
+	{
+		case 0:
+			return "read";
+		case 1:
+			return "write";
+		case 3:
+			return "flush";
+		case 4:
+			return "trim";
+	}
 
-	get_random_bytes((unsigned char *)&handle, sizeof handle);
+	return "?";
+}
+
+// header and (for writes) payload in one system call
+int send_request_nbd(int fd, uint32_t type, uint64_t handle, uint64_t offset, const char *data, uint32_t len)
+{
+	uint64_t phase_ns = phase_start();
+
+	unsigned char cmd[28];
+
+	encode_request_nbd(cmd, type, handle, offset, len);
+
+	phase_end(PH_BUILD, phase_ns);
+	phase_ns = phase_start();
+
+	struct iovec iov[2] = { { cmd, sizeof cmd }, { (void *)data, data ? len : 0 } };
+	ssize_t total = sizeof cmd + iov[1].iov_len;
+
+	if (WRITEV(fd, iov, iov[1].iov_len ? 2 : 1) != total)
+	{
+		std::cerr << "short write sending request" << std::endl;
+		return -1;
+	}
+
+	phase_end(PH_SEND, phase_ns);
+
+	return 0;
+}
+
+// for pipelined requests: wait for the next reply header, whichever
+// request it is for. The payload of a read is left for the caller.
+int receive_reply_nbd(int fd, uint64_t *handle, uint32_t *error)
+{
+	uint64_t phase_ns = phase_start();
 
-	if (send_command_nbd(fd, 1, handle, offset, len) == -1)
+	if (wait_for_data(fd))
+	{
+		std::cerr << "timeout waiting for reply" << std::endl;
 		return -1;
+	}
 
-	if (len > 0 && WRITE(fd, data, len) != (ssize_t)len)
+	int rc = -1;
+
+	unsigned char ack[16] = { 0 };
+	if ((rc = READ_BUFFERED(fd, ack, sizeof ack)) != sizeof ack)
 	{
-		std::cerr << "short write sending data for write-command" << std::endl;
+		std::cerr << "short read during reply retrieval (" << rc << " bytes out of " << sizeof ack << " received)" << std::endl;
 		return -1;
 	}
 
+	phase_end(PH_WAIT, phase_ns);
+
+	uint32_t magic = bytes_to_u32(&ack[0]);
+	if (magic != 0x67446698)
+	{
+		std::cerr << "reply magic wrong " << format("%08x", magic) << " (expected: 67446698)" << std::endl;
+		return -1;
+	}
+
+	*error = bytes_to_u32(&ack[4]);
+	memcpy(handle, &ack[8], 8);
+
+	return 0;
+}
+
+pipeline_t *pipeline_create(int fd, int queue_depth)
+{
+	pipeline_t *p = (pipeline_t *)malloc(sizeof(pipeline_t));
+
+	p -> fd = fd;
+	p -> queue_depth = queue_depth;
+	p -> in_flight = 0;
+
+	p -> free_slots = (int *)malloc(sizeof(int) * queue_depth);
+	p -> type = (uint32_t *)calloc(queue_depth, sizeof(uint32_t));
+	p -> len = (uint32_t *)calloc(queue_depth, sizeof(uint32_t));
+	p -> offset = (uint64_t *)calloc(queue_depth, sizeof(uint64_t));
+	p -> submit_ns = (uint64_t *)calloc(queue_depth, sizeof(uint64_t));
+	p -> data = (char **)calloc(queue_depth, sizeof(char *));
+	p -> in_flight_at_submit = (int *)calloc(queue_depth, sizeof(int));
+
+	// slot 0 goes out first
+	for(int index=0; index<queue_depth; index++)
+		p -> free_slots[index] = queue_depth - 1 - index;
+
+	p -> n_free = queue_depth;
+
+	return p;
+}
+
+void pipeline_free(pipeline_t *p)
+{
+	free(p -> in_flight_at_submit);
+	free(p -> data);
+	free(p -> submit_ns);
+	free(p -> offset);
+	free(p -> len);
+	free(p -> type);
+	free(p -> free_slots);
+
+	free(p);
+}
+
+int pipeline_next_slot(const pipeline_t *p)
+{
+	return p -> free_slots[p -> n_free - 1];
+}
+
+int pipeline_send(pipeline_t *p, uint32_t type, uint64_t offset, char *data, uint32_t len)
+{
+	int slot = p -> free_slots[--p -> n_free];
+
+	p -> type[slot] = type;
+	p -> len[slot] = len;
+	p -> offset[slot] = offset;
+	p -> data[slot] = data;
+	p -> submit_ns[slot] = get_ns();
+
+	if (send_request_nbd(p -> fd, type, slot, offset, (type & 0xffff) == 1 ? data : NULL, len))
+	{
+		p -> n_free++;
+		return -1;
+	}
+
+	p -> in_flight++;
+	p -> in_flight_at_submit[slot] = p -> in_flight;
+
+	return slot;
+}
+
+int pipeline_receive(pipeline_t *p, int *slot, uint32_t *error)
+{
+	uint64_t handle = -1;
+
+	if (receive_reply_nbd(p -> fd, &handle, error))
+		return -1;
+
+	if (handle >= uint64_t(p -> queue_depth))
+	{
+		std::cerr << "reply for unknown handle " << handle << std::endl;
+		return -1;
+	}
+
+	*slot = handle;
+
+	// an error reply has no payload
+	if (*error == 0 && (p -> type[handle] & 0xffff) == 0)
+	{
+		uint64_t phase_ns = phase_start();
+
+		if (READ_BUFFERED(p -> fd, (unsigned char *)p -> data[handle], p -> len[handle]) != ssize_t(p -> len[handle]))
+		{
+			std::cerr << "short read retrieving data for read-command" << std::endl;
+			return -1;
+		}
+
+		phase_end(PH_PAYLOAD, phase_ns);
+	}
+
+	p -> in_flight--;
+	p -> free_slots[p -> n_free++] = handle;
+
+	return 0;
+}
+
+uint32_t write_nbd(int fd, off64_t offset, const char *data, size_t len)
+{
+	uint64_t handle;
+
+	get_random_bytes((unsigned char *)&handle, sizeof handle);
+
+	if (send_request_nbd(fd, 1, handle, offset, data, len) == -1)
+		return -1;
+
 	uint32_t rc = verify_ack(fd, handle);
 
 	return rc;
@@ -299,17 +1045,21 @@ uint32_t read_nbd(int fd, off64_t offset, char *data, size_t len)
 
 	if (len > 0)
 	{
+		uint64_t phase_ns = phase_start();
+
 		if (wait_for_data(fd))
 		{
 			std::cerr << "timeout waiting for data for read-command" << std::endl;
 			return -1;
 		}
 
-		if (READ(fd, (unsigned char *)data, len) != (ssize_t)len)
+		if (READ_BUFFERED(fd, (unsigned char *)data, len) != (ssize_t)len)
 		{
 			std::cerr << "short read retrieving data for read-command" << std::endl;
 			return -1;
 		}
+
+		phase_end(PH_PAYLOAD, phase_ns);
 	}
 
 	return rc;
@@ -327,7 +1077,7 @@ int close_nbd(int fd)
 	// FIXME wait for an ack?
 	// reference implementation does not send it
 
-	close(fd);
+	CLOSE(fd);
 
 	return 0;
 }
@@ -1,11 +1,101 @@
+// handshake: option haggling (fixed newstyle)
+#define NBD_OPT_EXPORT_NAME	1
+#define NBD_OPT_ABORT		2
+#define NBD_OPT_LIST		3
+#define NBD_OPT_INFO		6
+#define NBD_OPT_GO		7
+
+#define NBD_REP_ACK		1
+#define NBD_REP_SERVER		2
+#define NBD_REP_INFO		3
+#define NBD_REP_FLAG_ERROR	0x80000000
+#define NBD_REP_ERR_UNSUP	(NBD_REP_FLAG_ERROR | 1)
+
+#define NBD_INFO_EXPORT		0
+#define NBD_INFO_NAME		1
+#define NBD_INFO_DESCRIPTION	2
+#define NBD_INFO_BLOCK_SIZE	3
+
+#define NBD_FLAG_FIXED_NEWSTYLE	1
+#define NBD_FLAG_NO_ZEROES	2
+
+// block size constraints of the export; set by connect_nbd
+// (defaults as described by the INFO extension when the server
+// does not advertise them)
+extern uint32_t block_size_min, block_size_preferred, block_size_max;
+
+// export to select with NBD_OPT_GO (newstyle only)
+extern std::string export_name;
+
 extern double read_timeout;
 
+// spin instead of sleeping while waiting for data
+extern bool busy_poll;
+
+// back-off between connect attempts: starts at connect_retry_delay and
+// doubles up to connect_retry_max_delay, each +/- connect_retry_jitter
+// (fraction); connect_max_attempts 0 retries forever
+extern double connect_retry_delay, connect_retry_max_delay, connect_retry_jitter;
+extern int connect_max_attempts;
+
+// number of times wait_for_data() timed out (in this thread)
+extern __thread uint64_t n_timeouts;
+
+double backoff_jitter(double delay);
+int connect_retry(std::string host, int port, bool verbose, int *n_attempts, double *attempt_ts);
+
+// handshake on a connected socket
+int handshake_nbd_v1(int fd, uint64_t *size, uint32_t *flags, bool verbose, double *magic_ts);
+int handshake_nbd_v2(int fd, uint64_t *size, uint32_t *flags, bool verbose, double *magic_ts);
+
 // connect and do handshake
 int connect_nbd_v1(std::string host, int port, uint64_t *size, uint32_t *flags, bool verbose);
+int connect_nbd_v2(std::string host, int port, uint64_t *size, uint32_t *flags, bool verbose);
+
+// one of the two above, selected on the command line (defined in main.cpp)
+extern int (*connect_nbd)(std::string host, int port, uint64_t *size, uint32_t *flags, bool verbose);
 
+int list_exports_nbd(std::string host, int port);
+
+void encode_request_nbd(unsigned char *cmd, uint32_t type, uint64_t handle, uint64_t offset, uint32_t len);
 int send_command_nbd(int fd, uint32_t type, uint64_t handle, uint64_t offset, uint32_t len);
 uint32_t verify_ack(int fd, off64_t handle);
 
+// pipelining: send requests, then collect the replies in any order
+int send_request_nbd(int fd, uint32_t type, uint64_t handle, uint64_t offset, const char *data, uint32_t len);
+int receive_reply_nbd(int fd, uint64_t *handle, uint32_t *error);
+int data_pending_nbd(int fd, double timeout);
+
+// a session with up to queue_depth requests in flight, the slot of a
+// request is its handle. What was sent is kept per slot until the reply
+// is in; the payload of a read that succeeded goes to the buffer that
+// was given when sending it.
+typedef struct
+{
+	int fd, queue_depth;
+	int in_flight;
+	int *free_slots, n_free;
+
+	// per slot
+	uint32_t *type, *len;
+	uint64_t *offset, *submit_ns;
+	char **data;
+	// requests in flight when the slot was sent (itself included)
+	int *in_flight_at_submit;
+} pipeline_t;
+
+pipeline_t *pipeline_create(int fd, int queue_depth);
+void pipeline_free(pipeline_t *p);
+// the slot that the next pipeline_send() uses (only when n_free > 0)
+int pipeline_next_slot(const pipeline_t *p);
+// data is sent for a write, filled for a read; the slot or -1
+int pipeline_send(pipeline_t *p, uint32_t type, uint64_t offset, char *data, uint32_t len);
+// waits for the next reply; what was sent stays in the slot until it is used again
+int pipeline_receive(pipeline_t *p, int *slot, uint32_t *error);
+
+// "read", "write", "flush", "trim" or "?"
+const char *nbd_cmd_name(uint32_t type);
+
 uint32_t write_nbd(int fd, off64_t offset, const char *data, size_t len);
 uint32_t read_nbd(int fd, off64_t offset, char *data, size_t len);
 
@@ -0,0 +1,477 @@
+#include <iostream>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <string.h>
+#include <unistd.h>
+#include <vector>
+
+#include "nbd.h"
+#include "ordering.h"
+#include "utils-data.h"
+#include "utils-hist.h"
+#include "utils-metrics.h"
+#include "utils-net.h"
+#include "utils-record.h"
+#include "utils-slowest.h"
+#include "utils-str.h"
+#include "utils-time.h"
+
+// few blocks so that the sessions overwrite each other all the time
+#define ORDERING_BLOCKS		64
+#define ORDERING_BLOCK_SIZE	4096
+
+// every other write is FUA, a flush after every ORDERING_FLUSH_EVERY writes
+#define ORDERING_FLUSH_EVERY	16
+
+#define ORDERING_MAGIC		0x4e42444f52444552ll // "NBDORDER"
+
+#define CMD_FLAG_FUA		(1 << 16)
+
+typedef struct
+{
+	uint64_t gen, block;
+	uint64_t submit_ns, ack_ns;
+	bool durable;
+} ordering_write_t;
+
+typedef struct
+{
+	int conn;
+	int fd;
+	int queue_depth;
+	bool fua, flush;
+	uint64_t deadline_ns;
+
+	std::vector<ordering_write_t> writes;
+	uint64_t n_fua, n_flushes;
+	bool failed;
+} ordering_session_t;
+
+volatile uint64_t ordering_gen = 0;
+
+// every 8 bytes of the block depend on block and generation: a torn or
+// misdirected write does not pass decode_block()
+void encode_block(unsigned char *p, uint64_t block, uint64_t gen, int conn)
+{
+	u64_to_bytes(&p[0], ORDERING_MAGIC);
+	u64_to_bytes(&p[8], block);
+	u64_to_bytes(&p[16], gen);
+	u64_to_bytes(&p[24], conn);
+
+	for(int index=4; index<ORDERING_BLOCK_SIZE / 8; index++)
+		u64_to_bytes(&p[index * 8], (gen * 0x9e3779b97f4a7c15ll) ^ (block << 20) ^ index);
+}
+
+bool decode_block(const unsigned char *p, uint64_t block, uint64_t *gen, int *conn)
+{
+	if (bytes_to_u64(&p[0]) != uint64_t(ORDERING_MAGIC) || bytes_to_u64(&p[8]) != block)
+		return false;
+
+	*gen = bytes_to_u64(&p[16]);
+	*conn = bytes_to_u64(&p[24]);
+
+	for(int index=4; index<ORDERING_BLOCK_SIZE / 8; index++)
+	{
+		if (bytes_to_u64(&p[index * 8]) != ((*gen * 0x9e3779b97f4a7c15ll) ^ (block << 20) ^ index))
+			return false;
+	}
+
+	return true;
+}
+
+void * ordering_thread(void *arg)
+{
+	ordering_session_t *os = (ordering_session_t *)arg;
+
+	// what each slot (= handle) is doing: index in 'writes', or -1 for a flush
+	std::vector<int64_t> slot_write(os -> queue_depth, -1);
+	std::vector<std::vector<uint64_t> > slot_covers(os -> queue_depth);
+	std::vector<uint64_t> slot_submit_ns(os -> queue_depth);
+	// requests in flight when the slot was sent (itself included)
+	std::vector<int> slot_in_flight(os -> queue_depth);
+
+	std::vector<int> free_slots;
+	for(int index=0; index<os -> queue_depth; index++)
+		free_slots.push_back(index);
+
+	// acknowledged writes that no flush was sent for yet
+	std::vector<uint64_t> unflushed;
+
+	// lrand48() is shared by all threads
+	unsigned short xsubi[3] = { 0x330e, (unsigned short)os -> conn, 0x1234 };
+
+	unsigned char *block = (unsigned char *)malloc(ORDERING_BLOCK_SIZE);
+	uint64_t n_since_flush = 0;
+	int in_flight = 0;
+
+	for(;;)
+	{
+		bool stopping = get_ns() >= os -> deadline_ns;
+
+		while(!stopping && !free_slots.empty())
+		{
+			int slot = free_slots.back();
+			free_slots.pop_back();
+
+			if (os -> flush && n_since_flush >= ORDERING_FLUSH_EVERY)
+			{
+				// covers what was answered before it is sent
+				slot_write[slot] = -1;
+				slot_covers[slot].swap(unflushed);
+				unflushed.clear();
+				slot_submit_ns[slot] = get_ns();
+
+				if (send_request_nbd(os -> fd, 3, slot, 0, NULL, 0))
+				{
+					os -> failed = true;
+					break;
+				}
+
+				os -> n_flushes++;
+				n_since_flush = 0;
+			}
+			else
+			{
+				ordering_write_t w;
+
+				w.gen = __atomic_add_fetch(&ordering_gen, 1, __ATOMIC_RELAXED);
+				w.block = nrand48(xsubi) % ORDERING_BLOCKS;
+				w.durable = false;
+
+				bool fua = os -> fua && (w.gen & 1);
+
+				encode_block(block, w.block, w.gen, os -> conn);
+
+				w.submit_ns = get_ns();
+				w.ack_ns = 0;
+
+				slot_write[slot] = os -> writes.size();
+				os -> writes.push_back(w);
+
+				if (send_request_nbd(os -> fd, 1 | (fua ? CMD_FLAG_FUA : 0), slot, w.block * ORDERING_BLOCK_SIZE, (const char *)block, ORDERING_BLOCK_SIZE))
+				{
+					os -> failed = true;
+					break;
+				}
+
+				if (fua)
+					os -> n_fua++;
+
+				n_since_flush++;
+			}
+
+			in_flight++;
+			slot_in_flight[slot] = in_flight;
+		}
+
+		if (os -> failed || in_flight == 0)
+			break;
+
+		uint64_t handle = -1;
+		uint32_t err = 0;
+
+		if (receive_reply_nbd(os -> fd, &handle, &err))
+		{
+			os -> failed = true;
+			break;
+		}
+
+		uint64_t now_ns = get_ns();
+
+		if (handle >= uint64_t(os -> queue_depth))
+		{
+			std::cerr << "session " << os -> conn << ": reply for unknown handle " << handle << std::endl;
+			os -> failed = true;
+			break;
+		}
+
+		if (recording || slowest_n || metrics_enabled)
+		{
+			int op = 3;
+			uint64_t offset = 0, submit_ns = slot_submit_ns[handle];
+			uint32_t len = 0;
+
+			if (slot_write[handle] != -1)
+			{
+				const ordering_write_t *w = &os -> writes.at(slot_write[handle]);
+
+				op = 1;
+				offset = w -> block * ORDERING_BLOCK_SIZE;
+				len = ORDERING_BLOCK_SIZE;
+				submit_ns = w -> submit_ns;
+			}
+
+			if (recording)
+				record_request(os -> conn, op, offset, len, submit_ns, now_ns, err);
+
+			if (slowest_n)
+				slowest_add(os -> conn, op, offset, len, submit_ns, now_ns, slot_in_flight[handle], err);
+
+			if (metrics_enabled)
+				metrics_add(op, len, now_ns - submit_ns, err);
+		}
+
+		if (err)
+		{
+			std::cerr << "session " << os -> conn << ": " << (slot_write[handle] == -1 ? "flush" : "write") << " failed: " << err << std::endl;
+			os -> failed = true;
+			break;
+		}
+
+		if (slot_write[handle] == -1)
+		{
+			for(size_t index=0; index<slot_covers[handle].size(); index++)
+				os -> writes.at(slot_covers[handle].at(index)).durable = true;
+
+			slot_covers[handle].clear();
+		}
+		else
+		{
+			ordering_write_t *w = &os -> writes.at(slot_write[handle]);
+
+			w -> ack_ns = now_ns;
+
+			if (os -> fua && (w -> gen & 1))
+				w -> durable = true;
+			else
+				unflushed.push_back(slot_write[handle]);
+		}
+
+		in_flight--;
+		free_slots.push_back(handle);
+	}
+
+	free(block);
+
+	return NULL;
+}
+
+// closes whatever sessions are still open and frees the per-session state
+void ordering_cleanup(ordering_session_t *sessions, int n_conns, pthread_t *threads)
+{
+	for(int index=0; index<n_conns; index++)
+	{
+		if (sessions[index].fd != -1)
+			close_nbd(sessions[index].fd);
+	}
+
+	delete [] threads;
+	delete [] sessions;
+}
+
+int nbd_ordering(std::string host, int port, int n_conns, int queue_depth, double duration, double sleep_duration)
+{
+	ordering_session_t *sessions = new ordering_session_t[n_conns];
+
+	pthread_t *threads = NULL;
+
+	uint64_t size = -1;
+	uint32_t flags = -1;
+
+	for(int index=0; index<n_conns; index++)
+		sessions[index].fd = -1;
+
+	for(int index=0; index<n_conns; index++)
+	{
+		sessions[index].fd = connect_nbd(host, port, &size, &flags, index == 0);
+		if (sessions[index].fd == -1)
+		{
+			std::cerr << "failed setting up NBD session " << index << std::endl;
+			ordering_cleanup(sessions, n_conns, threads);
+			return 1;
+		}
+	}
+
+	if (size < ORDERING_BLOCKS * ORDERING_BLOCK_SIZE)
+	{
+		std::cerr << "device too small, must be at least " << ORDERING_BLOCKS * ORDERING_BLOCK_SIZE << " bytes" << std::endl;
+		ordering_cleanup(sessions, n_conns, threads);
+		return 1;
+	}
+
+	// 4: flush, 8: fua
+	bool flush = flags & 4, fua = flags & 8;
+
+	if (!flush && !fua)
+	{
+		std::cerr << "server supports neither flush nor FUA: nothing is promised to be durable, nothing to check" << std::endl;
+		ordering_cleanup(sessions, n_conns, threads);
+		return 1;
+	}
+
+	// generation 0 of every block, flushed before the sessions start
+	std::vector<ordering_write_t> initial;
+	unsigned char block[ORDERING_BLOCK_SIZE];
+
+	for(uint64_t nr=0; nr<ORDERING_BLOCKS; nr++)
+	{
+		ordering_write_t w = { 0, nr, get_ns(), 0, true };
+
+		encode_block(block, nr, 0, -1);
+
+		uint32_t rc = write_nbd(sessions[0].fd, nr * ORDERING_BLOCK_SIZE, (const char *)block, ORDERING_BLOCK_SIZE);
+		if (rc)
+		{
+			std::cerr << "Failed writing to block " << nr << ": " << rc << std::endl;
+			ordering_cleanup(sessions, n_conns, threads);
+			return 1;
+		}
+
+		w.ack_ns = get_ns();
+		initial.push_back(w);
+	}
+
+	if (flush && flush_nbd(sessions[0].fd))
+	{
+		std::cerr << "flush failed" << std::endl;
+		ordering_cleanup(sessions, n_conns, threads);
+		return 1;
+	}
+
+	std::cout << n_conns << " sessions writing " << ORDERING_BLOCKS << " blocks for " << duration << "s, " << queue_depth << " requests in flight each";
+	std::cout << (fua ? ", every other write FUA" : "") << (flush ? format(", a flush every %d writes", ORDERING_FLUSH_EVERY) : "") << std::endl;
+
+	uint64_t deadline_ns = get_ns() + uint64_t(duration * 1000000000.0);
+
+	threads = new pthread_t[n_conns];
+	int n_started = 0;
+
+	for(; n_started<n_conns; n_started++)
+	{
+		ordering_session_t *os = &sessions[n_started];
+
+		os -> conn = n_started;
+		os -> queue_depth = queue_depth;
+		os -> fua = fua;
+		os -> flush = flush;
+		os -> deadline_ns = deadline_ns;
+		os -> n_fua = os -> n_flushes = 0;
+		os -> failed = false;
+
+		if (pthread_create(&threads[n_started], NULL, ordering_thread, os))
+		{
+			std::cerr << "cannot start thread for session " << n_started << std::endl;
+			break;
+		}
+	}
+
+	bool failed = n_started != n_conns;
+
+	for(int index=0; index<n_started; index++)
+	{
+		pthread_join(threads[index], NULL);
+
+		failed |= sessions[index].failed;
+	}
+
+	for(int index=0; index<n_conns; index++)
+	{
+		close_nbd(sessions[index].fd);
+		sessions[index].fd = -1;
+	}
+
+	if (failed)
+	{
+		std::cerr << "session failure, not checking" << std::endl;
+		ordering_cleanup(sessions, n_conns, threads);
+		return 1;
+	}
+
+	// all writes by generation
+	uint64_t n_gens = ordering_gen + 1;
+	std::vector<const ordering_write_t *> by_gen(n_gens, (const ordering_write_t *)NULL);
+
+	// a block must not hold a write that was answered before the last
+	// durable write to that block was even sent
+	std::vector<uint64_t> durable_submit(ORDERING_BLOCKS, 0), durable_gen(ORDERING_BLOCKS, 0);
+
+	uint64_t n_writes = 0, n_durable = 0, n_fua = 0, n_flushes = 0;
+
+	for(int index=0; index<n_conns; index++)
+	{
+		const std::vector<ordering_write_t> & writes = sessions[index].writes;
+
+		for(size_t w=0; w<writes.size(); w++)
+		{
+			by_gen.at(writes.at(w).gen) = &writes.at(w);
+
+			if (writes.at(w).durable)
+			{
+				n_durable++;
+
+				if (writes.at(w).submit_ns > durable_submit.at(writes.at(w).block))
+				{
+					durable_submit.at(writes.at(w).block) = writes.at(w).submit_ns;
+					durable_gen.at(writes.at(w).block) = writes.at(w).gen;
+				}
+			}
+		}
+
+		n_writes += writes.size();
+		n_fua += sessions[index].n_fua;
+		n_flushes += sessions[index].n_flushes;
+	}
+
+	std::cout << n_writes << " writes (" << n_fua << " FUA), " << n_flushes << " flushes, " << n_durable << " writes durable (FUA or covered by a flush)" << std::endl;
+
+	std::cout << "reconnecting..." << std::endl;
+	USLEEP(useconds_t(backoff_jitter(sleep_duration) * 1000000.0));
+
+	int fd = connect_nbd(host, port, &size, &flags, false);
+	if (fd == -1)
+	{
+		std::cerr << "failed setting up NBD session" << std::endl;
+		ordering_cleanup(sessions, n_conns, threads);
+		return 1;
+	}
+
+	int n_stale = 0, n_corrupt = 0;
+
+	for(uint64_t nr=0; nr<ORDERING_BLOCKS; nr++)
+	{
+		uint32_t rc = read_nbd(fd, nr * ORDERING_BLOCK_SIZE, (char *)block, ORDERING_BLOCK_SIZE);
+		if (rc)
+		{
+			std::cerr << "Failed reading block " << nr << ": " << rc << std::endl;
+			CLOSE(fd);
+			ordering_cleanup(sessions, n_conns, threads);
+			return 1;
+		}
+
+		uint64_t gen = 0;
+		int conn = -1;
+
+		if (!decode_block(block, nr, &gen, &conn) || gen >= n_gens || (gen && (by_gen.at(gen) == NULL || by_gen.at(gen) -> block != nr)))
+		{
+			std::cerr << "block " << nr << " does not hold any (complete) write that was sent to it" << std::endl;
+			n_corrupt++;
+			continue;
+		}
+
+		const ordering_write_t *w = gen ? by_gen.at(gen) : &initial.at(nr);
+
+		if (w -> ack_ns < durable_submit.at(nr))
+		{
+			std::cerr << "block " << nr << " went back to generation " << gen << " (session " << conn << "), which was answered " <<
+				(durable_submit.at(nr) - w -> ack_ns) / 1000 << "us before durable generation " << durable_gen.at(nr) << " was sent" << std::endl;
+			n_stale++;
+		}
+	}
+
+	close_nbd(fd);
+
+	std::cout << ORDERING_BLOCKS << " blocks checked: " << n_stale << " stale, " << n_corrupt << " corrupt" << std::endl;
+
+	ordering_cleanup(sessions, n_conns, threads);
+
+	if (n_stale || n_corrupt)
+		return 1;
+
+	printf("\n ***** all fine! *****\n");
+
+	return 0;
+}
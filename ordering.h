@@ -0,0 +1,5 @@
+// n_conns sessions write generation stamped blocks to a small shared area
+// (queue_depth requests in flight each, with FUA and flushes) for
+// 'duration' seconds; after a reconnect every block must hold a write that
+// was not superseded by a later flushed/FUA write
+int nbd_ordering(std::string host, int port, int n_conns, int queue_depth, double duration, double sleep_duration);
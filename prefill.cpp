@@ -0,0 +1,246 @@
+#include <algorithm>
+#include <iostream>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <string.h>
+#include <vector>
+
+#include "nbd.h"
+#include "utils-data.h"
+#include "utils-hist.h"
+#include "load.h"
+#include "prefill.h"
+#include "utils-net.h"
+#include "utils-str.h"
+#include "utils-time.h"
+
+// sequential fill: requests of up to this size (within the maximum block size of the server)
+#define PREFILL_IO_SIZE		(1024 * 1024)
+#define PREFILL_QUEUE_DEPTH	8
+
+// random overwrites
+#define PREFILL_RANDOM_DEPTH	32
+#define PREFILL_WINDOW		2.0
+
+// steady: over the last windows the IOPS stay within this fraction of their average
+#define PREFILL_STEADY_WINDOWS	5
+#define PREFILL_STEADY_BAND	0.2
+
+#define PREFILL_REPORT_INTERVAL	1.0
+
+std::string eta(double done, double total, double took)
+{
+	if (done <= 0.0)
+		return "?";
+
+	int left = int(took * (total - done) / done);
+
+	return format("%d:%02d:%02d", left / 3600, (left / 60) % 60, left % 60);
+}
+
+int prefill_sequential(const endpoint_t & e)
+{
+	uint64_t size = -1;
+	uint32_t flags = -1;
+
+	int fd = connect_nbd(e.host, e.port, &size, &flags, false);
+	if (fd == -1)
+	{
+		std::cerr << "failed setting up NBD session with " << endpoint_name(e) << std::endl;
+		return -1;
+	}
+
+	uint32_t io_size = std::min(uint32_t(PREFILL_IO_SIZE), block_size_max);
+	io_size -= io_size % block_size_min;
+
+	// every block differs (no de-duplication, no compression) and is not zero (no thin provisioning shortcuts)
+	std::vector<unsigned char *> data(PREFILL_QUEUE_DEPTH);
+	for(int index=0; index<PREFILL_QUEUE_DEPTH; index++)
+	{
+		data.at(index) = (unsigned char *)malloc(io_size);
+		get_random_bytes(data.at(index), io_size);
+	}
+
+	std::cout << "filling " << endpoint_name(e) << " (" << size << " bytes) with requests of " << io_size << " bytes" << std::endl;
+
+	pipeline_t *p = pipeline_create(fd, PREFILL_QUEUE_DEPTH);
+
+	uint64_t offset = 0, n_done = 0;
+	int rc = 0;
+	double start_ts = get_ts(), report_ts = start_ts;
+
+	while(offset < size || p -> in_flight > 0)
+	{
+		while(offset < size && p -> n_free)
+		{
+			unsigned char *block = data.at(pipeline_next_slot(p));
+
+			uint32_t len = uint32_t(std::min(uint64_t(io_size), size - offset));
+
+			for(uint32_t o=0; o + 8<=len; o += 4096)
+				u64_to_bytes(&block[o], offset + o);
+
+			if (pipeline_send(p, 1, offset, (char *)block, len) == -1)
+			{
+				std::cerr << "Failed to send write request to server" << std::endl;
+				rc = -1;
+				break;
+			}
+
+			offset += len;
+		}
+
+		if (rc || p -> in_flight == 0)
+			break;
+
+		int slot = -1;
+		uint32_t err = 0;
+
+		if (pipeline_receive(p, &slot, &err))
+		{
+			rc = -1;
+			break;
+		}
+
+		if (err)
+		{
+			std::cerr << "write failed with error " << err << std::endl;
+			rc = -1;
+			break;
+		}
+
+		n_done += p -> len[slot];
+
+		double now_ts = get_ts();
+		if (now_ts - report_ts >= PREFILL_REPORT_INTERVAL)
+		{
+			double took = now_ts - start_ts;
+
+			printf("%.1f%%, %.1f MB/s, ETA %s     \r", std::min(n_done, size) * 100.0 / size, n_done / took / 1000000.0, eta(n_done, size, took).c_str());
+			fflush(NULL);
+
+			report_ts = now_ts;
+		}
+	}
+
+	if (rc == 0)
+	{
+		double took = get_ts() - start_ts;
+
+		printf("filled %llu bytes in %.1f seconds (%.1f MB/s)          \n", (unsigned long long)size, took, size / took / 1000000.0);
+	}
+
+	pipeline_free(p);
+
+	for(int index=0; index<PREFILL_QUEUE_DEPTH; index++)
+		free(data.at(index));
+
+	close_nbd(fd);
+
+	return rc;
+}
+
+bool steady(const std::vector<double> & iops)
+{
+	if (iops.size() < PREFILL_STEADY_WINDOWS)
+		return false;
+
+	std::vector<double> last(iops.end() - PREFILL_STEADY_WINDOWS, iops.end());
+
+	double avg = 0.0;
+	for(size_t index=0; index<last.size(); index++)
+		avg += last.at(index);
+	avg /= last.size();
+
+	double lowest = *std::min_element(last.begin(), last.end());
+	double highest = *std::max_element(last.begin(), last.end());
+
+	return avg > 0.0 && lowest >= avg * (1.0 - PREFILL_STEADY_BAND) && highest <= avg * (1.0 + PREFILL_STEADY_BAND);
+}
+
+int prefill_random(const std::vector<endpoint_t> & endpoints, int n_passes)
+{
+	load_config_t cfg = { 1, PREFILL_RANDOM_DEPTH, 0, true, 0, true };
+
+	load_t *l = load_start(endpoints, &cfg);
+	if (!l)
+		return -1;
+
+	size_t n = endpoints.size();
+
+	// each endpoint gets the same number of requests, so the smallest one decides
+	double target = double(load_export_size(l)) * n_passes * n;
+
+	// a device that is not steady after the passes gets one more, and
+	// enough windows to judge it
+	double limit = target + double(load_export_size(l)) * n;
+	int n_extra_windows = 0;
+
+	std::cout << n_passes << " pass(es) of random writes, then until the IOPS are steady" << std::endl;
+
+	std::vector<load_stats_t> per_endpoint(n);
+	std::vector<double> window_iops;
+	double done = 0.0, start_ts = get_ts(), prev_ts = start_ts;
+	bool is_steady = false;
+
+	while(!load_failed(l) && (done < limit || n_extra_windows < PREFILL_STEADY_WINDOWS * 2))
+	{
+		USLEEP(useconds_t(PREFILL_WINDOW * 1000000.0));
+
+		load_snapshot(l, &per_endpoint.at(0));
+
+		double now_ts = get_ts();
+
+		uint64_t n_ios = 0;
+		for(size_t index=0; index<n; index++)
+		{
+			n_ios += per_endpoint.at(index).n_ios;
+			done += per_endpoint.at(index).n_bytes;
+		}
+
+		window_iops.push_back(n_ios / (now_ts - prev_ts));
+		prev_ts = now_ts;
+
+		is_steady = steady(window_iops);
+
+		printf("pass %.2f of %d, %.1f IOPS, %s, ETA %s     \r", done * n_passes / target, n_passes, window_iops.back(),
+				is_steady ? "steady" : "not steady yet", done < target ? eta(done, target, now_ts - start_ts).c_str() : "when steady");
+		fflush(NULL);
+
+		if (done >= target)
+		{
+			if (is_steady)
+				break;
+
+			n_extra_windows++;
+		}
+	}
+
+	int rc = load_stop(l);
+
+	printf("\n");
+
+	if (rc == 0 && !is_steady)
+		std::cout << "IOPS did not become steady (within " << PREFILL_STEADY_BAND * 100.0 << "% over " << PREFILL_STEADY_WINDOWS << " windows of " << PREFILL_WINDOW << " seconds); measuring anyway" << std::endl;
+
+	return rc;
+}
+
+int nbd_prefill(const std::vector<endpoint_t> & endpoints, int n_passes)
+{
+	for(size_t index=0; index<endpoints.size(); index++)
+	{
+		if (prefill_sequential(endpoints.at(index)))
+			return -1;
+	}
+
+	if (n_passes > 0 && prefill_random(endpoints, n_passes))
+		return -1;
+
+	std::cout << "preconditioning done" << std::endl << std::endl;
+
+	return 0;
+}
@@ -0,0 +1,4 @@
+// precondition an export: write all of it sequentially with large
+// pipelined requests, then n_passes times its size in random writes,
+// continued until the IOPS are steady
+int nbd_prefill(const std::vector<endpoint_t> & endpoints, int n_passes);
@@ -0,0 +1,393 @@
+#include <algorithm>
+#include <errno.h>
+#include <iostream>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <string.h>
+#include <unistd.h>
+#include <vector>
+
+#include "nbd.h"
+#include "replay.h"
+#include "utils-hist.h"
+#include "utils-metrics.h"
+#include "utils-net.h"
+#include "utils-pool.h"
+#include "utils-record.h"
+#include "utils-slowest.h"
+#include "utils-str.h"
+#include "utils-time.h"
+
+// NBD command types; for trace entries of an unknown kind
+#define OP_READ		0
+#define OP_WRITE	1
+#define OP_FLUSH	3
+#define OP_TRIM		4
+#define OP_NONE		-1
+
+typedef struct
+{
+	double ts;
+	int op;
+	uint64_t offset;
+	uint32_t len;
+} trace_entry_t;
+
+// "0.123,W,4096,8192" (op: r(ead), w(rite), f(lush), d(iscard) or t(rim))
+bool parse_csv_line(const char *line, trace_entry_t *e)
+{
+	char op[16] = { 0 };
+	unsigned long long offset = 0;
+	unsigned int len = 0;
+
+	if (sscanf(line, "%lf , %15[^,] , %llu , %u", &e -> ts, op, &offset, &len) < 2)
+		return false;
+
+	switch(op[0])
+	{
+		case 'r': case 'R':
+			e -> op = OP_READ;
+			break;
+		case 'w': case 'W':
+			e -> op = OP_WRITE;
+			break;
+		case 'f': case 'F':
+			e -> op = OP_FLUSH;
+			break;
+		case 'd': case 'D': case 't': case 'T':
+			e -> op = OP_TRIM;
+			break;
+		default:
+			e -> op = OP_NONE;
+	}
+
+	e -> offset = offset;
+	e -> len = len;
+
+	return true;
+}
+
+// default blkparse output, only the queue ('Q') events:
+// "  8,0    3        1     0.000000000   697  Q   W 223490 + 8 [kjournald]"
+bool parse_blkparse_line(const char *line, trace_entry_t *e)
+{
+	char action[8] = { 0 }, rwbs[16] = { 0 };
+	unsigned long long sector = 0;
+	unsigned int n_sectors = 0;
+
+	int n = sscanf(line, "%*s %*d %*d %lf %*d %7s %15s %llu + %u", &e -> ts, action, rwbs, &sector, &n_sectors);
+	if (n < 3 || strcmp(action, "Q"))
+		return false;
+
+	e -> offset = sector * 512;
+	e -> len = n_sectors * 512;
+
+	if (strchr(rwbs, 'D'))
+		e -> op = OP_TRIM;
+	else if (strchr(rwbs, 'W') && e -> len)
+		e -> op = OP_WRITE;
+	else if (strchr(rwbs, 'R'))
+		e -> op = OP_READ;
+	else if (strchr(rwbs, 'F'))
+		e -> op = OP_FLUSH;
+	else
+		e -> op = OP_NONE;
+
+	return true;
+}
+
+int load_trace(const char *trace_file, std::vector<trace_entry_t> *entries)
+{
+	FILE *fh = fopen(trace_file, "r");
+	if (!fh)
+	{
+		std::cerr << "cannot open " << trace_file << ": " << strerror(errno) << std::endl;
+		return -1;
+	}
+
+	char line[4096];
+	uint64_t n_lines = 0, n_ignored = 0;
+
+	while(fgets(line, sizeof line, fh))
+	{
+		n_lines++;
+
+		if (line[0] == '#' || line[0] == '\n')
+			continue;
+
+		trace_entry_t e;
+		bool ok = strchr(line, ',') && !strchr(line, '[') ? parse_csv_line(line, &e) : parse_blkparse_line(line, &e);
+
+		if (!ok || e.op == OP_NONE)
+		{
+			n_ignored++;
+			continue;
+		}
+
+		entries -> push_back(e);
+	}
+
+	fclose(fh);
+
+	std::cout << "trace " << trace_file << ": " << entries -> size() << " requests (" << n_ignored << " of " << n_lines << " lines ignored)" << std::endl;
+
+	return 0;
+}
+
+// make 'e' fit the export and its block size constraints; true if it had to change
+bool remap(trace_entry_t *e, uint64_t size)
+{
+	if (e -> op == OP_FLUSH)
+	{
+		e -> offset = e -> len = 0;
+		return false;
+	}
+
+	trace_entry_t orig = *e;
+
+	if (e -> len > block_size_max)
+		e -> len = block_size_max;
+
+	if (e -> len > size)
+		e -> len = size;
+
+	e -> offset -= e -> offset % block_size_min;
+	e -> len = (e -> len + block_size_min - 1) / block_size_min * block_size_min;
+
+	if (e -> offset + e -> len > size)
+	{
+		e -> offset %= size - e -> len + 1;
+		e -> offset -= e -> offset % block_size_min;
+	}
+
+	return e -> offset != orig.offset || e -> len != orig.len;
+}
+
+bool trace_entry_before(const trace_entry_t & a, const trace_entry_t & b)
+{
+	return a.ts < b.ts;
+}
+
+// everything the replay allocated once the session is set up
+void replay_cleanup(pipeline_t *p, buffer_pool_t *pool, unsigned char *write_data, std::vector<unsigned char *> & read_data, histogram_t *latency, histogram_t *slip)
+{
+	pipeline_free(p);
+
+	free(slip);
+	free(latency);
+
+	for(size_t index=0; index<read_data.size(); index++)
+		pool_put(pool, read_data.at(index));
+	pool_put(pool, write_data);
+	pool_destroy(pool);
+}
+
+int nbd_replay(std::string host, int port, const char *trace_file, int queue_depth, bool asap)
+{
+	std::vector<trace_entry_t> entries;
+	if (load_trace(trace_file, &entries))
+		return 1;
+
+	if (entries.empty())
+	{
+		std::cerr << "nothing to replay" << std::endl;
+		return 1;
+	}
+
+	// blkparse merges the per-cpu traces, they are not strictly in order
+	std::stable_sort(entries.begin(), entries.end(), trace_entry_before);
+
+	uint32_t flags = -1;
+	uint64_t size = -1;
+	int fd = connect_nbd(host, port, &size, &flags, true);
+	if (fd == -1)
+	{
+		std::cerr << "failed setting up NBD session" << std::endl;
+		return 1;
+	}
+
+	uint64_t n_remapped = 0, n_skipped = 0;
+	uint32_t max_len = 4096;
+
+	for(size_t index=0; index<entries.size(); index++)
+	{
+		trace_entry_t *e = &entries.at(index);
+
+		// 4: flush, 32: trim
+		if ((e -> op == OP_FLUSH && (flags & 4) == 0) || (e -> op == OP_TRIM && (flags & 32) == 0))
+		{
+			e -> op = OP_NONE;
+			n_skipped++;
+			continue;
+		}
+
+		if (remap(e, size))
+			n_remapped++;
+
+		max_len = std::max(max_len, e -> len);
+	}
+
+	// one (read-only) source for all writes, a read buffer per request in flight
+	buffer_pool_t *pool = pool_create(max_len, queue_depth + 1);
+
+	unsigned char *write_data = (unsigned char *)pool_get(pool, max_len);
+	memset(write_data, 0xa5, max_len);
+
+	std::vector<unsigned char *> read_data(queue_depth);
+	for(int index=0; index<queue_depth; index++)
+		read_data.at(index) = (unsigned char *)pool_get(pool, max_len);
+
+	pipeline_t *p = pipeline_create(fd, queue_depth);
+
+	histogram_t *latency = (histogram_t *)malloc(sizeof(histogram_t) * (OP_TRIM + 1));
+	for(int op=0; op<=OP_TRIM; op++)
+		hist_init(&latency[op]);
+
+	// how late requests were sent compared to the recorded timing
+	histogram_t *slip = (histogram_t *)malloc(sizeof(histogram_t));
+	hist_init(slip);
+
+	uint64_t n_errors[OP_TRIM + 1] = { 0 };
+	uint64_t n_done = 0;
+
+	std::cout << "replaying " << (asap ? "as fast as possible" : "with the recorded timing") << ", at most " << queue_depth << " requests in flight, over " << transport_name(host) << std::endl;
+
+	double ts0 = entries.at(0).ts;
+	uint64_t start_ns = get_ns(), last_ns = start_ns;
+	size_t next = 0;
+	bool failed = false;
+
+	for(;;)
+	{
+		while(next < entries.size() && entries.at(next).op == OP_NONE)
+			next++;
+
+		uint64_t due_ns = 0;
+		if (next < entries.size() && !asap)
+			due_ns = start_ns + uint64_t((entries.at(next).ts - ts0) * 1000000000.0);
+
+		uint64_t now_ns = get_ns();
+
+		if (next < entries.size() && p -> n_free && now_ns >= due_ns)
+		{
+			const trace_entry_t *e = &entries.at(next);
+
+			if (!asap)
+				hist_add(slip, now_ns - due_ns);
+
+			unsigned char *data = e -> op == OP_WRITE ? write_data : read_data.at(pipeline_next_slot(p));
+
+			if (pipeline_send(p, e -> op, e -> offset, (char *)data, e -> len) == -1)
+			{
+				std::cerr << "Failed to send request to server" << std::endl;
+				failed = true;
+				break;
+			}
+
+			next++;
+
+			continue;
+		}
+
+		if (p -> in_flight == 0)
+		{
+			if (next >= entries.size())
+				break;
+
+			USLEEP(useconds_t((due_ns - now_ns) / 1000));
+			continue;
+		}
+
+		// wait for a reply, but not beyond the moment the next one is due
+		if (next < entries.size() && p -> n_free && !asap)
+		{
+			int rc = data_pending_nbd(fd, (due_ns - now_ns) / 1000000000.0);
+			if (rc == -1)
+			{
+				failed = true;
+				break;
+			}
+
+			if (rc == 0)
+				continue;
+		}
+
+		int slot = -1;
+		uint32_t err = 0;
+
+		if (pipeline_receive(p, &slot, &err))
+		{
+			failed = true;
+			break;
+		}
+
+		int op = p -> type[slot];
+
+		if (err)
+			n_errors[op]++;
+
+		last_ns = get_ns();
+		hist_add(&latency[op], last_ns - p -> submit_ns[slot]);
+
+		if (recording)
+			record_request(0, op, p -> offset[slot], p -> len[slot], p -> submit_ns[slot], last_ns, err);
+
+		if (slowest_n)
+			slowest_add(0, op, p -> offset[slot], p -> len[slot], p -> submit_ns[slot], last_ns, p -> in_flight_at_submit[slot], err);
+
+		if (metrics_enabled)
+			metrics_add(op, p -> len[slot], last_ns - p -> submit_ns[slot], err);
+
+		n_done++;
+	}
+
+	if (failed)
+	{
+		replay_cleanup(p, pool, write_data, read_data, latency, slip);
+		CLOSE(fd);
+		return 1;
+	}
+
+	double took = (last_ns - start_ns) / 1000000000.0;
+	double recorded = entries.back().ts - ts0;
+
+	std::cout << std::endl;
+	std::cout << n_done << " requests in " << format("%.3f", took) << "s (recorded: " << format("%.3f", recorded) << "s), " << format("%.1f", n_done / took) << " IOPs" << std::endl;
+	std::cout << n_remapped << " requests remapped to fit the export (size " << size << ", block sizes " << block_size_min << "/" << block_size_max << "), ";
+	std::cout << n_skipped << " skipped (flush/trim not supported by the server)" << std::endl;
+	std::cout << std::endl;
+
+	hist_print_header("latency (us)");
+
+	for(int op=0; op<=OP_TRIM; op++)
+	{
+		if (latency[op].n == 0)
+			continue;
+
+		hist_print(nbd_cmd_name(op), &latency[op]);
+
+		if (n_errors[op])
+			std::cout << "  " << n_errors[op] << " " << nbd_cmd_name(op) << " requests failed" << std::endl;
+	}
+
+	if (!asap)
+	{
+		// the queue depth was too small or the client/server too slow to keep up
+		std::cout << std::endl;
+		hist_print_header("behind schedule (us)");
+		hist_print("slip", slip);
+	}
+
+	replay_cleanup(p, pool, write_data, read_data, latency, slip);
+
+	if (close_nbd(fd))
+	{
+		std::cerr << "Failed to close session with server" << std::endl;
+		return 1;
+	}
+
+	return 0;
+}
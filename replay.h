@@ -0,0 +1,3 @@
+// replay a block trace (blkparse output or CSV of timestamp,op,offset,length)
+// with the recorded timing or, when asap, as fast as queue_depth allows
+int nbd_replay(std::string host, int port, const char *trace_file, int queue_depth, bool asap);
@@ -0,0 +1,384 @@
+#include <algorithm>
+#include <errno.h>
+#include <iostream>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <string.h>
+#include <vector>
+
+#include "nbd.h"
+#include "scan.h"
+#include "utils-hist.h"
+#include "utils-metrics.h"
+#include "utils-net.h"
+#include "utils-record.h"
+#include "utils-slowest.h"
+#include "utils-str.h"
+#include "utils-time.h"
+
+#define SCAN_REGIONS		256
+#define SCAN_SAMPLES		32
+
+// a region stands out when its p50 or p90 is this factor above the median
+// of all regions (with this few samples the p99 is mostly noise)
+#define SCAN_OUTLIER		2.0
+#define SCAN_OUTLIER_TAIL	3.0
+#define SCAN_MAX_LISTED		25
+
+// heatmap: cells per line and at most this many lines (regions are combined to fit)
+#define SCAN_MAP_WIDTH		64
+#define SCAN_MAP_LINES		16
+
+typedef struct
+{
+	uint64_t n;
+	double avg_us, p50_us, p90_us, p99_us, max_us;
+	uint64_t n_errors;
+} scan_result_t;
+
+typedef struct
+{
+	std::string host;
+	int port;
+	// for the recorder and the slowest requests
+	int conn;
+	bool do_writes;
+	uint64_t size, region_size, n_regions;
+	uint32_t io_size;
+
+	// next region to sample
+	volatile uint64_t *next;
+
+	// [region * 2 + type]
+	scan_result_t *results;
+
+	bool failed;
+} scan_session_t;
+
+void * scan_thread(void *arg)
+{
+	scan_session_t *ss = (scan_session_t *)arg;
+
+	uint64_t size = -1;
+	uint32_t flags = -1;
+
+	int fd = connect_nbd(ss -> host, ss -> port, &size, &flags, false);
+	if (fd == -1)
+	{
+		ss -> failed = true;
+		return NULL;
+	}
+
+	histogram_t *h = (histogram_t *)malloc(sizeof(histogram_t));
+	char *data = (char *)malloc(ss -> io_size);
+	memset(data, 0x5a, ss -> io_size);
+
+	unsigned short xsubi[3] = { 0x330e, 0x1234, (unsigned short)fd };
+
+	for(;;)
+	{
+		uint64_t region = __atomic_fetch_add(ss -> next, 1, __ATOMIC_RELAXED);
+		if (region >= ss -> n_regions)
+			break;
+
+		uint64_t start = region * ss -> region_size;
+		uint64_t len = std::min(ss -> region_size, ss -> size - start);
+		uint64_t n_blocks = len / ss -> io_size;
+
+		for(int type=0; type<(ss -> do_writes ? 2 : 1); type++)
+		{
+			scan_result_t *r = &ss -> results[region * 2 + type];
+
+			hist_init(h);
+			r -> n_errors = 0;
+
+			for(int sample=0; sample<SCAN_SAMPLES; sample++)
+			{
+				uint64_t offset = start + ((uint64_t(nrand48(xsubi)) << 31 | nrand48(xsubi)) % n_blocks) * ss -> io_size;
+
+				uint64_t submit_ns = get_ns();
+
+				// an error reply has no payload, so read_nbd() would wait for one
+				uint64_t handle = -1;
+				uint32_t err = 0;
+
+				if (send_request_nbd(fd, type, sample, offset, type ? data : NULL, ss -> io_size) ||
+					receive_reply_nbd(fd, &handle, &err) || handle != uint64_t(sample))
+				{
+					ss -> failed = true;
+					break;
+				}
+
+				if (!err && type == 0 && READ_BUFFERED(fd, (unsigned char *)data, ss -> io_size) != ssize_t(ss -> io_size))
+				{
+					std::cerr << "short read retrieving data for read-command" << std::endl;
+					ss -> failed = true;
+					break;
+				}
+
+				uint64_t now_ns = get_ns();
+
+				if (err)
+					r -> n_errors++;
+				else
+					hist_add(h, now_ns - submit_ns);
+
+				if (recording)
+					record_request(ss -> conn, type, offset, ss -> io_size, submit_ns, now_ns, err);
+
+				if (slowest_n)
+					slowest_add(ss -> conn, type, offset, ss -> io_size, submit_ns, now_ns, 1, err);
+
+				if (metrics_enabled)
+					metrics_add(type, ss -> io_size, now_ns - submit_ns, err);
+			}
+
+			r -> n = h -> n;
+			r -> avg_us = hist_avg(h) / 1000.0;
+			r -> p50_us = hist_percentile(h, 50.0) / 1000.0;
+			r -> p90_us = hist_percentile(h, 90.0) / 1000.0;
+			r -> p99_us = hist_percentile(h, 99.0) / 1000.0;
+			r -> max_us = h -> max / 1000.0;
+
+			if (ss -> failed)
+				break;
+		}
+
+		if (ss -> failed)
+			break;
+	}
+
+	free(data);
+	free(h);
+
+	close_nbd(fd);
+
+	return NULL;
+}
+
+double median_of(std::vector<double> values)
+{
+	if (values.empty())
+		return 0.0;
+
+	std::nth_element(values.begin(), values.begin() + values.size() / 2, values.end());
+
+	return values.at(values.size() / 2);
+}
+
+void print_heatmap(const char *name, const scan_result_t *results, int type, uint64_t n_regions, uint64_t region_size, double median_p90)
+{
+	uint64_t n_cells = std::min(n_regions, uint64_t(SCAN_MAP_WIDTH * SCAN_MAP_LINES));
+	uint64_t per_cell = (n_regions + n_cells - 1) / n_cells;
+	n_cells = (n_regions + per_cell - 1) / per_cell;
+
+	printf("\n%s: p90 per region relative to the median (%.2f us); . < 1.25x, : < 1.5x, + < 2x, * < 4x, # >= 4x, ! errors\n", name, median_p90);
+
+	for(uint64_t cell=0; cell<n_cells; cell++)
+	{
+		if (cell % SCAN_MAP_WIDTH == 0)
+			printf("%14s ", format("%llu", (unsigned long long)(cell * per_cell * region_size)).c_str());
+
+		// worst region of the cell
+		double worst = 0.0;
+		bool errors = false;
+
+		for(uint64_t region=cell * per_cell; region<std::min(n_regions, (cell + 1) * per_cell); region++)
+		{
+			worst = std::max(worst, results[region * 2 + type].p90_us);
+			errors |= results[region * 2 + type].n_errors > 0;
+		}
+
+		double rel = median_p90 > 0.0 ? worst / median_p90 : 0.0;
+		char c = '#';
+
+		if (errors)
+			c = '!';
+		else if (rel < 1.25)
+			c = '.';
+		else if (rel < 1.5)
+			c = ':';
+		else if (rel < 2.0)
+			c = '+';
+		else if (rel < 4.0)
+			c = '*';
+
+		putchar(c);
+
+		if (cell % SCAN_MAP_WIDTH == SCAN_MAP_WIDTH - 1 || cell == n_cells - 1)
+			putchar('\n');
+	}
+}
+
+int nbd_scan(std::string host, int port, bool do_writes, int n_sessions, uint64_t region_size, const char *csv_file)
+{
+	uint64_t size = -1;
+	uint32_t flags = -1;
+
+	int fd = connect_nbd(host, port, &size, &flags, false);
+	if (fd == -1)
+	{
+		std::cerr << "failed setting up NBD session" << std::endl;
+		return 1;
+	}
+
+	uint32_t io_size = block_size_preferred;
+
+	close_nbd(fd);
+
+	// a tail shorter than one request cannot be sampled without going past the end
+	size -= size % io_size;
+
+	if (size == 0)
+	{
+		std::cerr << "device too small, must be at least " << io_size << " bytes" << std::endl;
+		return 1;
+	}
+
+	if (region_size == 0)
+		region_size = std::max(uint64_t(io_size), (size + SCAN_REGIONS - 1) / SCAN_REGIONS);
+
+	region_size = std::max(uint64_t(io_size), region_size - region_size % io_size);
+
+	uint64_t n_regions = (size + region_size - 1) / region_size;
+
+	FILE *csv = NULL;
+	if (csv_file)
+	{
+		csv = fopen(csv_file, "w");
+		if (!csv)
+		{
+			std::cerr << "cannot create " << csv_file << ": " << strerror(errno) << std::endl;
+			return 1;
+		}
+
+		fprintf(csv, "region,offset,length,type,samples,avg_us,p50_us,p90_us,p99_us,max_us,errors,outlier\n");
+	}
+
+	std::cout << "sampling " << SCAN_SAMPLES << " " << (do_writes ? "reads and writes" : "reads") << " of " << io_size << " bytes in each of " << n_regions << " regions of " << region_size << " bytes, " << n_sessions << " session(s) over " << transport_name(host) << std::endl;
+
+	scan_result_t *results = (scan_result_t *)calloc(n_regions * 2, sizeof(scan_result_t));
+	volatile uint64_t next = 0;
+
+	std::vector<scan_session_t> sessions(n_sessions);
+	std::vector<pthread_t> threads(n_sessions);
+	int n_started = 0;
+
+	double start_ts = get_ts();
+
+	for(int index=0; index<n_sessions; index++)
+	{
+		scan_session_t *ss = &sessions.at(index);
+
+		ss -> host = host;
+		ss -> port = port;
+		ss -> conn = index;
+		ss -> do_writes = do_writes;
+		ss -> size = size;
+		ss -> region_size = region_size;
+		ss -> n_regions = n_regions;
+		ss -> io_size = io_size;
+		ss -> next = &next;
+		ss -> results = results;
+		ss -> failed = false;
+
+		if (pthread_create(&threads.at(index), NULL, scan_thread, ss))
+		{
+			std::cerr << "cannot start thread for session " << index << std::endl;
+			break;
+		}
+
+		n_started++;
+	}
+
+	// progress
+	while(next < n_regions && n_started)
+	{
+		USLEEP(500000);
+
+		printf("%.1f%%\r", std::min(uint64_t(next), n_regions) * 100.0 / n_regions);
+		fflush(NULL);
+
+		bool any_failed = false;
+		for(int index=0; index<n_started; index++)
+			any_failed |= sessions.at(index).failed;
+
+		if (any_failed)
+			break;
+	}
+
+	bool failed = n_started != n_sessions;
+
+	for(int index=0; index<n_started; index++)
+	{
+		pthread_join(threads.at(index), NULL);
+
+		failed |= sessions.at(index).failed;
+	}
+
+	printf("scanned in %.1f seconds\n", get_ts() - start_ts);
+
+	const char *type_names[] = { "read", "write" };
+	int n_outliers = 0, n_listed = 0;
+
+	for(int type=0; type<(do_writes ? 2 : 1) && !failed; type++)
+	{
+		std::vector<double> p50s, p90s;
+
+		for(uint64_t region=0; region<n_regions; region++)
+		{
+			if (results[region * 2 + type].n)
+			{
+				p50s.push_back(results[region * 2 + type].p50_us);
+				p90s.push_back(results[region * 2 + type].p90_us);
+			}
+		}
+
+		double median_p50 = median_of(p50s), median_p90 = median_of(p90s);
+
+		print_heatmap(type_names[type], results, type, n_regions, region_size, median_p90);
+
+		printf("\n%s outliers (p50 more than %.1fx the median of %.2f us or p90 more than %.1fx that of %.2f us):\n", type_names[type], SCAN_OUTLIER, median_p50, SCAN_OUTLIER_TAIL, median_p90);
+
+		for(uint64_t region=0; region<n_regions; region++)
+		{
+			const scan_result_t *r = &results[region * 2 + type];
+
+			bool outlier = r -> n_errors || r -> p50_us > median_p50 * SCAN_OUTLIER || r -> p90_us > median_p90 * SCAN_OUTLIER_TAIL;
+			uint64_t len = std::min(region_size, size - region * region_size);
+
+			if (outlier)
+				n_outliers++;
+
+			if (outlier && n_listed++ < SCAN_MAX_LISTED)
+			{
+				printf("\t%llu...%llu: p50 %.2f us, p90 %.2f us, p99 %.2f us, %llu error(s)\n",
+						(unsigned long long)(region * region_size), (unsigned long long)(region * region_size + len - 1),
+						r -> p50_us, r -> p90_us, r -> p99_us, (unsigned long long)r -> n_errors);
+			}
+
+			if (csv)
+				fprintf(csv, "%llu,%llu,%llu,%s,%llu,%.2f,%.2f,%.2f,%.2f,%.2f,%llu,%d\n", (unsigned long long)region, (unsigned long long)(region * region_size), (unsigned long long)len,
+						type_names[type], (unsigned long long)r -> n, r -> avg_us, r -> p50_us, r -> p90_us, r -> p99_us, r -> max_us, (unsigned long long)r -> n_errors, outlier);
+		}
+	}
+
+	if (csv)
+		fclose(csv);
+
+	free(results);
+
+	if (failed)
+	{
+		std::cerr << "one or more sessions failed" << std::endl;
+		return 1;
+	}
+
+	printf("\n%d outlier region(s)%s\n", n_outliers, n_listed > SCAN_MAX_LISTED ? format(", the first %d are listed", SCAN_MAX_LISTED).c_str() : "");
+
+	return 0;
+}
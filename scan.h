@@ -0,0 +1,5 @@
+// sample the latency of reads (and writes when do_writes) in each region
+// of region_size bytes (0: SCAN_REGIONS regions) over the whole export
+// with n_sessions in parallel; a heatmap is printed and, when csv_file is
+// given, one line per region and type is written to it
+int nbd_scan(std::string host, int port, bool do_writes, int n_sessions, uint64_t region_size, const char *csv_file);
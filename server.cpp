@@ -0,0 +1,808 @@
+#include <algorithm>
+#include <errno.h>
+#include <fcntl.h>
+#include <iostream>
+#include <netdb.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string>
+#include <string.h>
+#include <unistd.h>
+#include <linux/falloc.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#ifdef __linux__
+#include <linux/vm_sockets.h>
+#endif
+
+#include "nbd.h"
+#include "server.h"
+#include "utils-data.h"
+#include "utils-net.h"
+#include "utils-str.h"
+
+// errors as defined in the "Error values" section of the protocol
+#define NBD_EPERM	1
+#define NBD_EIO		5
+#define NBD_EINVAL	22
+#define NBD_ENOSPC	28
+
+typedef struct
+{
+	server_config_t cfg;
+
+	int listen_fd;
+
+	// RAM backed: map != NULL, else file_fd
+	unsigned char *map;
+	int file_fd;
+
+	pthread_mutex_t queue_lock;
+	pthread_cond_t queue_cond;
+	struct job_t *queue_head, *queue_tail;
+} server_t;
+
+typedef struct
+{
+	server_t *s;
+	int fd;
+
+	pthread_mutex_t send_lock;
+
+	// requests handed to the workers which were not replied to yet
+	pthread_mutex_t inflight_lock;
+	pthread_cond_t inflight_cond;
+	int inflight;
+} session_t;
+
+typedef struct job_t
+{
+	session_t *session;
+
+	uint32_t type;
+	unsigned char handle[8];
+	uint64_t offset;
+	uint32_t len;
+	unsigned char *data;
+
+	struct job_t *next;
+} job_t;
+
+void init_server_config(server_config_t *cfg)
+{
+	cfg -> listen_addr = NULL;
+	cfg -> port = 10809;
+	cfg -> unix_path = NULL;
+	cfg -> vsock = false;
+	cfg -> file = NULL;
+	cfg -> size = uint64_t(1) << 30;
+	cfg -> n_workers = 4;
+	cfg -> oldstyle = false;
+	cfg -> block_size_min = 1;
+	cfg -> block_size_preferred = 4096;
+	cfg -> block_size_max = 32 * 1024 * 1024;
+	cfg -> verbose = false;
+}
+
+int send_reply(session_t *ses, const unsigned char *handle, uint32_t error, const unsigned char *data, uint32_t len)
+{
+	unsigned char hdr[16];
+
+	u32_to_bytes(&hdr[0], 0x67446698);
+	u32_to_bytes(&hdr[4], error);
+	memcpy(&hdr[8], handle, 8);
+
+	struct iovec iov[2] = { { hdr, sizeof hdr }, { (void *)data, len } };
+	size_t total = sizeof hdr + len;
+
+	pthread_mutex_lock(&ses -> send_lock);
+
+	// header and payload in one go; fall back to WRITE for whatever remains
+	ssize_t rc = -1;
+	do
+	{
+		rc = writev(ses -> fd, iov, len ? 2 : 1);
+	}
+	while(rc == -1 && errno == EINTR);
+
+	if (rc >= 0 && size_t(rc) < total)
+	{
+		if (size_t(rc) < sizeof hdr)
+		{
+			if (WRITE(ses -> fd, (const char *)&hdr[rc], sizeof hdr - rc) != ssize_t(sizeof hdr - rc))
+				rc = -1;
+			else
+				rc = sizeof hdr;
+		}
+
+		if (rc != -1 && len && WRITE(ses -> fd, (const char *)&data[rc - sizeof hdr], total - rc) != ssize_t(total - rc))
+			rc = -1;
+	}
+
+	pthread_mutex_unlock(&ses -> send_lock);
+
+	return rc == -1 ? -1 : 0;
+}
+
+bool in_range(server_t *s, uint64_t offset, uint32_t len)
+{
+	return offset <= s -> cfg.size && len <= s -> cfg.size - offset;
+}
+
+void execute_job(job_t *j)
+{
+	server_t *s = j -> session -> s;
+	uint32_t error = 0;
+	uint16_t command = j -> type & 0xffff;
+	bool fua = (j -> type >> 16) & 1;
+
+	if (command == 0)	// read
+	{
+		if (!in_range(s, j -> offset, j -> len))
+			error = NBD_EINVAL;
+		else if (s -> map)
+			j -> data = &s -> map[j -> offset];
+		else
+		{
+			j -> data = (unsigned char *)malloc(j -> len);
+
+			if (pread(s -> file_fd, j -> data, j -> len, j -> offset) != ssize_t(j -> len))
+				error = NBD_EIO;
+		}
+
+		send_reply(j -> session, j -> handle, error, error ? NULL : j -> data, error ? 0 : j -> len);
+
+		if (s -> map)
+			j -> data = NULL;
+	}
+	else if (command == 1)	// write
+	{
+		if (!in_range(s, j -> offset, j -> len))
+			error = NBD_ENOSPC;
+		else if (s -> map)
+			memcpy(&s -> map[j -> offset], j -> data, j -> len);
+		else if (pwrite(s -> file_fd, j -> data, j -> len, j -> offset) != ssize_t(j -> len))
+			error = NBD_EIO;
+		else if (fua && fdatasync(s -> file_fd) == -1)
+			error = NBD_EIO;
+
+		send_reply(j -> session, j -> handle, error, NULL, 0);
+	}
+	else if (command == 3)	// flush
+	{
+		if (s -> map == NULL && fdatasync(s -> file_fd) == -1)
+			error = NBD_EIO;
+
+		send_reply(j -> session, j -> handle, error, NULL, 0);
+	}
+	else if (command == 4)	// trim
+	{
+		if (!in_range(s, j -> offset, j -> len))
+			error = NBD_ENOSPC;
+		else if (s -> map)
+		{
+			// give whole pages back to the kernel, zero the edges
+			uint64_t page = sysconf(_SC_PAGESIZE);
+			uint64_t start = (j -> offset + page - 1) / page * page;
+			uint64_t end = (j -> offset + j -> len) / page * page;
+
+			if (start < end)
+			{
+				memset(&s -> map[j -> offset], 0x00, start - j -> offset);
+				madvise(&s -> map[start], end - start, MADV_DONTNEED);
+				memset(&s -> map[end], 0x00, j -> offset + j -> len - end);
+			}
+			else
+			{
+				memset(&s -> map[j -> offset], 0x00, j -> len);
+			}
+		}
+		else if (j -> len && fallocate(s -> file_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, j -> offset, j -> len) == -1)
+			error = NBD_EIO;
+
+		send_reply(j -> session, j -> handle, error, NULL, 0);
+	}
+	else
+	{
+		send_reply(j -> session, j -> handle, NBD_EINVAL, NULL, 0);
+	}
+
+	free(j -> data);
+}
+
+void job_done(job_t *j)
+{
+	session_t *ses = j -> session;
+
+	free(j);
+
+	pthread_mutex_lock(&ses -> inflight_lock);
+	if (--ses -> inflight == 0)
+		pthread_cond_signal(&ses -> inflight_cond);
+	pthread_mutex_unlock(&ses -> inflight_lock);
+}
+
+void * worker_thread(void *arg)
+{
+	server_t *s = (server_t *)arg;
+
+	for(;;)
+	{
+		pthread_mutex_lock(&s -> queue_lock);
+
+		while(s -> queue_head == NULL)
+			pthread_cond_wait(&s -> queue_cond, &s -> queue_lock);
+
+		job_t *j = s -> queue_head;
+		s -> queue_head = j -> next;
+		if (s -> queue_head == NULL)
+			s -> queue_tail = NULL;
+
+		pthread_mutex_unlock(&s -> queue_lock);
+
+		execute_job(j);
+
+		job_done(j);
+	}
+
+	return NULL;
+}
+
+void queue_job(server_t *s, job_t *j)
+{
+	pthread_mutex_lock(&j -> session -> inflight_lock);
+	j -> session -> inflight++;
+	pthread_mutex_unlock(&j -> session -> inflight_lock);
+
+	if (s -> cfg.n_workers == 0)
+	{
+		execute_job(j);
+		job_done(j);
+		return;
+	}
+
+	j -> next = NULL;
+
+	pthread_mutex_lock(&s -> queue_lock);
+
+	if (s -> queue_tail)
+		s -> queue_tail -> next = j;
+	else
+		s -> queue_head = j;
+
+	s -> queue_tail = j;
+
+	pthread_cond_signal(&s -> queue_cond);
+	pthread_mutex_unlock(&s -> queue_lock);
+}
+
+int send_option_reply(int fd, uint32_t option, uint32_t type, const unsigned char *data, uint32_t len)
+{
+	unsigned char hdr[20];
+
+	u64_to_bytes(&hdr[0], 0x3e889045565a9ll);
+	u32_to_bytes(&hdr[8], option);
+	u32_to_bytes(&hdr[12], type);
+	u32_to_bytes(&hdr[16], len);
+
+	if (WRITE(fd, (const char *)hdr, sizeof hdr) != sizeof hdr)
+		return -1;
+
+	if (len && WRITE(fd, (const char *)data, len) != ssize_t(len))
+		return -1;
+
+	return 0;
+}
+
+uint16_t transmission_flags(server_t *s)
+{
+	// has flags, flush, fua, trim
+	return 1 | 4 | 8 | 32;
+}
+
+int send_export_info(server_t *s, int fd, uint32_t option)
+{
+	unsigned char info_export[12];
+	u16_to_bytes(&info_export[0], NBD_INFO_EXPORT);
+	u64_to_bytes(&info_export[2], s -> cfg.size);
+	u16_to_bytes(&info_export[10], transmission_flags(s));
+
+	if (send_option_reply(fd, option, NBD_REP_INFO, info_export, sizeof info_export))
+		return -1;
+
+	unsigned char info_bs[14];
+	u16_to_bytes(&info_bs[0], NBD_INFO_BLOCK_SIZE);
+	u32_to_bytes(&info_bs[2], s -> cfg.block_size_min);
+	u32_to_bytes(&info_bs[6], s -> cfg.block_size_preferred);
+	u32_to_bytes(&info_bs[10], s -> cfg.block_size_max);
+
+	if (send_option_reply(fd, option, NBD_REP_INFO, info_bs, sizeof info_bs))
+		return -1;
+
+	return send_option_reply(fd, option, NBD_REP_ACK, NULL, 0);
+}
+
+// returns 0 when the transmission phase can start
+int handshake(server_t *s, int fd)
+{
+	unsigned char hello[8 + 8 + 8 + 4 + 124] = { 0 };
+
+	memcpy(&hello[0], "NBDMAGIC", 8);
+
+	if (s -> cfg.oldstyle)
+	{
+		unsigned char oldstyle_magic[8] = { 0x00, 0x00, 0x42, 0x02, 0x81, 0x86, 0x12, 0x53 };
+
+		memcpy(&hello[8], oldstyle_magic, 8);
+		u64_to_bytes(&hello[16], s -> cfg.size);
+		u32_to_bytes(&hello[24], transmission_flags(s));
+
+		return WRITE(fd, (const char *)hello, sizeof hello) == sizeof hello ? 0 : -1;
+	}
+
+	memcpy(&hello[8], "IHAVEOPT", 8);
+	u16_to_bytes(&hello[16], NBD_FLAG_FIXED_NEWSTYLE | NBD_FLAG_NO_ZEROES);
+
+	if (WRITE(fd, (const char *)hello, 18) != 18)
+		return -1;
+
+	unsigned char client_flags_in[4];
+	if (READ(fd, client_flags_in, 4) != 4)
+		return -1;
+
+	uint32_t client_flags = bytes_to_u32(client_flags_in);
+	if (client_flags & ~uint32_t(NBD_FLAG_FIXED_NEWSTYLE | NBD_FLAG_NO_ZEROES))
+		return -1;
+
+	for(;;)
+	{
+		unsigned char opt_hdr[16];
+		if (READ(fd, opt_hdr, sizeof opt_hdr) != sizeof opt_hdr)
+			return -1;
+
+		if (memcmp(opt_hdr, "IHAVEOPT", 8))
+			return -1;
+
+		uint32_t option = bytes_to_u32(&opt_hdr[8]);
+		uint32_t len = bytes_to_u32(&opt_hdr[12]);
+
+		if (len > 65536)
+			return -1;
+
+		unsigned char *data = (unsigned char *)malloc(len + 1);
+		if (len && READ(fd, data, len) != ssize_t(len))
+		{
+			free(data);
+			return -1;
+		}
+
+		int rc = 0;
+
+		if (option == NBD_OPT_EXPORT_NAME)
+		{
+			std::string name((const char *)data, len);
+			free(data);
+
+			if (name != s -> cfg.export_name)
+				return -1;
+
+			unsigned char details[8 + 2 + 124] = { 0 };
+			u64_to_bytes(&details[0], s -> cfg.size);
+			u16_to_bytes(&details[8], transmission_flags(s));
+
+			size_t details_len = (client_flags & NBD_FLAG_NO_ZEROES) ? 10 : sizeof details;
+
+			return WRITE(fd, (const char *)details, details_len) == ssize_t(details_len) ? 0 : -1;
+		}
+		else if (option == NBD_OPT_ABORT)
+		{
+			send_option_reply(fd, option, NBD_REP_ACK, NULL, 0);
+			free(data);
+			return -1;
+		}
+		else if (option == NBD_OPT_LIST)
+		{
+			std::string name = s -> cfg.export_name;
+
+			unsigned char *entry = (unsigned char *)malloc(4 + name.size());
+			u32_to_bytes(entry, name.size());
+			memcpy(&entry[4], name.c_str(), name.size());
+
+			rc = send_option_reply(fd, option, NBD_REP_SERVER, entry, 4 + name.size());
+			free(entry);
+
+			if (rc == 0)
+				rc = send_option_reply(fd, option, NBD_REP_ACK, NULL, 0);
+		}
+		else if (option == NBD_OPT_INFO || option == NBD_OPT_GO)
+		{
+			uint32_t name_len = len >= 4 ? bytes_to_u32(data) : 0xffffffff;
+
+			if (len < 6 || name_len > len - 6)
+				rc = send_option_reply(fd, option, NBD_REP_FLAG_ERROR | 3, NULL, 0);	// NBD_REP_ERR_INVALID
+			else if (std::string((const char *)&data[4], name_len) != s -> cfg.export_name)
+				rc = send_option_reply(fd, option, NBD_REP_FLAG_ERROR | 6, NULL, 0);	// NBD_REP_ERR_UNKNOWN
+			else
+			{
+				rc = send_export_info(s, fd, option);
+
+				if (rc == 0 && option == NBD_OPT_GO)
+				{
+					free(data);
+					return 0;
+				}
+			}
+		}
+		else
+		{
+			rc = send_option_reply(fd, option, NBD_REP_ERR_UNSUP, NULL, 0);
+		}
+
+		free(data);
+
+		if (rc)
+			return -1;
+	}
+}
+
+void * session_thread(void *arg)
+{
+	session_t *ses = (session_t *)arg;
+	server_t *s = ses -> s;
+
+	if (handshake(s, ses -> fd) == 0)
+	{
+		for(;;)
+		{
+			unsigned char req[28];
+			if (READ(ses -> fd, req, sizeof req) != sizeof req)
+				break;
+
+			if (bytes_to_u32(&req[0]) != 0x25609513)
+			{
+				if (s -> cfg.verbose)
+					std::cerr << "request magic mismatch, dropping connection" << std::endl;
+				break;
+			}
+
+			job_t *j = (job_t *)calloc(1, sizeof(job_t));
+			j -> session = ses;
+			j -> type = bytes_to_u32(&req[4]);
+			memcpy(j -> handle, &req[8], 8);
+			j -> offset = bytes_to_u64(&req[16]);
+			j -> len = bytes_to_u32(&req[24]);
+
+			uint16_t command = j -> type & 0xffff;
+
+			if (command == 2)	// disconnect
+			{
+				free(j);
+				break;
+			}
+
+			if (command == 1 && !in_range(s, j -> offset, j -> len))
+			{
+				// the client sends the payload anyway: it has to be read
+				// (and dropped) before anything else, else it would be
+				// taken for the next request header
+				unsigned char *dummy = (unsigned char *)malloc(65536);
+				uint32_t todo = j -> len;
+
+				while(todo > 0)
+				{
+					uint32_t cur = std::min(todo, uint32_t(65536));
+
+					if (READ(ses -> fd, dummy, cur) != ssize_t(cur))
+						break;
+
+					todo -= cur;
+				}
+
+				free(dummy);
+
+				if (todo)
+				{
+					free(j);
+					break;
+				}
+
+				send_reply(ses, j -> handle, NBD_ENOSPC, NULL, 0);
+				free(j);
+
+				continue;
+			}
+
+			if (command == 1 && j -> len)
+			{
+				j -> data = (unsigned char *)malloc(j -> len);
+
+				if (j -> data == NULL || READ(ses -> fd, j -> data, j -> len) != ssize_t(j -> len))
+				{
+					free(j -> data);
+					free(j);
+					break;
+				}
+			}
+
+			queue_job(s, j);
+		}
+	}
+
+	// all outstanding requests must be handled before closing
+	pthread_mutex_lock(&ses -> inflight_lock);
+	while(ses -> inflight > 0)
+		pthread_cond_wait(&ses -> inflight_cond, &ses -> inflight_lock);
+	pthread_mutex_unlock(&ses -> inflight_lock);
+
+	close(ses -> fd);
+
+	pthread_mutex_destroy(&ses -> send_lock);
+	pthread_mutex_destroy(&ses -> inflight_lock);
+	pthread_cond_destroy(&ses -> inflight_cond);
+	free(ses);
+
+	return NULL;
+}
+
+void * accept_thread(void *arg)
+{
+	server_t *s = (server_t *)arg;
+
+	for(;;)
+	{
+		int fd = accept(s -> listen_fd, NULL, NULL);
+		if (fd == -1)
+		{
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+
+			std::cerr << "accept() failed: " << strerror(errno) << std::endl;
+			break;
+		}
+
+		if (s -> cfg.unix_path == NULL && !s -> cfg.vsock)
+		{
+			int flag = 1;
+			setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (char *)&flag, sizeof flag);
+		}
+
+		session_t *ses = (session_t *)calloc(1, sizeof(session_t));
+		ses -> s = s;
+		ses -> fd = fd;
+		pthread_mutex_init(&ses -> send_lock, NULL);
+		pthread_mutex_init(&ses -> inflight_lock, NULL);
+		pthread_cond_init(&ses -> inflight_cond, NULL);
+
+		pthread_t th;
+		pthread_attr_t attr;
+		pthread_attr_init(&attr);
+		pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+		if (pthread_create(&th, &attr, session_thread, ses))
+		{
+			std::cerr << "cannot start thread for connection" << std::endl;
+			close(fd);
+			free(ses);
+		}
+
+		pthread_attr_destroy(&attr);
+	}
+
+	return NULL;
+}
+
+int listen_tcp(server_config_t *cfg)
+{
+	std::string portstr = format("%d", cfg -> port);
+
+	struct addrinfo hints;
+	struct addrinfo *result = NULL;
+	memset(&hints, 0x00, sizeof hints);
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE;
+
+	int rc = getaddrinfo(cfg -> listen_addr, portstr.c_str(), &hints, &result);
+	if (rc)
+	{
+		std::cerr << "Cannot resolve listen address: " << gai_strerror(rc) << std::endl;
+		return -1;
+	}
+
+	int fd = -1;
+
+	for (struct addrinfo *rp = result; rp != NULL; rp = rp -> ai_next)
+	{
+		fd = socket(rp -> ai_family, rp -> ai_socktype, rp -> ai_protocol);
+		if (fd == -1)
+			continue;
+
+		int flag = 1;
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, (char *)&flag, sizeof flag);
+
+		if (bind(fd, rp -> ai_addr, rp -> ai_addrlen) == 0)
+			break;
+
+		close(fd);
+		fd = -1;
+	}
+
+	freeaddrinfo(result);
+
+	if (fd == -1)
+	{
+		std::cerr << "Cannot bind to port " << cfg -> port << ": " << strerror(errno) << std::endl;
+		return -1;
+	}
+
+	struct sockaddr_storage ss;
+	socklen_t ss_len = sizeof ss;
+	if (getsockname(fd, (struct sockaddr *)&ss, &ss_len) == 0)
+	{
+		if (ss.ss_family == AF_INET)
+			cfg -> port = ntohs(((struct sockaddr_in *)&ss) -> sin_port);
+		else if (ss.ss_family == AF_INET6)
+			cfg -> port = ntohs(((struct sockaddr_in6 *)&ss) -> sin6_port);
+	}
+
+	return fd;
+}
+
+int listen_unix(server_config_t *cfg)
+{
+	struct sockaddr_un sa;
+	memset(&sa, 0x00, sizeof sa);
+	sa.sun_family = AF_UNIX;
+
+	if (strlen(cfg -> unix_path) >= sizeof sa.sun_path)
+	{
+		std::cerr << "Path " << cfg -> unix_path << " is too long for a unix domain socket" << std::endl;
+		return -1;
+	}
+
+	strcpy(sa.sun_path, cfg -> unix_path);
+
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd == -1)
+	{
+		std::cerr << "Cannot create unix domain socket: " << strerror(errno) << std::endl;
+		return -1;
+	}
+
+	unlink(cfg -> unix_path);
+
+	if (bind(fd, (struct sockaddr *)&sa, sizeof sa) == -1)
+	{
+		std::cerr << "Cannot bind to " << cfg -> unix_path << ": " << strerror(errno) << std::endl;
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+int listen_vsock(server_config_t *cfg)
+{
+#ifdef AF_VSOCK
+	struct sockaddr_vm sa;
+	memset(&sa, 0x00, sizeof sa);
+	sa.svm_family = AF_VSOCK;
+	sa.svm_cid = VMADDR_CID_ANY;
+	sa.svm_port = cfg -> port;
+
+	int fd = socket(AF_VSOCK, SOCK_STREAM, 0);
+	if (fd == -1)
+	{
+		std::cerr << "Cannot create vsock socket: " << strerror(errno) << std::endl;
+		return -1;
+	}
+
+	if (bind(fd, (struct sockaddr *)&sa, sizeof sa) == -1)
+	{
+		std::cerr << "Cannot bind to vsock port " << cfg -> port << ": " << strerror(errno) << std::endl;
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+#else
+	std::cerr << "vsock is not supported on this platform" << std::endl;
+	return -1;
+#endif
+}
+
+int start_server(server_config_t *cfg)
+{
+	server_t *s = new server_t();
+
+	s -> cfg = *cfg;
+	s -> file_fd = -1;
+
+	if (cfg -> file)
+	{
+		s -> file_fd = open(cfg -> file, O_RDWR | O_CREAT, 0600);
+		if (s -> file_fd == -1)
+		{
+			std::cerr << "Cannot open " << cfg -> file << ": " << strerror(errno) << std::endl;
+			delete s;
+			return -1;
+		}
+
+		// a new file is created sparse
+		off_t cur_size = lseek(s -> file_fd, 0, SEEK_END);
+		if (cur_size < off_t(cfg -> size) && ftruncate(s -> file_fd, cfg -> size) == -1)
+		{
+			std::cerr << "Cannot resize " << cfg -> file << " to " << cfg -> size << " bytes: " << strerror(errno) << std::endl;
+			close(s -> file_fd);
+			delete s;
+			return -1;
+		}
+	}
+	else
+	{
+		// only pages that are written to take up memory
+		void *p = mmap(NULL, cfg -> size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+		if (p == MAP_FAILED)
+		{
+			std::cerr << "Cannot allocate " << cfg -> size << " bytes of memory: " << strerror(errno) << std::endl;
+			delete s;
+			return -1;
+		}
+
+		s -> map = (unsigned char *)p;
+	}
+
+	if (cfg -> unix_path)
+		s -> listen_fd = listen_unix(cfg);
+	else if (cfg -> vsock)
+		s -> listen_fd = listen_vsock(cfg);
+	else
+		s -> listen_fd = listen_tcp(cfg);
+
+	if (s -> listen_fd == -1)
+		return -1;
+
+	s -> cfg.port = cfg -> port;
+
+	if (listen(s -> listen_fd, SOMAXCONN) == -1)
+	{
+		std::cerr << "listen() failed: " << strerror(errno) << std::endl;
+		close(s -> listen_fd);
+		return -1;
+	}
+
+	pthread_mutex_init(&s -> queue_lock, NULL);
+	pthread_cond_init(&s -> queue_cond, NULL);
+
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+	for(int index=0; index<cfg -> n_workers; index++)
+	{
+		pthread_t th;
+		if (pthread_create(&th, &attr, worker_thread, s))
+		{
+			std::cerr << "Cannot start worker thread" << std::endl;
+			pthread_attr_destroy(&attr);
+			return -1;
+		}
+	}
+
+	pthread_t th;
+	if (pthread_create(&th, &attr, accept_thread, s))
+	{
+		std::cerr << "Cannot start accept thread" << std::endl;
+		pthread_attr_destroy(&attr);
+		return -1;
+	}
+
+	pthread_attr_destroy(&attr);
+
+	return 0;
+}
@@ -0,0 +1,31 @@
+typedef struct
+{
+	// where to listen: unix_path when set, vsock port when vsock is set,
+	// else TCP on listen_addr (NULL: any) and port (0: pick one)
+	const char *listen_addr;
+	int port;
+	const char *unix_path;
+	bool vsock;
+
+	// backing store: NULL for RAM, else a (sparse) file which is created when needed
+	const char *file;
+	uint64_t size;
+
+	// number of threads executing requests; 0 executes them on the connection thread (no pipelining)
+	int n_workers;
+
+	// oldstyle or fixed newstyle negotiation
+	bool oldstyle;
+	std::string export_name;
+
+	uint32_t block_size_min, block_size_preferred, block_size_max;
+
+	bool verbose;
+} server_config_t;
+
+void init_server_config(server_config_t *cfg);
+
+// sets up the export and the listening socket and then returns; the
+// connections are handled by threads. cfg->port is updated with the
+// port picked by the kernel if it was 0.
+int start_server(server_config_t *cfg);
@@ -0,0 +1,189 @@
+#include <algorithm>
+#include <iostream>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+#include "utils-hist.h"
+#include "load.h"
+#include "slo.h"
+#include "utils-time.h"
+
+// seconds per control step; longer when there are too few requests for a percentile
+#define SLO_INTERVAL		1.0
+#define SLO_MIN_SAMPLES		200
+
+#define SLO_PERCENTILE		99.0
+
+// multiplicative decrease on a miss, additive increase (per session or
+// as a fraction of the rate) when the objective is met
+#define SLO_DECREASE		0.7
+#define SLO_RATE_INCREASE	0.05
+
+// the rate limit is lifted when it is no longer what holds the IOPS back
+#define SLO_RATE_SLACK		0.9
+
+typedef struct
+{
+	double ts, iops, p_us;
+	int depth;
+	double rate;
+	bool met;
+} slo_step_t;
+
+int nbd_slo(const std::vector<endpoint_t> & endpoints, const load_config_t *cfg, uint64_t slo_ns, double duration)
+{
+	size_t n = endpoints.size();
+	int n_sessions = cfg -> n_conns * n;
+
+	std::cout << "looking for the highest IOPS with p" << SLO_PERCENTILE << " below " << slo_ns / 1000.0 << " us: " << n_sessions << " session(s), at most " << cfg -> queue_depth << " request(s) in flight each, " << duration << " seconds" << std::endl << std::endl;
+
+	load_t *l = load_start(endpoints, cfg);
+	if (!l)
+		return 1;
+
+	// start low, slow start (doubling) until the first miss
+	int depth = 1;
+	double rate = 0.0;
+	bool slow_start = true;
+
+	load_set_depth(l, depth);
+
+	std::vector<slo_step_t> steps;
+	std::vector<load_stats_t> per_endpoint(n);
+	load_stats_t *window = (load_stats_t *)malloc(sizeof(load_stats_t));
+
+	printf("%8s %8s %8s %10s %10s %10s  %s\n", "time", "depth", "flight", "rate", "IOPS", "p99 us", "next");
+
+	double start_ts = get_ts(), now_ts = start_ts;
+
+	while(now_ts - start_ts < duration && !load_failed(l))
+	{
+		double window_start = now_ts;
+
+		load_stats_init(window);
+
+		do
+		{
+			USLEEP(useconds_t(SLO_INTERVAL * 1000000.0));
+
+			load_snapshot(l, &per_endpoint.at(0));
+
+			for(size_t index=0; index<n; index++)
+				load_stats_merge(window, &per_endpoint.at(index));
+
+			now_ts = get_ts();
+		}
+		while(window -> n_ios < SLO_MIN_SAMPLES && now_ts - start_ts < duration && !load_failed(l));
+
+		slo_step_t step;
+		step.ts = now_ts - start_ts;
+		step.iops = window -> n_ios / (now_ts - window_start);
+		step.p_us = hist_percentile(&window -> latency, SLO_PERCENTILE) / 1000.0;
+		step.depth = depth;
+		step.rate = rate;
+		step.met = window -> n_ios > 0 && hist_percentile(&window -> latency, SLO_PERCENTILE) <= slo_ns;
+
+		steps.push_back(step);
+
+		std::string what;
+
+		if (!step.met)
+		{
+			slow_start = false;
+
+			if (depth > 1)
+			{
+				depth = std::max(1, int(depth * SLO_DECREASE));
+				what = "miss: fewer in flight";
+			}
+			else
+			{
+				// one in flight is too much already: space them out
+				rate = (rate > 0.0 ? rate : step.iops) * SLO_DECREASE;
+				what = "miss: lower rate";
+			}
+		}
+		else if (rate > 0.0)
+		{
+			if (step.iops < rate * SLO_RATE_SLACK)
+			{
+				rate = 0.0;
+				what = "met: rate limit lifted";
+			}
+			else
+			{
+				rate += rate * SLO_RATE_INCREASE;
+				what = "met: higher rate";
+			}
+		}
+		else if (depth < cfg -> queue_depth)
+		{
+			depth = std::min(cfg -> queue_depth, slow_start ? depth * 2 : depth + 1);
+			what = slow_start ? "met: double in flight" : "met: one more in flight";
+		}
+		else
+		{
+			what = "met: at -q";
+		}
+
+		printf("%8.1f %8d %8d %10s %10.1f %10.2f  %s\n", step.ts, step.depth, step.depth * n_sessions,
+				step.rate > 0.0 ? std::to_string(int(step.rate)).c_str() : "-", step.iops, step.p_us, what.c_str());
+		fflush(NULL);
+
+		load_set_depth(l, depth);
+		load_set_rate(l, rate);
+	}
+
+	free(window);
+
+	bool failed = load_stop(l) != 0;
+
+	// the best single step, and what was sustained over the second half
+	// of the run (where the controller should have settled)
+	const slo_step_t *best = NULL;
+	double sustained_iops = 0.0;
+	int n_late = 0, n_late_met = 0;
+
+	for(size_t index=0; index<steps.size(); index++)
+	{
+		const slo_step_t *s = &steps.at(index);
+
+		if (s -> met && (!best || s -> iops > best -> iops))
+			best = s;
+
+		if (s -> ts >= duration / 2)
+		{
+			n_late++;
+
+			if (s -> met)
+			{
+				n_late_met++;
+				sustained_iops += s -> iops;
+			}
+		}
+	}
+
+	std::cout << std::endl;
+
+	if (!best)
+		std::cout << "the objective of " << slo_ns / 1000.0 << " us was never met" << std::endl;
+	else
+	{
+		printf("best: %.1f IOPS with p99 %.2f us at %d in flight per session%s\n", best -> iops, best -> p_us, best -> depth,
+				best -> rate > 0.0 ? (", limited to " + std::to_string(int(best -> rate)) + " requests per second").c_str() : "");
+
+		if (n_late_met)
+			printf("sustained: %.1f IOPS (objective met in %d of the last %d steps)\n", sustained_iops / n_late_met, n_late_met, n_late);
+	}
+
+	if (failed)
+	{
+		std::cerr << "one or more sessions failed" << std::endl;
+		return 1;
+	}
+
+	return best ? 0 : 1;
+}
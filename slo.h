@@ -0,0 +1,4 @@
+// find the highest IOPS for which the p99 latency stays below slo_ns:
+// requests in flight per session (up to cfg -> queue_depth) and, below
+// one in flight, the request rate follow the measured p99 (AIMD)
+int nbd_slo(const std::vector<endpoint_t> & endpoints, const load_config_t *cfg, uint64_t slo_ns, double duration);
@@ -0,0 +1,248 @@
+#include <algorithm>
+#include <errno.h>
+#include <iostream>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <string.h>
+#include <time.h>
+#include <vector>
+
+#include "utils-hist.h"
+#include "load.h"
+#include "soak.h"
+#include "utils-str.h"
+#include "utils-time.h"
+
+// seconds per window
+#define SOAK_WINDOW		10.0
+
+// windows: skipped at the start, that form the baseline, and that are
+// averaged before comparing against it
+#define SOAK_WARMUP		1
+#define SOAK_BASELINE		6
+#define SOAK_ROLLING		6
+
+volatile sig_atomic_t soak_stop = 0;
+
+void soak_sigint_handler(int sig)
+{
+	soak_stop = 1;
+
+	signal(SIGINT, SIG_DFL);
+}
+
+std::string soak_elapsed(double t)
+{
+	int s = int(t);
+
+	return format("%dd%02d:%02d:%02d", s / 86400, (s / 3600) % 24, (s / 60) % 60, s % 60);
+}
+
+// alerts only when the state changes so that a drifted server does not flood the output
+void soak_check(const char *what, bool drifted, bool *was_drifted, double t, double value, double baseline, const char *unit, int *n_alerts)
+{
+	if (drifted == *was_drifted)
+		return;
+
+	*was_drifted = drifted;
+
+	if (drifted)
+	{
+		(*n_alerts)++;
+
+		std::cerr << soak_elapsed(t) << " ALERT: " << what << " drifted to " << format("%.1f", value) << unit << " (baseline " << format("%.1f", baseline) << unit << ", " << format("%+.0f", (value - baseline) * 100.0 / baseline) << "%)" << std::endl;
+	}
+	else
+	{
+		std::cerr << soak_elapsed(t) << " " << what << " back within range: " << format("%.1f", value) << unit << " (baseline " << format("%.1f", baseline) << unit << ")" << std::endl;
+	}
+}
+
+int nbd_soak(const std::vector<endpoint_t> & endpoints, const load_config_t *cfg, double duration, const char *timeline_file, double drift_fraction)
+{
+	size_t n = endpoints.size();
+
+	FILE *timeline = NULL;
+	if (timeline_file)
+	{
+		// a restarted soak continues the same timeline
+		timeline = fopen(timeline_file, "a");
+		if (!timeline)
+		{
+			std::cerr << "cannot open " << timeline_file << ": " << strerror(errno) << std::endl;
+			return 1;
+		}
+
+		// where "a" starts is up to the C library, so go to the end explicitly
+		fseek(timeline, 0, SEEK_END);
+		if (ftell(timeline) == 0)
+			fprintf(timeline, "elapsed,unix_time,iops,mb_per_s,avg_us,p50_us,p99_us,p999_us,max_us,errors,rolling_iops,rolling_p99_us,alert\n");
+		fflush(timeline);
+	}
+
+	if (duration > 0.0)
+		std::cout << "soaking for " << soak_elapsed(duration);
+	else
+		std::cout << "soaking until ctrl+c";
+
+	std::cout << ": " << cfg -> n_conns << " session(s) with " << cfg -> queue_depth << " request(s) in flight each on " << n << " endpoint(s), " << SOAK_WINDOW << " second windows, alert on " << drift_fraction * 100.0 << "% drift" << std::endl;
+
+	load_t *l = load_start(endpoints, cfg);
+	if (!l)
+	{
+		if (timeline)
+			fclose(timeline);
+
+		return 1;
+	}
+
+	soak_stop = 0;
+	signal(SIGINT, soak_sigint_handler);
+
+	// all there is, however long it runs
+	std::vector<load_stats_t> per_endpoint(n);
+	load_stats_t *window = (load_stats_t *)malloc(sizeof(load_stats_t));
+	load_stats_t *baseline = (load_stats_t *)malloc(sizeof(load_stats_t));
+	load_stats_t *rolling = (load_stats_t *)malloc(sizeof(load_stats_t));
+	load_stats_t *total = (load_stats_t *)malloc(sizeof(load_stats_t));
+	load_stats_t *ring = (load_stats_t *)malloc(sizeof(load_stats_t) * SOAK_ROLLING);
+	double ring_took[SOAK_ROLLING];
+
+	load_stats_init(baseline);
+	load_stats_init(total);
+
+	double baseline_took = 0.0, baseline_iops = 0.0, baseline_p99 = 0.0;
+	bool iops_drifted = false, p99_drifted = false;
+	int n_alerts = 0;
+
+	double start_ts = get_ts(), now_ts = start_ts;
+
+	for(int nr=0; !soak_stop && !load_failed(l) && (duration <= 0.0 || now_ts - start_ts < duration); nr++)
+	{
+		double window_start = now_ts;
+		double window_end = window_start + SOAK_WINDOW;
+
+		if (duration > 0.0 && window_end > start_ts + duration)
+			window_end = start_ts + duration;
+
+		// short naps so that ctrl+c is not left waiting
+		while(!soak_stop && (now_ts = get_ts()) < window_end)
+			USLEEP(useconds_t(std::min(window_end - now_ts, 1.0) * 1000000.0));
+
+		load_snapshot(l, &per_endpoint.at(0));
+
+		now_ts = get_ts();
+
+		double took = now_ts - window_start;
+		double t = now_ts - start_ts;
+
+		load_stats_init(window);
+		for(size_t index=0; index<n; index++)
+			load_stats_merge(window, &per_endpoint.at(index));
+
+		load_stats_merge(total, window);
+
+		double iops = window -> n_ios / took;
+		double p99 = hist_percentile(&window -> latency, 99.0) / 1000.0;
+
+		int slot = nr % SOAK_ROLLING;
+		ring[slot] = *window;
+		ring_took[slot] = took;
+
+		// rolling average of the last windows
+		load_stats_init(rolling);
+		double rolling_took = 0.0;
+
+		for(int index=0; index<=std::min(nr, SOAK_ROLLING - 1); index++)
+		{
+			load_stats_merge(rolling, &ring[index]);
+			rolling_took += ring_took[index];
+		}
+
+		double rolling_iops = rolling -> n_ios / rolling_took;
+		double rolling_p99 = hist_percentile(&rolling -> latency, 99.0) / 1000.0;
+
+		std::string alert;
+
+		if (nr >= SOAK_WARMUP && nr < SOAK_WARMUP + SOAK_BASELINE)
+		{
+			load_stats_merge(baseline, window);
+			baseline_took += took;
+
+			if (nr == SOAK_WARMUP + SOAK_BASELINE - 1)
+			{
+				baseline_iops = baseline -> n_ios / baseline_took;
+				baseline_p99 = hist_percentile(&baseline -> latency, 99.0) / 1000.0;
+
+				std::cout << soak_elapsed(t) << " baseline: " << format("%.1f", baseline_iops) << " IOPS, p99 " << format("%.2f", baseline_p99) << " us" << std::endl;
+			}
+		}
+		// compare once the rolling windows are all past the baseline
+		else if (nr >= SOAK_WARMUP + SOAK_BASELINE + SOAK_ROLLING - 1)
+		{
+			soak_check("IOPS", rolling_iops < baseline_iops * (1.0 - drift_fraction), &iops_drifted, t, rolling_iops, baseline_iops, "", &n_alerts);
+			soak_check("p99 latency", rolling_p99 > baseline_p99 * (1.0 + drift_fraction), &p99_drifted, t, rolling_p99, baseline_p99, " us", &n_alerts);
+
+			if (iops_drifted)
+				alert = "iops";
+
+			if (p99_drifted)
+				alert += alert.empty() ? "p99" : "+p99";
+		}
+
+		printf("%s IOPS: %.1f, p99: %.2f us, rolling IOPS: %.1f, rolling p99: %.2f us%s\r", soak_elapsed(t).c_str(), iops, p99, rolling_iops, rolling_p99, alert.empty() ? "" : " (drifted)");
+		fflush(NULL);
+
+		if (timeline)
+		{
+			fprintf(timeline, "%.1f,%ld,%.1f,%.3f,%.2f,%.2f,%.2f,%.2f,%.2f,%llu,%.1f,%.2f,%s\n", t, long(time(NULL)),
+					iops,
+					window -> n_bytes / took / 1000000.0,
+					hist_avg(&window -> latency) / 1000.0,
+					hist_percentile(&window -> latency, 50.0) / 1000.0,
+					p99,
+					hist_percentile(&window -> latency, 99.9) / 1000.0,
+					window -> latency.max / 1000.0,
+					(unsigned long long)window -> n_errors,
+					rolling_iops, rolling_p99, alert.c_str());
+
+			fflush(timeline);
+		}
+	}
+
+	signal(SIGINT, SIG_DFL);
+
+	bool failed = load_stop(l) != 0;
+
+	double took = now_ts - start_ts;
+
+	printf("\n\nran for %s: %.1f IOPS on average, %llu errors\n", soak_elapsed(took).c_str(), total -> n_ios / took, (unsigned long long)total -> n_errors);
+
+	hist_print_header("latency (us)");
+	hist_print("all", &total -> latency);
+
+	if (baseline_took > 0.0)
+		hist_print("baseline", &baseline -> latency);
+
+	printf("%d drift alert(s)\n", n_alerts);
+
+	if (timeline)
+		fclose(timeline);
+
+	free(ring);
+	free(total);
+	free(rolling);
+	free(baseline);
+	free(window);
+
+	if (failed)
+	{
+		std::cerr << "one or more sessions failed" << std::endl;
+		return 1;
+	}
+
+	return n_alerts ? 1 : 0;
+}
@@ -0,0 +1,5 @@
+// random I/O for 'duration' seconds (0: until ctrl+c) in fixed memory:
+// windows of SOAK_WINDOW seconds are compared, as a rolling average of the
+// last few, against the first ones; drift of IOPS or p99 beyond
+// drift_fraction is reported. One line per window goes to timeline_file.
+int nbd_soak(const std::vector<endpoint_t> & endpoints, const load_config_t *cfg, double duration, const char *timeline_file, double drift_fraction);
@@ -0,0 +1,225 @@
+#include <algorithm>
+#include <iostream>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <unistd.h>
+#include <sys/uio.h>
+#include <vector>
+
+#include "nbd.h"
+#include "storm.h"
+#include "utils-net.h"
+#include "utils-str.h"
+#include "utils-time.h"
+
+typedef struct
+{
+	std::string host;
+	int port;
+	int (*handshake)(int fd, uint64_t *size, uint32_t *flags, bool verbose, double *magic_ts);
+
+	// all sessions start at once when rate is 0
+	pthread_barrier_t *start;
+
+	int fd;
+	int n_attempts;
+	bool connect_failed, timed_out;
+
+	// start of the session, start of the connect() that succeeded,
+	// connected, NBDMAGIC received, handshake done
+	double t_start, t_attempt, t_connect, t_magic, t_done;
+} storm_session_t;
+
+void * storm_thread(void *arg)
+{
+	storm_session_t *ss = (storm_session_t *)arg;
+
+	if (ss -> start)
+		pthread_barrier_wait(ss -> start);
+
+	ss -> t_start = get_ts();
+
+	ss -> fd = connect_retry(ss -> host, ss -> port, false, &ss -> n_attempts, &ss -> t_attempt);
+	if (ss -> fd == -1)
+	{
+		ss -> connect_failed = true;
+		return NULL;
+	}
+
+	ss -> t_connect = get_ts();
+
+	uint64_t timeouts_before = n_timeouts;
+	uint64_t size = -1;
+	uint32_t flags = -1;
+
+	if (ss -> handshake(ss -> fd, &size, &flags, false, &ss -> t_magic))
+	{
+		ss -> timed_out = n_timeouts != timeouts_before;
+
+		CLOSE(ss -> fd);
+		ss -> fd = -1;
+		return NULL;
+	}
+
+	ss -> t_done = get_ts();
+
+	return NULL;
+}
+
+void print_distribution(std::string name, std::vector<double> & values)
+{
+	if (values.empty())
+	{
+		printf("%-16s %10s\n", name.c_str(), "-");
+		return;
+	}
+
+	std::sort(values.begin(), values.end());
+
+	double total = 0.0;
+	for(size_t index=0; index<values.size(); index++)
+		total += values.at(index);
+
+	size_t n = values.size();
+
+	printf("%-16s %10.3f %10.3f %10.3f %10.3f %10.3f %10.3f\n", name.c_str(),
+			values.at(0) * 1000.0,
+			total * 1000.0 / n,
+			values.at(n / 2) * 1000.0,
+			values.at(std::min(n - 1, n * 90 / 100)) * 1000.0,
+			values.at(std::min(n - 1, n * 99 / 100)) * 1000.0,
+			values.at(n - 1) * 1000.0);
+}
+
+int nbd_connect_storm(std::string host, int port, int n_sessions, double rate)
+{
+	storm_session_t *sessions = new storm_session_t[n_sessions];
+
+	pthread_barrier_t start;
+	if (rate <= 0.0)
+		pthread_barrier_init(&start, NULL, n_sessions);
+
+	if (rate > 0.0)
+		std::cout << "opening " << n_sessions << " sessions at " << rate << " sessions per second over " << transport_name(host) << std::endl;
+	else
+		std::cout << "opening " << n_sessions << " sessions concurrently over " << transport_name(host) << std::endl;
+
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	pthread_attr_setstacksize(&attr, 256 * 1024);
+
+	pthread_t *threads = new pthread_t[n_sessions];
+
+	double start_ts = get_ts();
+	int n_started = 0;
+
+	for(int index=0; index<n_sessions; index++)
+	{
+		storm_session_t *ss = &sessions[index];
+
+		ss -> host = host;
+		ss -> port = port;
+		ss -> handshake = connect_nbd == connect_nbd_v2 ? handshake_nbd_v2 : handshake_nbd_v1;
+		ss -> start = rate > 0.0 ? NULL : &start;
+		ss -> fd = -1;
+		ss -> n_attempts = 0;
+		ss -> connect_failed = ss -> timed_out = false;
+		ss -> t_start = ss -> t_attempt = ss -> t_connect = ss -> t_magic = ss -> t_done = 0.0;
+
+		if (rate > 0.0)
+		{
+			double sleep_duration = start_ts + index / rate - get_ts();
+
+			if (sleep_duration > 0.0)
+				USLEEP(useconds_t(sleep_duration * 1000000.0));
+		}
+
+		if (pthread_create(&threads[index], &attr, storm_thread, ss))
+		{
+			std::cerr << "cannot start thread for session " << index << std::endl;
+
+			// the others would wait forever for this one
+			if (rate <= 0.0)
+				return 1;
+
+			break;
+		}
+
+		n_started++;
+	}
+
+	pthread_attr_destroy(&attr);
+
+	for(int index=0; index<n_started; index++)
+		pthread_join(threads[index], NULL);
+
+	double end_ts = 0.0;
+	std::vector<double> retry_wait, connect, magic, done;
+	int n_connect_failed = 0, n_handshake_failed = 0, n_timed_out = 0, n_retried = 0;
+
+	for(int index=0; index<n_started; index++)
+	{
+		storm_session_t *ss = &sessions[index];
+
+		if (ss -> n_attempts > 1)
+			n_retried++;
+
+		if (ss -> fd == -1)
+		{
+			if (ss -> connect_failed)
+				n_connect_failed++;
+			else
+				n_handshake_failed++;
+
+			if (ss -> timed_out)
+				n_timed_out++;
+
+			continue;
+		}
+
+		// the back-off sleeps are not part of what the server took
+		if (ss -> n_attempts > 1)
+			retry_wait.push_back(ss -> t_attempt - ss -> t_start);
+
+		connect.push_back(ss -> t_connect - ss -> t_attempt);
+		magic.push_back(ss -> t_magic - ss -> t_attempt);
+		done.push_back(ss -> t_done - ss -> t_attempt);
+
+		end_ts = std::max(end_ts, ss -> t_done);
+	}
+
+	// all sessions were kept open until now so that they were all there at the same time
+	for(int index=0; index<n_started; index++)
+	{
+		if (sessions[index].fd != -1)
+			close_nbd(sessions[index].fd);
+	}
+
+	std::cout << std::endl;
+	std::cout << "established: " << done.size() << ", connect failures: " << n_connect_failed << ", handshake failures: " << n_handshake_failed << " (of which timeouts: " << n_timed_out << "), sessions that needed connect retries: " << n_retried << std::endl;
+	std::cout << std::endl;
+
+	printf("%-16s %10s %10s %10s %10s %10s %10s\n", "time to (ms)", "min", "avg", "p50", "p90", "p99", "max");
+	print_distribution("connect (" + transport_name(host) + ")", connect);
+	print_distribution("NBDMAGIC", magic);
+	print_distribution("handshake done", done);
+
+	if (!retry_wait.empty())
+	{
+		printf("\n%-16s %10s %10s %10s %10s %10s %10s\n", "retrying (ms)", "min", "avg", "p50", "p90", "p99", "max");
+		print_distribution("connect retries", retry_wait);
+	}
+
+	if (!done.empty() && end_ts > start_ts)
+		printf("\n%.1f sessions established per second\n", done.size() / (end_ts - start_ts));
+
+	delete [] threads;
+	delete [] sessions;
+
+	if (rate <= 0.0)
+		pthread_barrier_destroy(&start);
+
+	return done.size() == size_t(n_sessions) ? 0 : 1;
+}
@@ -0,0 +1,3 @@
+// open n_sessions NBD sessions, all at once (rate 0) or at 'rate' sessions
+// per second, and show how long connecting and the handshake took
+int nbd_connect_storm(std::string host, int port, int n_sessions, double rate);
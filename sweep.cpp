@@ -0,0 +1,189 @@
+#include <algorithm>
+#include <iostream>
+#include <math.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+#include "utils-hist.h"
+#include "load.h"
+#include "sweep.h"
+#include "utils-time.h"
+
+// seconds per measurement window; the first window of a point is warm-up
+#define SWEEP_WINDOW		1.0
+#define SWEEP_MAX_WINDOWS	10
+
+// steady: two windows within this fraction of each other
+#define SWEEP_STEADY		0.05
+
+// going up in concurrency must give at least this much more IOPS
+#define SWEEP_MIN_GAIN		0.05
+
+// the knee is at this fraction of the highest IOPS seen
+#define SWEEP_KNEE		0.90
+
+typedef struct
+{
+	int conns, depth;
+	double iops, avg_us, p50_us, p99_us;
+} sweep_point_t;
+
+// window of all endpoints together; returns how long it took
+double measure_window(load_t *l, std::vector<load_stats_t> & per_endpoint, load_stats_t *all)
+{
+	double start_ts = get_ts();
+
+	USLEEP(useconds_t(SWEEP_WINDOW * 1000000.0));
+
+	load_snapshot(l, &per_endpoint.at(0));
+
+	double took = get_ts() - start_ts;
+
+	load_stats_init(all);
+	for(size_t index=0; index<per_endpoint.size(); index++)
+		load_stats_merge(all, &per_endpoint.at(index));
+
+	return took;
+}
+
+int measure_point(load_t *l, size_t n_endpoints, sweep_point_t *p)
+{
+	std::vector<load_stats_t> per_endpoint(n_endpoints);
+	load_stats_t *prev = (load_stats_t *)malloc(sizeof(load_stats_t));
+	load_stats_t *cur = (load_stats_t *)malloc(sizeof(load_stats_t));
+	load_stats_t *pair = (load_stats_t *)malloc(sizeof(load_stats_t));
+
+	// warm-up
+	measure_window(l, per_endpoint, prev);
+
+	double prev_took = measure_window(l, per_endpoint, prev), pair_took = prev_took;
+	*pair = *prev;
+
+	for(int index=1; index<SWEEP_MAX_WINDOWS && !load_failed(l); index++)
+	{
+		double took = measure_window(l, per_endpoint, cur);
+
+		double prev_iops = prev -> n_ios / prev_took, iops = cur -> n_ios / took;
+		bool steady = fabs(iops - prev_iops) <= SWEEP_STEADY * std::max(iops, prev_iops);
+
+		// only the last two windows make up the point
+		*pair = *prev;
+		load_stats_merge(pair, cur);
+		pair_took = prev_took + took;
+
+		std::swap(cur, prev);
+		prev_took = took;
+
+		if (steady)
+			break;
+	}
+
+	p -> iops = pair -> n_ios / pair_took;
+	p -> avg_us = hist_avg(&pair -> latency) / 1000.0;
+	p -> p50_us = hist_percentile(&pair -> latency, 50.0) / 1000.0;
+	p -> p99_us = hist_percentile(&pair -> latency, 99.0) / 1000.0;
+
+	free(pair);
+	free(cur);
+	free(prev);
+
+	return load_failed(l);
+}
+
+bool point_before(const sweep_point_t & a, const sweep_point_t & b)
+{
+	int ca = a.conns * a.depth, cb = b.conns * b.depth;
+
+	return ca < cb || (ca == cb && a.conns < b.conns);
+}
+
+int nbd_sweep(const std::vector<endpoint_t> & endpoints, const load_config_t *cfg, int max_conns, int max_depth)
+{
+	std::vector<sweep_point_t> points;
+	double prev_row_best = 0.0;
+
+	std::cout << "sweeping up to " << max_conns << " session(s) per endpoint with up to " << max_depth << " request(s) in flight each, " << endpoints.size() << " endpoint(s)" << std::endl << std::endl;
+
+	printf("%8s %8s %10s %10s %10s %10s\n", "sessions", "depth", "IOPS", "avg us", "p50 us", "p99 us");
+
+	for(int conns=1; conns<=max_conns; conns *= 2)
+	{
+		load_config_t row_cfg = *cfg;
+		row_cfg.n_conns = conns;
+		row_cfg.queue_depth = max_depth;
+
+		load_t *l = load_start(endpoints, &row_cfg);
+		if (!l)
+			return 1;
+
+		double row_best = 0.0;
+
+		for(int depth=1; depth<=max_depth; depth *= 2)
+		{
+			load_set_depth(l, depth);
+
+			sweep_point_t p = { conns, depth, 0.0, 0.0, 0.0, 0.0 };
+
+			if (measure_point(l, endpoints.size(), &p))
+			{
+				std::cerr << "session failure during the sweep" << std::endl;
+				load_stop(l);
+				return 1;
+			}
+
+			printf("%8d %8d %10.1f %10.2f %10.2f %10.2f\n", p.conns, p.depth, p.iops, p.avg_us, p.p50_us, p.p99_us);
+			fflush(NULL);
+
+			points.push_back(p);
+
+			bool gained = p.iops >= row_best * (1.0 + SWEEP_MIN_GAIN);
+
+			row_best = std::max(row_best, p.iops);
+
+			if (!gained)
+				break;
+		}
+
+		load_stop(l);
+
+		if (row_best < prev_row_best * (1.0 + SWEEP_MIN_GAIN))
+			break;
+
+		prev_row_best = row_best;
+	}
+
+	// knee: the least concurrency that gets (nearly) the highest IOPS;
+	// beyond it more requests in flight mostly add latency
+	std::sort(points.begin(), points.end(), point_before);
+
+	double best_iops = 0.0;
+	for(size_t index=0; index<points.size(); index++)
+		best_iops = std::max(best_iops, points.at(index).iops);
+
+	size_t knee = 0;
+	while(knee < points.size() && points.at(knee).iops < best_iops * SWEEP_KNEE)
+		knee++;
+
+	printf("\nIOPS versus latency, by requests in flight in total:\n");
+	printf("%10s %8s %8s %10s %10s %10s\n", "in flight", "sessions", "depth", "IOPS", "avg us", "p99 us");
+
+	for(size_t index=0; index<points.size(); index++)
+	{
+		const sweep_point_t *p = &points.at(index);
+
+		printf("%10d %8d %8d %10.1f %10.2f %10.2f%s\n", int(p -> conns * p -> depth * endpoints.size()), p -> conns, p -> depth, p -> iops, p -> avg_us, p -> p99_us, index == knee ? "  <- knee" : "");
+	}
+
+	if (!points.empty())
+	{
+		const sweep_point_t *p = &points.at(knee);
+
+		printf("\nknee: %d session(s) x %d in flight: %.1f IOPS (%.0f%% of the highest seen, %.1f) at p99 %.2f us\n",
+				p -> conns, p -> depth, p -> iops, p -> iops * 100.0 / best_iops, best_iops, p -> p99_us);
+	}
+
+	return 0;
+}
@@ -0,0 +1,5 @@
+// step sessions (1...max_conns) and requests in flight per session
+// (1...max_depth), doubling, each point measured until steady; stops
+// going up where more concurrency no longer gives more IOPS and marks
+// the knee of the IOPS/latency curve
+int nbd_sweep(const std::vector<endpoint_t> & endpoints, const load_config_t *cfg, int max_conns, int max_depth);
@@ -0,0 +1,272 @@
+#include <algorithm>
+#include <errno.h>
+#include <fcntl.h>
+#include <functional>
+#include <iostream>
+#include <queue>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <vector>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "utils-hist.h"
+#include "utils-record.h"
+
+#define TRACE_MAX_INTERVALS 300
+
+const char *op_name(uint16_t op)
+{
+	switch(op)
+	{
+		case 0:
+			return "read";
+		case 1:
+			return "write";
+		case 3:
+			return "flush";
+		case 4:
+			return "trim";
+	}
+
+	return "?";
+}
+
+void help()
+{
+	std::cerr << "usage: nbd-verify-trace [options] file" << std::endl;
+	std::cerr << "-i x     latency over time in intervals of x seconds (1), widened to a multiple of x" << std::endl;
+	std::cerr << "         when the trace would otherwise need more than " << TRACE_MAX_INTERVALS << " of them" << std::endl;
+	std::cerr << "-b x     latency by offset in x ranges (16)" << std::endl;
+	std::cerr << "-n x     show the x slowest requests (10)" << std::endl;
+}
+
+int main(int argc, char *argv[])
+{
+	double interval = 1.0;
+	int n_ranges = 16, n_outliers = 10;
+
+	int c = -1;
+	while((c = getopt(argc, argv, "i:b:n:h")) != -1)
+	{
+		switch(c)
+		{
+			case 'i':
+				interval = atof(optarg);
+				if (interval <= 0.0)
+				{
+					std::cerr << "interval must be > 0" << std::endl;
+					return 1;
+				}
+				break;
+
+			case 'b':
+				n_ranges = atoi(optarg);
+				if (n_ranges <= 0)
+				{
+					std::cerr << "number of ranges must be > 0" << std::endl;
+					return 1;
+				}
+				break;
+
+			case 'n':
+				n_outliers = atoi(optarg);
+				if (n_outliers < 0)
+				{
+					std::cerr << "number of requests must be >= 0" << std::endl;
+					return 1;
+				}
+				break;
+
+			case 'h':
+				help();
+				return 0;
+
+			default:
+				help();
+				return 1;
+		}
+	}
+
+	if (optind >= argc)
+	{
+		help();
+		return 1;
+	}
+
+	const char *file = argv[optind];
+
+	int fd = open(file, O_RDONLY);
+	if (fd == -1)
+	{
+		std::cerr << "cannot open " << file << ": " << strerror(errno) << std::endl;
+		return 1;
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) == -1 || size_t(st.st_size) < sizeof(trace_header_t))
+	{
+		std::cerr << file << " is not a trace file" << std::endl;
+		return 1;
+	}
+
+	// the records are used in place: no loading, also for huge files
+	void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED)
+	{
+		std::cerr << "cannot mmap " << file << ": " << strerror(errno) << std::endl;
+		return 1;
+	}
+
+	const trace_header_t *header = (const trace_header_t *)map;
+
+	if (memcmp(header -> magic, TRACE_MAGIC, sizeof header -> magic))
+	{
+		std::cerr << file << " is not a trace file" << std::endl;
+		return 1;
+	}
+
+	if (header -> byte_order != TRACE_BYTE_ORDER || header -> record_size != sizeof(trace_record_t))
+	{
+		std::cerr << file << " was recorded on a system with a different byte order or by another version" << std::endl;
+		return 1;
+	}
+
+	const trace_record_t *records = (const trace_record_t *)(header + 1);
+	uint64_t n = (st.st_size - sizeof(trace_header_t)) / sizeof(trace_record_t);
+
+	if (n == 0)
+	{
+		std::cout << "no requests in " << file << std::endl;
+		return 0;
+	}
+
+	uint64_t last_ns = 0, end_offset = 0;
+	uint64_t n_ops[5] = { 0 }, n_errors = 0;
+	uint16_t max_conn = 0;
+
+	for(uint64_t index=0; index<n; index++)
+	{
+		last_ns = std::max(last_ns, records[index].complete_ns);
+		end_offset = std::max(end_offset, records[index].offset + records[index].len);
+		max_conn = std::max(max_conn, records[index].conn);
+
+		if (records[index].op <= 4)
+			n_ops[records[index].op]++;
+
+		if (records[index].error)
+			n_errors++;
+	}
+
+	time_t start = header -> start_ns / 1000000000;
+
+	printf("%llu requests in %.3fs, recorded at %s", (unsigned long long)n, last_ns / 1000000000.0, ctime(&start));
+	printf("reads: %llu, writes: %llu, flushes: %llu, trims: %llu, failed: %llu, sessions: %d\n\n",
+			(unsigned long long)n_ops[0], (unsigned long long)n_ops[1], (unsigned long long)n_ops[3], (unsigned long long)n_ops[4],
+			(unsigned long long)n_errors, max_conn + 1);
+
+	// latency over time (by submit time)
+	uint64_t interval_ns = std::max(uint64_t(1), uint64_t(interval * 1000000000.0));
+	uint64_t n_needed = last_ns / interval_ns + 1;
+
+	// a histogram per interval: a long trace would take gigabytes and
+	// print more rows than anyone reads
+	if (n_needed > TRACE_MAX_INTERVALS)
+	{
+		uint64_t factor = (n_needed + TRACE_MAX_INTERVALS - 1) / TRACE_MAX_INTERVALS;
+
+		interval_ns *= factor;
+		interval *= factor;
+
+		printf("interval widened to %gs to stay within %d rows\n\n", interval, TRACE_MAX_INTERVALS);
+	}
+
+	size_t n_intervals = last_ns / interval_ns + 1;
+
+	std::vector<histogram_t> by_time(n_intervals);
+	for(size_t index=0; index<n_intervals; index++)
+		hist_init(&by_time.at(index));
+
+	std::vector<histogram_t> by_offset(n_ranges);
+	for(int index=0; index<n_ranges; index++)
+		hist_init(&by_offset.at(index));
+
+	uint64_t range_size = (end_offset + n_ranges - 1) / n_ranges;
+	if (range_size == 0)
+		range_size = 1;
+
+	// min-heap of the slowest so far
+	typedef std::pair<uint64_t, uint64_t> latency_index_t;
+	std::priority_queue<latency_index_t, std::vector<latency_index_t>, std::greater<latency_index_t> > slowest;
+
+	for(uint64_t index=0; index<n; index++)
+	{
+		const trace_record_t *r = &records[index];
+		uint64_t latency = r -> complete_ns - r -> submit_ns;
+
+		hist_add(&by_time.at(std::min(size_t(r -> submit_ns / interval_ns), n_intervals - 1)), latency);
+
+		// flushes have no offset
+		if (r -> op != 3)
+			hist_add(&by_offset.at(std::min(uint64_t(n_ranges - 1), r -> offset / range_size)), latency);
+
+		if (n_outliers)
+		{
+			if (slowest.size() < size_t(n_outliers))
+				slowest.push(latency_index_t(latency, index));
+			else if (latency > slowest.top().first)
+			{
+				slowest.pop();
+				slowest.push(latency_index_t(latency, index));
+			}
+		}
+	}
+
+	hist_print_header("time (s)");
+	for(size_t index=0; index<n_intervals; index++)
+	{
+		char name[32];
+		snprintf(name, sizeof name, "%.1f-%.1f", index * interval, (index + 1) * interval);
+
+		hist_print(name, &by_time.at(index));
+	}
+
+	printf("\n");
+	hist_print_header("offset (MiB)");
+	for(int index=0; index<n_ranges; index++)
+	{
+		char name[32];
+		snprintf(name, sizeof name, "%llu-%llu", (unsigned long long)(index * range_size >> 20), (unsigned long long)((index + 1) * range_size >> 20));
+
+		hist_print(name, &by_offset.at(index));
+	}
+
+	if (n_outliers)
+	{
+		std::vector<latency_index_t> list;
+		while(!slowest.empty())
+		{
+			list.push_back(slowest.top());
+			slowest.pop();
+		}
+
+		printf("\n%d slowest requests:\n", int(list.size()));
+		printf("%12s %12s %-6s %14s %10s %8s %6s\n", "latency (us)", "at (s)", "type", "offset", "length", "session", "error");
+
+		for(size_t index=list.size(); index>0; index--)
+		{
+			const trace_record_t *r = &records[list.at(index - 1).second];
+
+			printf("%12.2f %12.6f %-6s %14llu %10u %8d %6u\n", (r -> complete_ns - r -> submit_ns) / 1000.0, r -> submit_ns / 1000000000.0,
+					op_name(r -> op), (unsigned long long)r -> offset, r -> len, r -> conn, r -> error);
+		}
+	}
+
+	munmap(map, st.st_size);
+	close(fd);
+
+	return 0;
+}
@@ -0,0 +1,219 @@
+#include <algorithm>
+#include <iostream>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <string.h>
+#include <vector>
+
+#include "nbd.h"
+#include "unaligned.h"
+#include "utils-hist.h"
+#include "utils-metrics.h"
+#include "utils-net.h"
+#include "utils-record.h"
+#include "utils-slowest.h"
+#include "utils-time.h"
+
+// requests go to a random multiple of this plus the misalignment
+#define UNALIGNED_BASE		65536
+
+const uint32_t misalignments[] = { 0, 512, 2048, 1 };
+const uint32_t lengths[] = { 1, 512, 1000, 4096, 6144, 8000, 65535, 65536 };
+
+#define N_MISALIGNMENTS	(sizeof misalignments / sizeof misalignments[0])
+#define N_LENGTHS	(sizeof lengths / sizeof lengths[0])
+
+typedef struct
+{
+	double iops, p50_us, p99_us;
+	uint64_t n_ios, n_errors;
+} unaligned_cell_t;
+
+int measure_cell(int fd, uint64_t size, bool do_writes, int queue_depth, double cell_duration, uint32_t misalign, uint32_t len, unsigned char *data, histogram_t *h, unaligned_cell_t *cell)
+{
+	uint64_t n_bases = (size - misalign - len) / UNALIGNED_BASE + 1;
+	unsigned short xsubi[3] = { 0x330e, (unsigned short)misalign, (unsigned short)len };
+
+	// all reads land in 'data', they are not looked at
+	pipeline_t *p = pipeline_create(fd, queue_depth);
+
+	hist_init(h);
+	cell -> n_ios = cell -> n_errors = 0;
+
+	uint64_t start_ns = get_ns(), end_ns = start_ns + uint64_t(cell_duration * 1000000000.0), now_ns = start_ns;
+	int rc = 0;
+
+	for(;;)
+	{
+		while(now_ns < end_ns && p -> n_free)
+		{
+			uint64_t offset = ((uint64_t(nrand48(xsubi)) << 31 | nrand48(xsubi)) % n_bases) * UNALIGNED_BASE + misalign;
+
+			if (pipeline_send(p, do_writes ? 1 : 0, offset, (char *)data, len) == -1)
+			{
+				std::cerr << "Failed to send request to server" << std::endl;
+				rc = -1;
+				break;
+			}
+		}
+
+		if (rc || p -> in_flight == 0)
+			break;
+
+		int slot = -1;
+		uint32_t err = 0;
+
+		if (pipeline_receive(p, &slot, &err))
+		{
+			rc = -1;
+			break;
+		}
+
+		now_ns = get_ns();
+
+		uint64_t latency_ns = now_ns - p -> submit_ns[slot];
+
+		if (err)
+			cell -> n_errors++;
+		else
+		{
+			cell -> n_ios++;
+			hist_add(h, latency_ns);
+		}
+
+		if (recording)
+			record_request(0, p -> type[slot], p -> offset[slot], len, p -> submit_ns[slot], now_ns, err);
+
+		if (slowest_n)
+			slowest_add(0, p -> type[slot], p -> offset[slot], len, p -> submit_ns[slot], now_ns, p -> in_flight_at_submit[slot], err);
+
+		if (metrics_enabled)
+			metrics_add(p -> type[slot], len, latency_ns, err);
+	}
+
+	pipeline_free(p);
+
+	if (rc)
+		return rc;
+
+	double took = (now_ns - start_ns) / 1000000000.0;
+
+	cell -> iops = cell -> n_ios / took;
+	cell -> p50_us = hist_percentile(h, 50.0) / 1000.0;
+	cell -> p99_us = hist_percentile(h, 99.0) / 1000.0;
+
+	return 0;
+}
+
+void print_matrix(const char *title, unaligned_cell_t cells[N_MISALIGNMENTS][N_LENGTHS], int what)
+{
+	printf("\n%s\n%-10s", title, "offset+");
+	for(size_t l=0; l<N_LENGTHS; l++)
+		printf(" %9u", lengths[l]);
+	printf("\n");
+
+	for(size_t m=0; m<N_MISALIGNMENTS; m++)
+	{
+		printf("%-10u", misalignments[m]);
+
+		for(size_t l=0; l<N_LENGTHS; l++)
+		{
+			const unaligned_cell_t *c = &cells[m][l];
+
+			if (c -> n_ios == 0)
+			{
+				printf(" %9s", c -> n_errors ? "refused" : "-");
+				continue;
+			}
+
+			if (what == 0)
+				printf(" %9.0f", c -> iops);
+			else if (what == 1)
+				printf(" %9.2f", c -> p50_us);
+			else if (what == 2)
+				printf(" %9.2f", c -> p99_us);
+			// relative to the block aligned offset with the same length
+			else if (cells[0][l].n_ios)
+				printf(" %8.2fx", c -> p50_us / cells[0][l].p50_us);
+			else
+				printf(" %9s", "-");
+		}
+
+		printf("\n");
+	}
+}
+
+int nbd_unaligned(std::string host, int port, bool do_writes, int queue_depth, double cell_duration)
+{
+	uint64_t size = -1;
+	uint32_t flags = -1;
+
+	int fd = connect_nbd(host, port, &size, &flags, false);
+	if (fd == -1)
+	{
+		std::cerr << "failed setting up NBD session" << std::endl;
+		return 1;
+	}
+
+	uint32_t longest = *std::max_element(lengths, lengths + N_LENGTHS);
+	uint32_t most_misaligned = *std::max_element(misalignments, misalignments + N_MISALIGNMENTS);
+
+	if (size < uint64_t(UNALIGNED_BASE) + longest + most_misaligned)
+	{
+		std::cerr << "export of " << size << " bytes is too small" << std::endl;
+		close_nbd(fd);
+		return 1;
+	}
+
+	std::cout << (do_writes ? "writes" : "reads") << " with " << queue_depth << " in flight over " << transport_name(host) << ", " << cell_duration << " seconds per combination of offset and length" << std::endl;
+
+	if (block_size_min > 1)
+		std::cout << "the server asks for multiples of " << block_size_min << " bytes; it may refuse the requests that are not" << std::endl;
+
+	unsigned char *data = (unsigned char *)malloc(longest);
+	memset(data, 0xa5, longest);
+
+	histogram_t *h = (histogram_t *)malloc(sizeof(histogram_t));
+
+	unaligned_cell_t cells[N_MISALIGNMENTS][N_LENGTHS];
+
+	// warm-up so that the first cell is not the odd one out
+	int rc = measure_cell(fd, size, do_writes, queue_depth, cell_duration, 0, 4096, data, h, &cells[0][0]) ? 1 : 0;
+
+	for(size_t m=0; m<N_MISALIGNMENTS && rc == 0; m++)
+	{
+		for(size_t l=0; l<N_LENGTHS; l++)
+		{
+			printf("offset +%u, length %u...\r", misalignments[m], lengths[l]);
+			fflush(NULL);
+
+			if (measure_cell(fd, size, do_writes, queue_depth, cell_duration, misalignments[m], lengths[l], data, h, &cells[m][l]))
+			{
+				std::cerr << "session failed at offset +" << misalignments[m] << ", length " << lengths[l] << std::endl;
+				rc = 1;
+				break;
+			}
+		}
+	}
+
+	free(h);
+	free(data);
+
+	close_nbd(fd);
+
+	if (rc)
+		return rc;
+
+	printf("%40s\r", "");
+	printf("rows: offset from a multiple of %d bytes, columns: request length in bytes\n", UNALIGNED_BASE);
+
+	print_matrix("IOPS", cells, 0);
+	print_matrix("p50 latency (us)", cells, 1);
+	print_matrix("p99 latency (us)", cells, 2);
+	print_matrix("p50 latency relative to the aligned offset", cells, 3);
+
+	return 0;
+}
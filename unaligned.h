@@ -0,0 +1,3 @@
+// IOPS and latency for each combination of offset misalignment and
+// request length (aligned or not), each for 'cell_duration' seconds
+int nbd_unaligned(std::string host, int port, bool do_writes, int queue_depth, double cell_duration);
@@ -1,6 +1,7 @@
 #include <iostream>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "utils-str.h"
 
@@ -36,6 +37,26 @@ void u32_to_bytes(unsigned char *p, uint32_t what)
 		p[index] = (what << index * 8) >> 24;
 }
 
+uint16_t bytes_to_u16(const unsigned char *in)
+{
+	return (in[0] << 8) | in[1];
+}
+
+void u16_to_bytes(unsigned char *p, uint16_t what)
+{
+	p[0] = what >> 8;
+	p[1] = what;
+}
+
+// the first byte is 0 and every byte equals the one after it
+bool is_zero(const unsigned char *p, size_t len)
+{
+	if (len == 0)
+		return true;
+
+	return p[0] == 0 && memcmp(p, p + 1, len - 1) == 0;
+}
+
 void hex_dump(const unsigned char *in, int size)
 {
 	for(int index=0; index<size; index++)
@@ -0,0 +1,210 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "utils-hist.h"
+
+void hist_init(histogram_t *h)
+{
+	memset(h, 0x00, sizeof(histogram_t));
+
+	h -> min = uint64_t(-1);
+}
+
+int hist_index(uint64_t value)
+{
+	if (value < HIST_SUB)
+		return value;
+
+	int msb = 63 - __builtin_clzll(value);
+	int group = msb - HIST_SUB_BITS + 1;
+	int sub = (value >> (msb - HIST_SUB_BITS)) - HIST_SUB;
+
+	return group * HIST_SUB + sub;
+}
+
+// middle of the range of values that end up in bucket 'index'
+uint64_t hist_value(int index)
+{
+	if (index < HIST_SUB)
+		return index;
+
+	int group = index / HIST_SUB;
+	int sub = index % HIST_SUB;
+	int shift = group - 1;
+
+	uint64_t low = uint64_t(HIST_SUB + sub) << shift;
+
+	return low + ((uint64_t(1) << shift) >> 1);
+}
+
+void hist_add(histogram_t *h, uint64_t value)
+{
+	h -> counts[hist_index(value)]++;
+	h -> n++;
+	h -> sum += value;
+
+	if (value < h -> min)
+		h -> min = value;
+
+	if (value > h -> max)
+		h -> max = value;
+}
+
+void hist_merge(histogram_t *dest, const histogram_t *src)
+{
+	for(int index=0; index<HIST_BUCKETS; index++)
+		dest -> counts[index] += src -> counts[index];
+
+	dest -> n += src -> n;
+	dest -> sum += src -> sum;
+
+	if (src -> min < dest -> min)
+		dest -> min = src -> min;
+
+	if (src -> max > dest -> max)
+		dest -> max = src -> max;
+}
+
+// only the adding thread writes, so a load and a store will do (no locked add)
+void hist_add_relaxed(histogram_t *h, uint64_t value)
+{
+	int index = hist_index(value);
+
+	__atomic_store_n(&h -> counts[index], h -> counts[index] + 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&h -> n, h -> n + 1, __ATOMIC_RELAXED);
+
+	double sum = h -> sum + value;
+	__atomic_store(&h -> sum, &sum, __ATOMIC_RELAXED);
+
+	if (value < h -> min)
+		__atomic_store_n(&h -> min, value, __ATOMIC_RELAXED);
+
+	if (value > h -> max)
+		__atomic_store_n(&h -> max, value, __ATOMIC_RELAXED);
+}
+
+void hist_merge_relaxed(histogram_t *dest, const histogram_t *src)
+{
+	for(int index=0; index<HIST_BUCKETS; index++)
+		dest -> counts[index] += __atomic_load_n(&src -> counts[index], __ATOMIC_RELAXED);
+
+	dest -> n += __atomic_load_n(&src -> n, __ATOMIC_RELAXED);
+
+	double sum = 0.0;
+	__atomic_load(&src -> sum, &sum, __ATOMIC_RELAXED);
+	dest -> sum += sum;
+
+	uint64_t min = __atomic_load_n(&src -> min, __ATOMIC_RELAXED);
+	if (min < dest -> min)
+		dest -> min = min;
+
+	uint64_t max = __atomic_load_n(&src -> max, __ATOMIC_RELAXED);
+	if (max > dest -> max)
+		dest -> max = max;
+}
+
+void hist_delta(histogram_t *dest, const histogram_t *now, const histogram_t *before)
+{
+	hist_init(dest);
+
+	int first = -1, last = -1;
+
+	for(int index=0; index<HIST_BUCKETS; index++)
+	{
+		uint64_t count = now -> counts[index] - before -> counts[index];
+
+		if (count == 0)
+			continue;
+
+		dest -> counts[index] = count;
+		dest -> n += count;
+
+		if (first == -1)
+			first = index;
+		last = index;
+	}
+
+	if (dest -> n == 0)
+		return;
+
+	dest -> sum = now -> sum - before -> sum;
+	dest -> min = now -> min < before -> min ? now -> min : hist_value(first);
+	dest -> max = now -> max > before -> max ? now -> max : hist_value(last);
+}
+
+// perc: 0...100
+uint64_t hist_percentile(const histogram_t *h, double perc)
+{
+	if (h -> n == 0)
+		return 0;
+
+	uint64_t want = uint64_t(h -> n * perc / 100.0);
+	if (want >= h -> n)
+		want = h -> n - 1;
+
+	uint64_t seen = 0;
+
+	for(int index=0; index<HIST_BUCKETS; index++)
+	{
+		seen += h -> counts[index];
+
+		if (seen > want)
+		{
+			uint64_t value = hist_value(index);
+
+			// the bucket middle can be outside of what was seen
+			if (value < h -> min)
+				return h -> min;
+
+			if (value > h -> max)
+				return h -> max;
+
+			return value;
+		}
+	}
+
+	return h -> max;
+}
+
+double hist_avg(const histogram_t *h)
+{
+	return h -> n ? h -> sum / h -> n : 0.0;
+}
+
+uint64_t hist_count_upto(const histogram_t *h, uint64_t value)
+{
+	if (value >= h -> max)
+		return h -> n;
+
+	int last = hist_index(value);
+	uint64_t n = 0;
+
+	for(int index=0; index<=last; index++)
+		n += h -> counts[index];
+
+	return n;
+}
+
+void hist_print_header(const char *name)
+{
+	printf("%-20s %10s %10s %10s %10s %10s %10s %10s %10s\n", name, "count", "min", "avg", "p50", "p90", "p99", "p99.9", "max");
+}
+
+void hist_print(const char *name, const histogram_t *h)
+{
+	if (h -> n == 0)
+	{
+		printf("%-20s %10d\n", name, 0);
+		return;
+	}
+
+	printf("%-20s %10llu %10.2f %10.2f %10.2f %10.2f %10.2f %10.2f %10.2f\n", name, (unsigned long long)h -> n,
+			h -> min / 1000.0,
+			hist_avg(h) / 1000.0,
+			hist_percentile(h, 50.0) / 1000.0,
+			hist_percentile(h, 90.0) / 1000.0,
+			hist_percentile(h, 99.0) / 1000.0,
+			hist_percentile(h, 99.9) / 1000.0,
+			h -> max / 1000.0);
+}
@@ -0,0 +1,34 @@
+// log-linear histogram of values (e.g. latencies in ns): exact below
+// HIST_SUB, above that HIST_SUB buckets per power of 2 (~3% resolution);
+// fixed size so it can be embedded, copied and merged
+#define HIST_SUB_BITS	5
+#define HIST_SUB	(1 << HIST_SUB_BITS)
+#define HIST_BUCKETS	((64 - HIST_SUB_BITS + 1) * HIST_SUB)
+
+typedef struct
+{
+	uint64_t counts[HIST_BUCKETS];
+	uint64_t n, min, max;
+	double sum;
+} histogram_t;
+
+void hist_init(histogram_t *h);
+void hist_add(histogram_t *h, uint64_t value);
+void hist_merge(histogram_t *dest, const histogram_t *src);
+// for a histogram that one thread adds to while another merges it: every
+// field is stored and loaded atomically (relaxed), so nothing is torn,
+// though a merge may see a value added to some fields and not yet to others
+void hist_add_relaxed(histogram_t *h, uint64_t value);
+void hist_merge_relaxed(histogram_t *dest, const histogram_t *src);
+// what was added to 'now' since 'before', an earlier copy of the same
+// histogram; min and max are exact when they changed in between, else at
+// bucket resolution
+void hist_delta(histogram_t *dest, const histogram_t *now, const histogram_t *before);
+uint64_t hist_percentile(const histogram_t *h, double perc);
+double hist_avg(const histogram_t *h);
+// how many values were <= value (at bucket resolution)
+uint64_t hist_count_upto(const histogram_t *h, uint64_t value);
+
+// a table of latency distributions in microseconds (values in ns)
+void hist_print_header(const char *name);
+void hist_print(const char *name, const histogram_t *h);
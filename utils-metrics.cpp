@@ -0,0 +1,382 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <iostream>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/mman.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+
+#include "utils-hist.h"
+#include "utils-metrics.h"
+#include "utils-net.h"
+#include "utils-str.h"
+#include "utils-time.h"
+
+bool metrics_enabled = false;
+
+typedef struct metrics_thread_t
+{
+	metrics_type_t types[METRICS_TYPES];
+	struct metrics_thread_t *next;
+} metrics_thread_t;
+
+__thread metrics_thread_t *my_metrics = NULL;
+
+metrics_thread_t *all_metrics = NULL;
+pthread_mutex_t all_metrics_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// the shared memory segment or, with only the HTTP endpoint, plain memory
+metrics_shm_t *published = NULL;
+std::string shm_path;
+
+int http_fd = -1;
+pthread_t publisher_tid, http_tid;
+bool http_started = false;
+volatile bool metrics_stopping = false;
+
+const char *metrics_type_names[METRICS_TYPES] = { "read", "write", "other" };
+
+uint64_t wall_ns()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+
+	return uint64_t(ts.tv_sec) * 1000000000ll + ts.tv_nsec;
+}
+
+void metrics_add(int op, uint32_t len, uint64_t latency_ns, uint32_t error)
+{
+	metrics_thread_t *m = my_metrics;
+
+	if (!m)
+	{
+		m = my_metrics = (metrics_thread_t *)malloc(sizeof(metrics_thread_t));
+
+		for(int index=0; index<METRICS_TYPES; index++)
+		{
+			m -> types[index].n_requests = m -> types[index].n_bytes = m -> types[index].n_errors = 0;
+			hist_init(&m -> types[index].latency);
+		}
+
+		pthread_mutex_lock(&all_metrics_lock);
+		m -> next = all_metrics;
+		all_metrics = m;
+		pthread_mutex_unlock(&all_metrics_lock);
+	}
+
+	metrics_type_t *t = &m -> types[op == 0 || op == 1 ? op : 2];
+
+	// only this thread writes these while the publisher reads them: relaxed
+	// atomics so that it never sees a torn value, at no cost on this side
+	__atomic_store_n(&t -> n_requests, t -> n_requests + 1, __ATOMIC_RELAXED);
+
+	if (error)
+		__atomic_store_n(&t -> n_errors, t -> n_errors + 1, __ATOMIC_RELAXED);
+	else
+	{
+		__atomic_store_n(&t -> n_bytes, t -> n_bytes + len, __ATOMIC_RELAXED);
+		hist_add_relaxed(&t -> latency, latency_ns);
+	}
+}
+
+void publish(bool finished)
+{
+	metrics_type_t *merged = (metrics_type_t *)malloc(sizeof(metrics_type_t) * METRICS_TYPES);
+
+	for(int index=0; index<METRICS_TYPES; index++)
+	{
+		merged[index].n_requests = merged[index].n_bytes = merged[index].n_errors = 0;
+		hist_init(&merged[index].latency);
+	}
+
+	pthread_mutex_lock(&all_metrics_lock);
+
+	for(metrics_thread_t *m = all_metrics; m; m = m -> next)
+	{
+		for(int index=0; index<METRICS_TYPES; index++)
+		{
+			merged[index].n_requests += __atomic_load_n(&m -> types[index].n_requests, __ATOMIC_RELAXED);
+			merged[index].n_bytes += __atomic_load_n(&m -> types[index].n_bytes, __ATOMIC_RELAXED);
+			merged[index].n_errors += __atomic_load_n(&m -> types[index].n_errors, __ATOMIC_RELAXED);
+			hist_merge_relaxed(&merged[index].latency, &m -> types[index].latency);
+		}
+	}
+
+	pthread_mutex_unlock(&all_metrics_lock);
+
+	__atomic_add_fetch(&published -> seq, 1, __ATOMIC_ACQ_REL);
+
+	memcpy(published -> types, merged, sizeof(metrics_type_t) * METRICS_TYPES);
+	published -> update_ns = wall_ns();
+	published -> finished = finished;
+
+	__atomic_add_fetch(&published -> seq, 1, __ATOMIC_ACQ_REL);
+
+	free(merged);
+}
+
+void * publisher_thread(void *arg)
+{
+	while(!metrics_stopping)
+	{
+		USLEEP(useconds_t(METRICS_INTERVAL * 1000000.0));
+
+		publish(false);
+	}
+
+	return NULL;
+}
+
+// consistent copy of what was published last
+void read_published(metrics_shm_t *out)
+{
+	for(;;)
+	{
+		uint64_t before = __atomic_load_n(&published -> seq, __ATOMIC_ACQUIRE);
+
+		if (before & 1)
+			continue;
+
+		memcpy(out, (const void *)published, sizeof(metrics_shm_t));
+
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+		if (__atomic_load_n(&published -> seq, __ATOMIC_RELAXED) == before)
+			break;
+	}
+}
+
+std::string prometheus_text()
+{
+	// seconds
+	const double bounds[] = { 0.00001, 0.000025, 0.00005, 0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1.0 };
+
+	metrics_shm_t *m = (metrics_shm_t *)malloc(sizeof(metrics_shm_t));
+	read_published(m);
+
+	std::string out;
+
+	out += "# HELP nbd_verify_requests_total Requests completed.\n# TYPE nbd_verify_requests_total counter\n";
+	for(int index=0; index<METRICS_TYPES; index++)
+		out += format("nbd_verify_requests_total{type=\"%s\"} %llu\n", metrics_type_names[index], (unsigned long long)m -> types[index].n_requests);
+
+	out += "# HELP nbd_verify_bytes_total Bytes transferred by requests that succeeded.\n# TYPE nbd_verify_bytes_total counter\n";
+	for(int index=0; index<METRICS_TYPES; index++)
+		out += format("nbd_verify_bytes_total{type=\"%s\"} %llu\n", metrics_type_names[index], (unsigned long long)m -> types[index].n_bytes);
+
+	out += "# HELP nbd_verify_errors_total Requests the server returned an error for.\n# TYPE nbd_verify_errors_total counter\n";
+	for(int index=0; index<METRICS_TYPES; index++)
+		out += format("nbd_verify_errors_total{type=\"%s\"} %llu\n", metrics_type_names[index], (unsigned long long)m -> types[index].n_errors);
+
+	out += "# HELP nbd_verify_latency_seconds Time from sending a request until its reply was in.\n# TYPE nbd_verify_latency_seconds histogram\n";
+	for(int index=0; index<METRICS_TYPES; index++)
+	{
+		const histogram_t *h = &m -> types[index].latency;
+
+		for(size_t b=0; b<sizeof bounds / sizeof bounds[0]; b++)
+			out += format("nbd_verify_latency_seconds_bucket{type=\"%s\",le=\"%g\"} %llu\n", metrics_type_names[index], bounds[b], (unsigned long long)hist_count_upto(h, uint64_t(bounds[b] * 1000000000.0)));
+
+		out += format("nbd_verify_latency_seconds_bucket{type=\"%s\",le=\"+Inf\"} %llu\n", metrics_type_names[index], (unsigned long long)h -> n);
+		out += format("nbd_verify_latency_seconds_sum{type=\"%s\"} %.9f\n", metrics_type_names[index], h -> sum / 1000000000.0);
+		out += format("nbd_verify_latency_seconds_count{type=\"%s\"} %llu\n", metrics_type_names[index], (unsigned long long)h -> n);
+	}
+
+	out += "# HELP nbd_verify_start_time_seconds When nbd-verify started measuring.\n# TYPE nbd_verify_start_time_seconds gauge\n";
+	out += format("nbd_verify_start_time_seconds %.3f\n", m -> start_ns / 1000000000.0);
+
+	free(m);
+
+	return out;
+}
+
+void * http_thread(void *arg)
+{
+	while(!metrics_stopping)
+	{
+		// wake up now and then to see if we should stop
+		fd_set rfds;
+		FD_ZERO(&rfds);
+		FD_SET(http_fd, &rfds);
+
+		struct timeval tv = { 0, 250000 };
+
+		if (select(http_fd + 1, &rfds, NULL, NULL, &tv) <= 0)
+			continue;
+
+		int fd = accept(http_fd, NULL, NULL);
+		if (fd == -1)
+			continue;
+
+		// the request itself does not matter: every path gets the metrics
+		struct timeval rtv = { 1, 0 };
+		setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &rtv, sizeof rtv);
+
+		char request[4096];
+		if (recv(fd, request, sizeof request, 0) > 0)
+		{
+			std::string body = prometheus_text();
+			std::string reply = format("HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %zu\r\nConnection: close\r\n\r\n", body.size()) + body;
+
+			WRITE(fd, reply.c_str(), reply.size());
+		}
+
+		close(fd);
+	}
+
+	return NULL;
+}
+
+int start_http(int port)
+{
+	http_fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (http_fd == -1)
+	{
+		std::cerr << "cannot create socket for the metrics endpoint: " << strerror(errno) << std::endl;
+		return -1;
+	}
+
+	int on = 1;
+	setsockopt(http_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof on);
+
+	struct sockaddr_in addr;
+	memset(&addr, 0x00, sizeof addr);
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	if (bind(http_fd, (struct sockaddr *)&addr, sizeof addr) == -1 || listen(http_fd, 16) == -1)
+	{
+		std::cerr << "cannot listen on 127.0.0.1:" << port << " for the metrics endpoint: " << strerror(errno) << std::endl;
+		close(http_fd);
+		http_fd = -1;
+		return -1;
+	}
+
+	if (pthread_create(&http_tid, NULL, http_thread, NULL))
+	{
+		std::cerr << "cannot start thread for the metrics endpoint" << std::endl;
+		return -1;
+	}
+
+	http_started = true;
+
+	std::cout << "metrics (Prometheus) on http://127.0.0.1:" << port << "/metrics" << std::endl;
+
+	return 0;
+}
+
+int metrics_start(const char *shm_name, int http_port)
+{
+	if (shm_name)
+	{
+		shm_path = std::string("/") + shm_name;
+
+		int fd = shm_open(shm_path.c_str(), O_CREAT | O_RDWR | O_TRUNC, 0644);
+		if (fd == -1)
+		{
+			std::cerr << "cannot create shared memory segment " << shm_path << ": " << strerror(errno) << std::endl;
+			return -1;
+		}
+
+		if (ftruncate(fd, sizeof(metrics_shm_t)) == -1)
+		{
+			std::cerr << "cannot size shared memory segment " << shm_path << ": " << strerror(errno) << std::endl;
+			close(fd);
+			shm_unlink(shm_path.c_str());
+			return -1;
+		}
+
+		void *p = mmap(NULL, sizeof(metrics_shm_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		close(fd);
+
+		if (p == MAP_FAILED)
+		{
+			std::cerr << "cannot map shared memory segment " << shm_path << ": " << strerror(errno) << std::endl;
+			shm_unlink(shm_path.c_str());
+			return -1;
+		}
+
+		published = (metrics_shm_t *)p;
+	}
+	else
+	{
+		published = (metrics_shm_t *)malloc(sizeof(metrics_shm_t));
+	}
+
+	memset((void *)published, 0x00, sizeof(metrics_shm_t));
+	memcpy(published -> magic, METRICS_MAGIC, 8);
+	published -> version = METRICS_VERSION;
+	published -> size = sizeof(metrics_shm_t);
+	published -> start_ns = published -> update_ns = wall_ns();
+	published -> pid = getpid();
+
+	for(int index=0; index<METRICS_TYPES; index++)
+		hist_init(&published -> types[index].latency);
+
+	metrics_stopping = false;
+	metrics_enabled = true;
+
+	if (pthread_create(&publisher_tid, NULL, publisher_thread, NULL))
+	{
+		std::cerr << "cannot start thread publishing the metrics" << std::endl;
+		metrics_enabled = false;
+		return -1;
+	}
+
+	if (shm_name)
+		std::cout << "metrics in shared memory segment " << shm_path << " (/dev/shm" << shm_path << ")" << std::endl;
+
+	if (http_port && start_http(http_port))
+	{
+		metrics_stop();
+		return -1;
+	}
+
+	return 0;
+}
+
+void metrics_stop()
+{
+	if (!metrics_enabled)
+		return;
+
+	metrics_stopping = true;
+
+	pthread_join(publisher_tid, NULL);
+
+	if (http_started)
+	{
+		pthread_join(http_tid, NULL);
+		http_started = false;
+	}
+
+	if (http_fd != -1)
+	{
+		close(http_fd);
+		http_fd = -1;
+	}
+
+	// the totals, for who still has it mapped
+	publish(true);
+
+	if (shm_path.empty())
+		free(published);
+	else
+	{
+		munmap((void *)published, sizeof(metrics_shm_t));
+		shm_unlink(shm_path.c_str());
+	}
+
+	published = NULL;
+	metrics_enabled = false;
+}
@@ -0,0 +1,44 @@
+// live counters and latency histograms for external monitoring: published
+// every METRICS_INTERVAL seconds in a POSIX shared memory segment and/or
+// served on 127.0.0.1 in the Prometheus text format. The measuring
+// threads only add to counters of their own; a separate thread merges
+// and publishes them.
+#define METRICS_MAGIC		"NBDVMET1"
+#define METRICS_VERSION		1
+#define METRICS_INTERVAL	1.0
+
+// read, write, other (flush, trim)
+#define METRICS_TYPES		3
+
+typedef struct
+{
+	uint64_t n_requests, n_bytes, n_errors;
+	// ns
+	histogram_t latency;
+} metrics_type_t;
+
+// the layout of the shared memory segment (byte order of the host). A
+// reader copies it and then checks that seq was even and unchanged
+// before and after, else it retries (seqlock).
+typedef struct
+{
+	char magic[8];
+	uint32_t version, size;
+	volatile uint64_t seq;
+	// wall clock, ns since the epoch
+	uint64_t start_ns, update_ns;
+	uint32_t pid;
+	// 1 when nbd-verify is done; the segment is then also removed
+	uint32_t finished;
+	metrics_type_t types[METRICS_TYPES];
+} metrics_shm_t;
+
+extern bool metrics_enabled;
+
+// shm_name: e.g. "nbd-verify" for /dev/shm/nbd-verify (NULL for none),
+// http_port: 0 for no Prometheus endpoint
+int metrics_start(const char *shm_name, int http_port);
+void metrics_stop();
+
+// op: NBD command type
+void metrics_add(int op, uint32_t len, uint64_t latency_ns, uint32_t error);
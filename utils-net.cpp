@@ -1,3 +1,5 @@
+#include <algorithm>
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -8,12 +10,20 @@
 #include <netdb.h>
 #include <sys/time.h>
 #include <netinet/tcp.h>
+#include <sys/un.h>
+#ifdef __linux__
+#include <linux/vm_sockets.h>
+#endif
 #include <fcntl.h>
+#include <sys/uio.h>
 #include <unistd.h>
 #include <string>
 
 #include "utils-str.h"
 
+// system calls done by READ, WRITE etc. (in this thread)
+__thread uint64_t n_syscalls = 0;
+
 ssize_t WRITE(int fd, const char *whereto, size_t len)
 {
         ssize_t cnt=0;
@@ -21,6 +31,7 @@ ssize_t WRITE(int fd, const char *whereto, size_t len)
         while(len>0)
         {
 		ssize_t rc = write(fd, whereto, len);
+		n_syscalls++;
 
 		if (rc == -1)
 		{
@@ -49,6 +60,7 @@ ssize_t READ(int fd, unsigned char *whereto, size_t len)
         while(len>0)
         {
 		ssize_t rc = read(fd, whereto, len);
+		n_syscalls++;
 
 		if (rc == -1)
 		{
@@ -70,8 +82,322 @@ ssize_t READ(int fd, unsigned char *whereto, size_t len)
         return cnt;
 }
 
+ssize_t WRITEV(int fd, struct iovec *iov, int iovcnt)
+{
+	ssize_t cnt = 0;
+
+	while(iovcnt > 0)
+	{
+		ssize_t rc = writev(fd, iov, iovcnt);
+		n_syscalls++;
+
+		if (rc == -1)
+		{
+			if (errno != EINTR && errno != EINPROGRESS && errno != EAGAIN)
+				return -1;
+
+			continue;
+		}
+		else if (rc == 0)
+			return 0;
+
+		cnt += rc;
+
+		// skip what was sent
+		while(iovcnt > 0 && size_t(rc) >= iov -> iov_len)
+		{
+			rc -= iov -> iov_len;
+			iov++;
+			iovcnt--;
+		}
+
+		if (iovcnt > 0)
+		{
+			iov -> iov_base = (char *)iov -> iov_base + rc;
+			iov -> iov_len -= rc;
+		}
+	}
+
+	return cnt;
+}
+
+// receive buffering: instead of a read() per reply header, payload and
+// handshake field, read() as much as is available into a ring buffer per
+// connection and take the fields from it. Reads of at least
+// rx_direct_threshold bytes go straight into the caller's buffer once
+// what is buffered has been handed out.
+size_t rx_buffer_size = 128 * 1024;
+size_t rx_direct_threshold = 16 * 1024;
+
+#define MAX_BUFFERED_FD 65536
+
+typedef struct
+{
+	unsigned char *buffer;
+	size_t size;	// power of 2
+
+	// total bytes put in/taken out; the difference is what is buffered
+	uint64_t head, tail;
+} rx_ring_t;
+
+static rx_ring_t *rx_rings[MAX_BUFFERED_FD];
+
+rx_ring_t *get_rx_ring(int fd)
+{
+	if (fd < 0 || fd >= MAX_BUFFERED_FD || rx_buffer_size == 0)
+		return NULL;
+
+	if (rx_rings[fd] == NULL)
+	{
+		size_t size = 1;
+		while(size < rx_buffer_size)
+			size <<= 1;
+
+		rx_ring_t *r = (rx_ring_t *)malloc(sizeof(rx_ring_t));
+		r -> buffer = (unsigned char *)malloc(size);
+		r -> size = size;
+		r -> head = r -> tail = 0;
+
+		rx_rings[fd] = r;
+	}
+
+	return rx_rings[fd];
+}
+
+size_t buffered_bytes(int fd)
+{
+	if (fd < 0 || fd >= MAX_BUFFERED_FD || rx_rings[fd] == NULL)
+		return 0;
+
+	return rx_rings[fd] -> head - rx_rings[fd] -> tail;
+}
+
+// one read() of whatever fits in the ring
+ssize_t rx_fill(int fd, rx_ring_t *r)
+{
+	size_t mask = r -> size - 1;
+	size_t free_bytes = r -> size - (r -> head - r -> tail);
+	size_t start = r -> head & mask;
+	size_t first = std::min(free_bytes, r -> size - start);
+
+	struct iovec iov[2] = { { &r -> buffer[start], first }, { r -> buffer, free_bytes - first } };
+
+	for(;;)
+	{
+		ssize_t rc = readv(fd, iov, iov[1].iov_len ? 2 : 1);
+		n_syscalls++;
+
+		if (rc == -1)
+		{
+			if (errno == EINTR || errno == EAGAIN)
+				continue;
+
+			return -1;
+		}
+
+		r -> head += rc;
+
+		return rc;
+	}
+}
+
+void rx_take(rx_ring_t *r, unsigned char *whereto, size_t len)
+{
+	size_t mask = r -> size - 1;
+	size_t start = r -> tail & mask;
+	size_t first = std::min(len, r -> size - start);
+
+	memcpy(whereto, &r -> buffer[start], first);
+	memcpy(&whereto[first], r -> buffer, len - first);
+
+	r -> tail += len;
+}
+
+ssize_t READ_BUFFERED(int fd, unsigned char *whereto, size_t len)
+{
+	rx_ring_t *r = get_rx_ring(fd);
+
+	if (r == NULL)
+		return READ(fd, whereto, len);
+
+	ssize_t cnt = 0;
+
+	while(len > 0)
+	{
+		size_t avail = r -> head - r -> tail;
+
+		if (avail)
+		{
+			size_t cur = std::min(avail, len);
+
+			rx_take(r, whereto, cur);
+
+			whereto += cur;
+			len -= cur;
+			cnt += cur;
+
+			continue;
+		}
+
+		// large payloads: no copy via the ring
+		if (len >= rx_direct_threshold)
+		{
+			ssize_t rc = READ(fd, whereto, len);
+			if (rc == -1)
+				return -1;
+
+			return cnt + rc;
+		}
+
+		ssize_t rc = rx_fill(fd, r);
+		if (rc == -1)
+			return -1;
+
+		if (rc == 0)
+			break;
+	}
+
+	return cnt;
+}
+
+// for busy polling: get whatever has arrived without blocking; returns
+// the number of bytes, 0 on EOF or -1 (errno EAGAIN if nothing came in)
+ssize_t rx_poll(int fd)
+{
+	rx_ring_t *r = get_rx_ring(fd);
+
+	ssize_t rc = -1;
+
+	if (r == NULL)
+	{
+		unsigned char dummy = 0;
+
+		rc = recv(fd, &dummy, 1, MSG_PEEK | MSG_DONTWAIT);
+	}
+	else
+	{
+		size_t mask = r -> size - 1;
+		size_t free_bytes = r -> size - (r -> head - r -> tail);
+		size_t start = r -> head & mask;
+		size_t first = std::min(free_bytes, r -> size - start);
+
+		struct iovec iov[2] = { { &r -> buffer[start], first }, { r -> buffer, free_bytes - first } };
+
+		struct msghdr msg;
+		memset(&msg, 0x00, sizeof msg);
+		msg.msg_iov = iov;
+		msg.msg_iovlen = iov[1].iov_len ? 2 : 1;
+
+		rc = recvmsg(fd, &msg, MSG_DONTWAIT);
+
+		if (rc > 0)
+			r -> head += rc;
+	}
+
+	n_syscalls++;
+
+	return rc;
+}
+
+// let the kernel busy poll the device queue for 'usecs' on blocking reads (TCP)
+int set_busy_poll(int fd, int usecs)
+{
+#ifdef SO_BUSY_POLL
+	if (setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, (char *)&usecs, sizeof usecs) == -1)
+		return -1;
+
+	return 0;
+#else
+	return -1;
+#endif
+}
+
+// close a connection and forget what was buffered for it
+int CLOSE(int fd)
+{
+	if (fd >= 0 && fd < MAX_BUFFERED_FD && rx_rings[fd])
+	{
+		free(rx_rings[fd] -> buffer);
+		free(rx_rings[fd]);
+		rx_rings[fd] = NULL;
+	}
+
+	return close(fd);
+}
+
+// "unix:/path/to/socket", "vsock:cid" or a host name/address for TCP
+std::string transport_name(std::string hostname)
+{
+	if (hostname.compare(0, 5, "unix:") == 0)
+		return "unix";
+
+	if (hostname.compare(0, 6, "vsock:") == 0)
+		return "vsock";
+
+	return "tcp";
+}
+
+int connect_to_unix(std::string path)
+{
+	struct sockaddr_un sa;
+	memset(&sa, 0x00, sizeof sa);
+	sa.sun_family = AF_UNIX;
+
+	if (path.size() >= sizeof sa.sun_path)
+	{
+		fprintf(stderr, "Path %s is too long for a unix domain socket\n", path.c_str());
+		return -1;
+	}
+
+	strcpy(sa.sun_path, path.c_str());
+
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd == -1)
+		return -1;
+
+	if (connect(fd, (struct sockaddr *)&sa, sizeof sa) == -1)
+	{
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+int connect_to_vsock(std::string cid, int port)
+{
+#ifdef AF_VSOCK
+	struct sockaddr_vm sa;
+	memset(&sa, 0x00, sizeof sa);
+	sa.svm_family = AF_VSOCK;
+	sa.svm_cid = atoi(cid.c_str());
+	sa.svm_port = port;
+
+	int fd = socket(AF_VSOCK, SOCK_STREAM, 0);
+	if (fd == -1)
+		return -1;
+
+	if (connect(fd, (struct sockaddr *)&sa, sizeof sa) == -1)
+	{
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+#else
+	fprintf(stderr, "vsock is not supported on this platform\n");
+	return -1;
+#endif
+}
+
 int connect_to(std::string hostname, int port)
 {
+	if (transport_name(hostname) == "unix")
+		return connect_to_unix(hostname.substr(5));
+
+	if (transport_name(hostname) == "vsock")
+		return connect_to_vsock(hostname.substr(6), port);
+
 	std::string portstr = format("%d", port);
 	int fd = -1;
 
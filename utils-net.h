@@ -1,3 +1,13 @@
+extern __thread uint64_t n_syscalls;
+extern size_t rx_buffer_size, rx_direct_threshold;
+
 ssize_t WRITE(int fd, const char *whereto, size_t len);
+ssize_t WRITEV(int fd, struct iovec *iov, int iovcnt);
 ssize_t READ(int fd, unsigned char *whereto, size_t len);
+ssize_t READ_BUFFERED(int fd, unsigned char *whereto, size_t len);
+size_t buffered_bytes(int fd);
+ssize_t rx_poll(int fd);
+int set_busy_poll(int fd, int usecs);
+int CLOSE(int fd);
+std::string transport_name(std::string hostname);
 int connect_to(std::string hostname, int port);
@@ -0,0 +1,150 @@
+#include <errno.h>
+#include <iostream>
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <string.h>
+#include <unistd.h>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+#include "utils-net.h"
+#include "utils-perf.h"
+
+bool perf_enabled = false;
+
+const struct { uint32_t type; uint64_t config; } perf_events[PERF_N_COUNTERS] = {
+	{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+	{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+	{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+	{ PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES }
+};
+
+int perf_open(uint32_t type, uint64_t config, bool exclude_kernel)
+{
+	struct perf_event_attr attr;
+
+	memset(&attr, 0x00, sizeof attr);
+	attr.size = sizeof attr;
+	attr.type = type;
+	attr.config = config;
+	attr.disabled = 1;
+	attr.exclude_kernel = exclude_kernel;
+	attr.exclude_hv = 1;
+	attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+	// this thread only, on any cpu
+	return syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+void perf_start(perf_counters_t *pc)
+{
+	static bool warned = false;
+
+	for(int index=0; index<PERF_N_COUNTERS; index++)
+	{
+		pc -> values[index] = uint64_t(-1);
+
+		// the kernel side of the system calls is part of the cost, but
+		// counting it may not be allowed (perf_event_paranoid)
+		pc -> fds[index] = perf_open(perf_events[index].type, perf_events[index].config, false);
+		if (pc -> fds[index] == -1)
+			pc -> fds[index] = perf_open(perf_events[index].type, perf_events[index].config, true);
+
+		if (pc -> fds[index] == -1 && !warned)
+		{
+			std::cerr << "perf_event_open failed (" << strerror(errno) << "), some counters are not available" << std::endl;
+			warned = true;
+		}
+	}
+
+	getrusage(RUSAGE_THREAD, &pc -> ru_start);
+	pc -> syscalls_start = n_syscalls;
+
+	for(int index=0; index<PERF_N_COUNTERS; index++)
+	{
+		if (pc -> fds[index] != -1)
+			ioctl(pc -> fds[index], PERF_EVENT_IOC_ENABLE, 0);
+	}
+}
+
+void perf_stop(perf_counters_t *pc)
+{
+	for(int index=0; index<PERF_N_COUNTERS; index++)
+	{
+		if (pc -> fds[index] != -1)
+			ioctl(pc -> fds[index], PERF_EVENT_IOC_DISABLE, 0);
+	}
+
+	pc -> syscalls_end = n_syscalls;
+	getrusage(RUSAGE_THREAD, &pc -> ru_end);
+
+	for(int index=0; index<PERF_N_COUNTERS; index++)
+	{
+		if (pc -> fds[index] == -1)
+			continue;
+
+		// value, time enabled, time running
+		uint64_t buffer[3] = { 0 };
+
+		if (read(pc -> fds[index], buffer, sizeof buffer) == sizeof buffer && buffer[2])
+		{
+			// scale up when the counter had to share the pmu with others
+			pc -> values[index] = buffer[2] < buffer[1] ? uint64_t(double(buffer[0]) * buffer[1] / buffer[2]) : buffer[0];
+		}
+
+		close(pc -> fds[index]);
+		pc -> fds[index] = -1;
+	}
+}
+
+double tv_diff(const struct timeval *a, const struct timeval *b)
+{
+	return (b -> tv_sec - a -> tv_sec) + (b -> tv_usec - a -> tv_usec) / 1000000.0;
+}
+
+std::string per_op(uint64_t value, uint64_t n_ops)
+{
+	if (value == uint64_t(-1))
+		return "-";
+
+	char buffer[32];
+	snprintf(buffer, sizeof buffer, "%.2f", double(value) / n_ops);
+
+	return buffer;
+}
+
+void perf_print_header()
+{
+	printf("%-20s %10s %10s %10s %10s %10s %10s %10s %10s\n", "client cost per op", "cycles", "instr.", "IPC", "cache-miss", "ctx-sw", "syscalls", "user us", "sys us");
+}
+
+void perf_print(const char *name, const perf_counters_t *pc, uint64_t n_ops)
+{
+	if (n_ops == 0)
+		return;
+
+	double user = tv_diff(&pc -> ru_start.ru_utime, &pc -> ru_end.ru_utime);
+	double sys = tv_diff(&pc -> ru_start.ru_stime, &pc -> ru_end.ru_stime);
+	uint64_t ctx = (pc -> ru_end.ru_nvcsw - pc -> ru_start.ru_nvcsw) + (pc -> ru_end.ru_nivcsw - pc -> ru_start.ru_nivcsw);
+
+	std::string ipc = "-";
+	if (pc -> values[0] != uint64_t(-1) && pc -> values[1] != uint64_t(-1) && pc -> values[0])
+	{
+		char buffer[32];
+		snprintf(buffer, sizeof buffer, "%.2f", double(pc -> values[1]) / pc -> values[0]);
+		ipc = buffer;
+	}
+
+	printf("%-20s %10s %10s %10s %10s %10s %10.2f %10.2f %10.2f\n", name,
+			per_op(pc -> values[0], n_ops).c_str(),
+			per_op(pc -> values[1], n_ops).c_str(),
+			ipc.c_str(),
+			per_op(pc -> values[2], n_ops).c_str(),
+			per_op(pc -> values[3] != uint64_t(-1) ? pc -> values[3] : ctx, n_ops).c_str(),
+			double(pc -> syscalls_end - pc -> syscalls_start) / n_ops,
+			user * 1000000.0 / n_ops,
+			sys * 1000000.0 / n_ops);
+}
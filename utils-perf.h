@@ -0,0 +1,20 @@
+// what the client itself costs: hardware/software counters of the
+// calling thread (perf_event_open, where permitted) plus getrusage
+#define PERF_N_COUNTERS 4
+
+typedef struct
+{
+	int fds[PERF_N_COUNTERS];
+	uint64_t values[PERF_N_COUNTERS];
+	struct rusage ru_start, ru_end;
+	uint64_t syscalls_start, syscalls_end;
+} perf_counters_t;
+
+extern bool perf_enabled;
+
+void perf_start(perf_counters_t *pc);
+void perf_stop(perf_counters_t *pc);
+
+void perf_print_header();
+// per operation; counters that could not be opened show as "-"
+void perf_print(const char *name, const perf_counters_t *pc, uint64_t n_ops);
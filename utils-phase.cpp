@@ -0,0 +1,90 @@
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "utils-hist.h"
+#include "utils-phase.h"
+#include "utils-time.h"
+
+volatile sig_atomic_t phase_timing = 0;
+
+const char *phase_names[PH_N] = { "build header", "send", "wait for reply", "payload receive", "compare" };
+
+typedef struct phase_stats_t
+{
+	histogram_t h[PH_N];
+	struct phase_stats_t *next;
+} phase_stats_t;
+
+// each thread adds to its own histograms; the list is only walked when printing
+__thread phase_stats_t *my_stats = NULL;
+
+phase_stats_t *all_stats = NULL;
+pthread_mutex_t all_stats_lock = PTHREAD_MUTEX_INITIALIZER;
+
+uint64_t phase_start()
+{
+	return phase_timing ? get_ns() : 0;
+}
+
+void phase_end(phase_t phase, uint64_t start_ns)
+{
+	if (start_ns == 0)
+		return;
+
+	if (!my_stats)
+	{
+		my_stats = (phase_stats_t *)malloc(sizeof(phase_stats_t));
+
+		for(int index=0; index<PH_N; index++)
+			hist_init(&my_stats -> h[index]);
+
+		pthread_mutex_lock(&all_stats_lock);
+		my_stats -> next = all_stats;
+		all_stats = my_stats;
+		pthread_mutex_unlock(&all_stats_lock);
+	}
+
+	hist_add(&my_stats -> h[phase], get_ns() - start_ns);
+}
+
+void phase_toggle_handler(int sig)
+{
+	phase_timing = !phase_timing;
+}
+
+void phase_print()
+{
+	histogram_t *total = (histogram_t *)malloc(sizeof(histogram_t) * PH_N);
+	uint64_t n = 0;
+
+	for(int index=0; index<PH_N; index++)
+		hist_init(&total[index]);
+
+	pthread_mutex_lock(&all_stats_lock);
+
+	for(phase_stats_t *p = all_stats; p; p = p -> next)
+	{
+		for(int index=0; index<PH_N; index++)
+		{
+			hist_merge(&total[index], &p -> h[index]);
+			n += p -> h[index].n;
+		}
+	}
+
+	pthread_mutex_unlock(&all_stats_lock);
+
+	if (n)
+	{
+		printf("\n");
+		hist_print_header("phase (us)");
+
+		for(int index=0; index<PH_N; index++)
+			hist_print(phase_names[index], &total[index]);
+	}
+
+	free(total);
+}
@@ -0,0 +1,14 @@
+// where the time of a request goes; each phase is timed into its own
+// histogram (ns) while phase_timing is set (-I, toggled by SIGUSR1)
+typedef enum { PH_BUILD, PH_SEND, PH_WAIT, PH_PAYLOAD, PH_COMPARE, PH_N } phase_t;
+
+extern volatile sig_atomic_t phase_timing;
+
+// returns 0 when timing is off; phase_end() then does nothing
+uint64_t phase_start();
+void phase_end(phase_t phase, uint64_t start_ns);
+
+void phase_toggle_handler(int sig);
+
+// merged over all threads; prints nothing when nothing was timed
+void phase_print();
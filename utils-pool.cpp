@@ -0,0 +1,151 @@
+#include <iostream>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "utils-pool.h"
+
+#define POOL_PAGE_SIZE		4096
+#define POOL_HUGE_PAGE_SIZE	(2 * 1024 * 1024)
+#define POOL_EMPTY		0xffffffff
+
+size_t round_up(size_t value, size_t multiple)
+{
+	return (value + multiple - 1) / multiple * multiple;
+}
+
+buffer_pool_t *pool_create(size_t buffer_size, uint32_t n_buffers)
+{
+	buffer_pool_t *p = (buffer_pool_t *)calloc(1, sizeof(buffer_pool_t));
+
+	p -> buffer_size = buffer_size;
+	p -> stride = round_up(buffer_size, POOL_PAGE_SIZE);
+	p -> n_buffers = n_buffers;
+	p -> region_size = round_up(p -> stride * n_buffers, POOL_PAGE_SIZE);
+
+	void *region = MAP_FAILED;
+
+	// less than one huge page is not worth rounding up for
+	if (p -> region_size < POOL_HUGE_PAGE_SIZE)
+	{
+		region = mmap(NULL, p -> region_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		p -> backing = "normal pages";
+	}
+	else
+	{
+		// explicitly reserved huge pages first, then transparent ones,
+		// then whatever the kernel gives
+		p -> region_size = round_up(p -> region_size, POOL_HUGE_PAGE_SIZE);
+
+		region = mmap(NULL, p -> region_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		p -> backing = "hugetlb";
+	}
+
+	if (region == MAP_FAILED && p -> region_size >= POOL_HUGE_PAGE_SIZE)
+	{
+		region = mmap(NULL, p -> region_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		p -> backing = "transparent huge pages";
+
+		if (region != MAP_FAILED && madvise(region, p -> region_size, MADV_HUGEPAGE) == -1)
+			p -> backing = "normal pages";
+	}
+
+	if (region == MAP_FAILED)
+	{
+		std::cerr << "cannot allocate " << p -> region_size << " bytes for the buffer pool, allocating per request" << std::endl;
+
+		p -> region = NULL;
+		p -> region_size = 0;
+		p -> n_buffers = 0;
+		p -> backing = "none";
+	}
+	else
+	{
+		p -> region = (unsigned char *)region;
+	}
+
+	p -> next = (uint32_t *)malloc(sizeof(uint32_t) * (p -> n_buffers + 1));
+
+	for(uint32_t index=0; index<p -> n_buffers; index++)
+		p -> next[index] = index + 1 < p -> n_buffers ? index + 1 : POOL_EMPTY;
+
+	p -> head = p -> n_buffers ? 0 : POOL_EMPTY;
+
+	return p;
+}
+
+void pool_destroy(buffer_pool_t *p)
+{
+	if (p -> region)
+		munmap(p -> region, p -> region_size);
+
+	free(p -> next);
+	free(p);
+}
+
+void * pool_get(buffer_pool_t *p, size_t len)
+{
+	if (p && len <= p -> buffer_size)
+	{
+		uint64_t head = __atomic_load_n(&p -> head, __ATOMIC_ACQUIRE);
+
+		for(;;)
+		{
+			uint32_t index = uint32_t(head);
+			if (index == POOL_EMPTY)
+				break;
+
+			uint64_t new_head = ((head >> 32) + 1) << 32 | p -> next[index];
+
+			if (__atomic_compare_exchange_n(&p -> head, &head, new_head, true, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+			{
+				__atomic_add_fetch(&p -> hits, 1, __ATOMIC_RELAXED);
+
+				return p -> region + index * p -> stride;
+			}
+		}
+	}
+
+	if (p)
+		__atomic_add_fetch(&p -> misses, 1, __ATOMIC_RELAXED);
+
+	void *buffer = NULL;
+	if (posix_memalign(&buffer, POOL_PAGE_SIZE, len ? len : 1))
+		return NULL;
+
+	return buffer;
+}
+
+void pool_put(buffer_pool_t *p, void *buffer)
+{
+	unsigned char *b = (unsigned char *)buffer;
+
+	if (!p || b < p -> region || b >= p -> region + p -> stride * p -> n_buffers)
+	{
+		free(buffer);
+		return;
+	}
+
+	uint32_t index = (b - p -> region) / p -> stride;
+	uint64_t head = __atomic_load_n(&p -> head, __ATOMIC_ACQUIRE);
+
+	for(;;)
+	{
+		p -> next[index] = uint32_t(head);
+
+		uint64_t new_head = ((head >> 32) + 1) << 32 | index;
+
+		if (__atomic_compare_exchange_n(&p -> head, &head, new_head, true, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+			break;
+	}
+}
+
+void pool_print(const char *name, const buffer_pool_t *p)
+{
+	uint64_t total = p -> hits + p -> misses;
+
+	printf("%s buffer pool: %u buffers of %zu bytes (%s), %llu hits, %llu misses (%.2f%% hit)\n", name, p -> n_buffers, p -> buffer_size, p -> backing,
+			(unsigned long long)p -> hits, (unsigned long long)p -> misses, total ? p -> hits * 100.0 / total : 0.0);
+}
@@ -0,0 +1,26 @@
+// preallocated page aligned buffers (on huge pages where possible)
+// for the I/O paths; get and put are lock-free and O(1). When the pool
+// is empty or a buffer larger than buffer_size is asked for, it falls
+// back to an aligned allocation (a miss).
+typedef struct
+{
+	unsigned char *region;
+	size_t region_size, buffer_size, stride;
+	uint32_t n_buffers;
+	const char *backing;
+
+	// free list: index of the first free buffer in the low 32 bits, a
+	// counter against ABA in the upper 32 bits
+	volatile uint64_t head;
+	uint32_t *next;
+
+	volatile uint64_t hits, misses;
+} buffer_pool_t;
+
+buffer_pool_t *pool_create(size_t buffer_size, uint32_t n_buffers);
+void pool_destroy(buffer_pool_t *p);
+
+void * pool_get(buffer_pool_t *p, size_t len);
+void pool_put(buffer_pool_t *p, void *buffer);
+
+void pool_print(const char *name, const buffer_pool_t *p);
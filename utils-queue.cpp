@@ -0,0 +1,93 @@
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "utils-queue.h"
+
+queue_t *queue_create(uint64_t size)
+{
+	queue_t *q = NULL;
+
+	if (posix_memalign((void **)&q, 64, sizeof(queue_t)))
+		return NULL;
+
+	q -> cells = (queue_cell_t *)malloc(sizeof(queue_cell_t) * size);
+	q -> mask = size - 1;
+
+	for(uint64_t index=0; index<size; index++)
+		q -> cells[index].seq = index;
+
+	q -> enqueue_pos = q -> dequeue_pos = 0;
+
+	return q;
+}
+
+void queue_destroy(queue_t *q)
+{
+	free(q -> cells);
+	free(q);
+}
+
+bool queue_push(queue_t *q, void *data)
+{
+	uint64_t pos = __atomic_load_n(&q -> enqueue_pos, __ATOMIC_RELAXED);
+
+	for(;;)
+	{
+		queue_cell_t *cell = &q -> cells[pos & q -> mask];
+		uint64_t seq = __atomic_load_n(&cell -> seq, __ATOMIC_ACQUIRE);
+		int64_t diff = int64_t(seq) - int64_t(pos);
+
+		if (diff == 0)
+		{
+			// the cell is free: claim it
+			if (__atomic_compare_exchange_n(&q -> enqueue_pos, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			{
+				cell -> data = data;
+				__atomic_store_n(&cell -> seq, pos + 1, __ATOMIC_RELEASE);
+
+				return true;
+			}
+		}
+		else if (diff < 0)
+		{
+			// not consumed yet: full
+			return false;
+		}
+		else
+		{
+			pos = __atomic_load_n(&q -> enqueue_pos, __ATOMIC_RELAXED);
+		}
+	}
+}
+
+bool queue_pop(queue_t *q, void **data)
+{
+	uint64_t pos = __atomic_load_n(&q -> dequeue_pos, __ATOMIC_RELAXED);
+
+	for(;;)
+	{
+		queue_cell_t *cell = &q -> cells[pos & q -> mask];
+		uint64_t seq = __atomic_load_n(&cell -> seq, __ATOMIC_ACQUIRE);
+		int64_t diff = int64_t(seq) - int64_t(pos + 1);
+
+		if (diff == 0)
+		{
+			if (__atomic_compare_exchange_n(&q -> dequeue_pos, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			{
+				*data = cell -> data;
+				__atomic_store_n(&cell -> seq, pos + q -> mask + 1, __ATOMIC_RELEASE);
+
+				return true;
+			}
+		}
+		else if (diff < 0)
+		{
+			// nothing produced yet: empty
+			return false;
+		}
+		else
+		{
+			pos = __atomic_load_n(&q -> dequeue_pos, __ATOMIC_RELAXED);
+		}
+	}
+}
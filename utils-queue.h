@@ -0,0 +1,24 @@
+// bounded lock-free queue of pointers for any number of producers and
+// consumers (sequence number per cell); size must be a power of 2
+typedef struct
+{
+	volatile uint64_t seq;
+	void *data;
+} queue_cell_t;
+
+typedef struct
+{
+	queue_cell_t *cells;
+	uint64_t mask;
+
+	// on their own cache lines: producers and consumers do not share one
+	volatile uint64_t enqueue_pos __attribute__((aligned(64)));
+	volatile uint64_t dequeue_pos __attribute__((aligned(64)));
+} queue_t;
+
+queue_t *queue_create(uint64_t size);
+void queue_destroy(queue_t *q);
+
+// false when full/empty
+bool queue_push(queue_t *q, void *data);
+bool queue_pop(queue_t *q, void **data);
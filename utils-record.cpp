@@ -0,0 +1,189 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <iostream>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "utils-net.h"
+#include "utils-record.h"
+#include "utils-time.h"
+
+// per thread, a power of 2; when the writer cannot keep up records are dropped
+#define RECORD_RING_SIZE	65536
+
+bool recording = false;
+
+// one producer (the thread that owns it), one consumer (the writer thread)
+typedef struct record_ring_t
+{
+	trace_record_t records[RECORD_RING_SIZE];
+	volatile uint64_t head, tail;
+	volatile uint64_t dropped;
+	struct record_ring_t *next;
+} record_ring_t;
+
+__thread record_ring_t *my_ring = NULL;
+
+record_ring_t *all_rings = NULL;
+pthread_mutex_t all_rings_lock = PTHREAD_MUTEX_INITIALIZER;
+
+int record_fd = -1;
+uint64_t record_start_ns = 0, n_written = 0;
+volatile int writer_stop = 0;
+pthread_t writer_tid;
+
+// move what is in the rings to the file; returns the number of records
+uint64_t drain_rings(trace_record_t *buffer, size_t buffer_n)
+{
+	uint64_t total = 0;
+
+	pthread_mutex_lock(&all_rings_lock);
+	record_ring_t *rings = all_rings;
+	pthread_mutex_unlock(&all_rings_lock);
+
+	for(record_ring_t *r = rings; r; r = r -> next)
+	{
+		uint64_t head = __atomic_load_n(&r -> head, __ATOMIC_ACQUIRE);
+		uint64_t tail = r -> tail;
+
+		while(tail < head)
+		{
+			size_t n = 0;
+
+			while(tail < head && n < buffer_n)
+				buffer[n++] = r -> records[tail++ & (RECORD_RING_SIZE - 1)];
+
+			__atomic_store_n(&r -> tail, tail, __ATOMIC_RELEASE);
+
+			if (WRITE(record_fd, (const char *)buffer, n * sizeof(trace_record_t)) != ssize_t(n * sizeof(trace_record_t)))
+				std::cerr << "short write to the trace file: " << strerror(errno) << std::endl;
+
+			total += n;
+		}
+	}
+
+	return total;
+}
+
+void * writer_thread(void *arg)
+{
+	size_t buffer_n = 65536 / sizeof(trace_record_t);
+	trace_record_t *buffer = (trace_record_t *)malloc(buffer_n * sizeof(trace_record_t));
+
+	while(!writer_stop)
+	{
+		uint64_t n = drain_rings(buffer, buffer_n);
+
+		n_written += n;
+
+		if (n == 0)
+			USLEEP(1000);
+	}
+
+	// what came in after the last round
+	n_written += drain_rings(buffer, buffer_n);
+
+	free(buffer);
+
+	return NULL;
+}
+
+int recorder_start(const char *file)
+{
+	record_fd = open(file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (record_fd == -1)
+	{
+		std::cerr << "cannot create " << file << ": " << strerror(errno) << std::endl;
+		return -1;
+	}
+
+	trace_header_t header;
+	memset(&header, 0x00, sizeof header);
+	memcpy(header.magic, TRACE_MAGIC, sizeof header.magic);
+	header.byte_order = TRACE_BYTE_ORDER;
+	header.record_size = sizeof(trace_record_t);
+
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	header.start_ns = uint64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+
+	if (WRITE(record_fd, (const char *)&header, sizeof header) != sizeof header)
+	{
+		std::cerr << "cannot write to " << file << ": " << strerror(errno) << std::endl;
+		close(record_fd);
+		return -1;
+	}
+
+	record_start_ns = get_ns();
+	writer_stop = 0;
+
+	if (pthread_create(&writer_tid, NULL, writer_thread, NULL))
+	{
+		std::cerr << "cannot start the trace writer thread" << std::endl;
+		close(record_fd);
+		return -1;
+	}
+
+	recording = true;
+
+	return 0;
+}
+
+void recorder_stop()
+{
+	if (!recording)
+		return;
+
+	recording = false;
+
+	writer_stop = 1;
+	pthread_join(writer_tid, NULL);
+
+	close(record_fd);
+	record_fd = -1;
+
+	uint64_t dropped = 0;
+
+	for(record_ring_t *r = all_rings; r; r = r -> next)
+		dropped += r -> dropped;
+
+	std::cout << n_written << " requests recorded, " << dropped << " dropped (writer could not keep up)" << std::endl;
+}
+
+void record_request(uint16_t conn, uint16_t op, uint64_t offset, uint32_t len, uint64_t submit_ns, uint64_t complete_ns, uint32_t error)
+{
+	if (!my_ring)
+	{
+		my_ring = (record_ring_t *)calloc(1, sizeof(record_ring_t));
+
+		pthread_mutex_lock(&all_rings_lock);
+		my_ring -> next = all_rings;
+		all_rings = my_ring;
+		pthread_mutex_unlock(&all_rings_lock);
+	}
+
+	uint64_t head = my_ring -> head;
+
+	if (head - __atomic_load_n(&my_ring -> tail, __ATOMIC_ACQUIRE) >= RECORD_RING_SIZE)
+	{
+		my_ring -> dropped++;
+		return;
+	}
+
+	trace_record_t *r = &my_ring -> records[head & (RECORD_RING_SIZE - 1)];
+
+	r -> submit_ns = submit_ns - record_start_ns;
+	r -> complete_ns = complete_ns - record_start_ns;
+	r -> offset = offset;
+	r -> len = len;
+	r -> op = op;
+	r -> conn = conn;
+	r -> error = error;
+	r -> reserved = 0;
+
+	__atomic_store_n(&my_ring -> head, head + 1, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,36 @@
+// compact binary trace of every request: a header and then fixed size
+// records in the byte order of the recording host, so that a reader can
+// mmap() the file and index it directly
+#define TRACE_MAGIC		"NBDVTRC1"
+#define TRACE_BYTE_ORDER	0x01020304
+
+typedef struct
+{
+	char magic[8];
+	uint32_t byte_order, record_size;
+	// wall clock (ns since the epoch) at the start of the recording
+	uint64_t start_ns;
+	uint64_t reserved[5];
+} trace_header_t;
+
+typedef struct
+{
+	// ns since the start of the recording
+	uint64_t submit_ns, complete_ns;
+	uint64_t offset;
+	uint32_t len;
+	// NBD command type
+	uint16_t op;
+	uint16_t conn;
+	uint32_t error;
+	uint32_t reserved;
+} trace_record_t;
+
+extern bool recording;
+
+// starts a thread that writes what the threads recorded to 'file'
+int recorder_start(const char *file);
+void recorder_stop();
+
+// submit/complete_ns from get_ns()
+void record_request(uint16_t conn, uint16_t op, uint64_t offset, uint32_t len, uint64_t submit_ns, uint64_t complete_ns, uint32_t error);
@@ -0,0 +1,121 @@
+#include <algorithm>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <time.h>
+#include <vector>
+
+#include "nbd.h"
+#include "utils-slowest.h"
+#include "utils-time.h"
+
+int slowest_n = 0;
+
+typedef struct slowest_t
+{
+	// min-heap on latency_ns: the fastest of the slowest is at the top
+	slow_request_t *heap;
+	int n;
+	struct slowest_t *next;
+} slowest_t;
+
+__thread slowest_t *my_slowest = NULL;
+
+slowest_t *all_slowest = NULL;
+pthread_mutex_t all_slowest_lock = PTHREAD_MUTEX_INITIALIZER;
+
+bool faster(const slow_request_t & a, const slow_request_t & b)
+{
+	return a.latency_ns > b.latency_ns;
+}
+
+void slowest_add(int conn, int op, uint64_t offset, uint32_t len, uint64_t submit_ns, uint64_t complete_ns, int in_flight, uint32_t error)
+{
+	uint64_t latency_ns = complete_ns - submit_ns;
+
+	slowest_t *s = my_slowest;
+
+	if (s && s -> n == slowest_n && latency_ns <= s -> heap[0].latency_ns)
+		return;
+
+	if (!s)
+	{
+		s = my_slowest = (slowest_t *)malloc(sizeof(slowest_t));
+
+		s -> heap = (slow_request_t *)malloc(sizeof(slow_request_t) * slowest_n);
+		s -> n = 0;
+
+		// only once per thread
+		pthread_mutex_lock(&all_slowest_lock);
+		s -> next = all_slowest;
+		all_slowest = s;
+		pthread_mutex_unlock(&all_slowest_lock);
+	}
+
+	if (s -> n == slowest_n)
+	{
+		std::pop_heap(s -> heap, s -> heap + s -> n, faster);
+		s -> n--;
+	}
+
+	slow_request_t *r = &s -> heap[s -> n++];
+
+	r -> submit_ns = submit_ns;
+	r -> latency_ns = latency_ns;
+	r -> offset = offset;
+	r -> len = len;
+	r -> op = op;
+	r -> conn = conn;
+	r -> in_flight = in_flight;
+	r -> error = error;
+
+	std::push_heap(s -> heap, s -> heap + s -> n, faster);
+}
+
+// call when the threads that added are done
+void slowest_print()
+{
+	std::vector<slow_request_t> all;
+
+	pthread_mutex_lock(&all_slowest_lock);
+
+	for(slowest_t *s = all_slowest; s; s = s -> next)
+		all.insert(all.end(), s -> heap, s -> heap + s -> n);
+
+	pthread_mutex_unlock(&all_slowest_lock);
+
+	if (all.empty())
+		return;
+
+	// slowest first
+	std::sort(all.begin(), all.end(), faster);
+
+	if (all.size() > size_t(slowest_n))
+		all.resize(slowest_n);
+
+	// submit times on the wall clock so that they can be lined up with server logs
+	struct timespec rt;
+	clock_gettime(CLOCK_REALTIME, &rt);
+	int64_t to_wall_ns = int64_t(uint64_t(rt.tv_sec) * 1000000000ll + rt.tv_nsec) - int64_t(get_ns());
+
+	printf("\n%d slowest requests:\n", int(all.size()));
+	printf("%-26s %12s %-6s %16s %10s %8s %9s %6s\n", "submitted", "latency us", "type", "offset", "length", "session", "in flight", "error");
+
+	for(size_t index=0; index<all.size(); index++)
+	{
+		const slow_request_t *r = &all.at(index);
+
+		uint64_t wall_ns = r -> submit_ns + to_wall_ns;
+		time_t t = wall_ns / 1000000000ll;
+		struct tm tm;
+		localtime_r(&t, &tm);
+
+		char when[32];
+		strftime(when, sizeof when, "%Y-%m-%d %H:%M:%S", &tm);
+
+		printf("%s.%06d %12.2f %-6s %16llu %10u %8d %9d %6u\n", when, int((wall_ns % 1000000000ll) / 1000),
+				r -> latency_ns / 1000.0, nbd_cmd_name(r -> op), (unsigned long long)r -> offset, r -> len, r -> conn, r -> in_flight, r -> error);
+	}
+}
@@ -0,0 +1,20 @@
+// the slowest_n slowest requests of each thread with their context; each
+// thread keeps its own min-heap (no locks, one compare for the common
+// case of a request that is not among them), merged when printing
+typedef struct
+{
+	uint64_t submit_ns, latency_ns;
+	uint64_t offset;
+	uint32_t len;
+	int op, conn;
+	// requests of the session in flight when it was sent (itself included)
+	int in_flight;
+	uint32_t error;
+} slow_request_t;
+
+// 0: off
+extern int slowest_n;
+
+// submit/complete_ns from get_ns()
+void slowest_add(int conn, int op, uint64_t offset, uint32_t len, uint64_t submit_ns, uint64_t complete_ns, int in_flight, uint32_t error);
+void slowest_print();
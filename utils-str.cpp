@@ -1,5 +1,6 @@
 #include <stdarg.h>
 #include <stdio.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string>
 
@@ -18,3 +19,28 @@ std::string format(const char *fmt, ...)
 
 	return result;
 }
+
+// "4096", "512k", "64M", "5G" and so on (powers of 1024)
+uint64_t parse_size(const char *in)
+{
+	char *end = NULL;
+	uint64_t value = strtoull(in, &end, 10);
+
+	switch(*end)
+	{
+		case 't': case 'T':
+			value *= 1024;
+			// fall through
+		case 'g': case 'G':
+			value *= 1024;
+			// fall through
+		case 'm': case 'M':
+			value *= 1024;
+			// fall through
+		case 'k': case 'K':
+			value *= 1024;
+			break;
+	}
+
+	return value;
+}
@@ -1 +1,2 @@
 std::string format(const char *fmt, ...);
+uint64_t parse_size(const char *in);
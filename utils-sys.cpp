@@ -0,0 +1,50 @@
+#include <errno.h>
+#include <iostream>
+#include <pthread.h>
+#include <sched.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+// pin the calling thread to 'cpu'
+int pin_to_cpu(int cpu)
+{
+	cpu_set_t set;
+
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+
+	int rc = pthread_setaffinity_np(pthread_self(), sizeof set, &set);
+	if (rc)
+	{
+		std::cerr << "cannot pin thread to cpu " << cpu << ": " << strerror(rc) << std::endl;
+		return -1;
+	}
+
+	return 0;
+}
+
+// keep everything (also what is allocated later) in RAM: no page faults while measuring
+int lock_memory()
+{
+	if (mlockall(MCL_CURRENT | MCL_FUTURE) == -1)
+	{
+		std::cerr << "mlockall failed (" << strerror(errno) << "), continuing without" << std::endl;
+		return -1;
+	}
+
+	return 0;
+}
+
+// touch every page so that the first real access does not fault
+void prefault(void *p, size_t len)
+{
+	volatile unsigned char *v = (volatile unsigned char *)p;
+	size_t page = sysconf(_SC_PAGESIZE);
+
+	for(size_t index=0; index<len; index += page)
+		v[index] = v[index];
+
+	if (len)
+		v[len - 1] = v[len - 1];
+}
@@ -0,0 +1,3 @@
+int pin_to_cpu(int cpu);
+int lock_memory();
+void prefault(void *p, size_t len);
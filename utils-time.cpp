@@ -1,6 +1,8 @@
 #include <errno.h>
 #include <iostream>
+#include <stdint.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include <sys/time.h>
 
@@ -34,3 +36,13 @@ void USLEEP(useconds_t how_long)
 		break;
 	}
 }
+
+// monotonic, for measuring durations
+uint64_t get_ns()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return uint64_t(ts.tv_sec) * 1000000000ll + ts.tv_nsec;
+}
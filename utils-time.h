@@ -1,2 +1,3 @@
 double get_ts();
 void USLEEP(useconds_t how_long);
+uint64_t get_ns();
@@ -0,0 +1,229 @@
+#include <iostream>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string>
+#include <string.h>
+
+#include "nbd.h"
+#include "utils-net.h"
+#include "utils-phase.h"
+#include "utils-pool.h"
+#include "utils-queue.h"
+#include "utils-str.h"
+#include "verify.h"
+
+typedef struct
+{
+	uint64_t nr;
+	const unsigned char *expected;
+	unsigned char *data;
+} verify_job_t;
+
+typedef struct
+{
+	queue_t *q;
+	buffer_pool_t *pool;
+	size_t len;
+
+	// set when nothing more will be queued
+	volatile int producer_done;
+
+	volatile uint64_t n_mismatches;
+
+	// only for reporting mismatches
+	pthread_mutex_t report_lock;
+} verify_pipeline_t;
+
+uint64_t verify_queue_size(int depth)
+{
+	uint64_t size = 16;
+
+	while(size < uint64_t(depth) * 2)
+		size <<= 1;
+
+	return size;
+}
+
+void * verifier_thread(void *arg)
+{
+	verify_pipeline_t *vp = (verify_pipeline_t *)arg;
+
+	for(;;)
+	{
+		void *p = NULL;
+
+		if (!queue_pop(vp -> q, &p))
+		{
+			if (!__atomic_load_n(&vp -> producer_done, __ATOMIC_ACQUIRE))
+			{
+				sched_yield();
+				continue;
+			}
+
+			// the last ones may have been queued just before
+			if (!queue_pop(vp -> q, &p))
+				break;
+		}
+
+		verify_job_t *job = (verify_job_t *)p;
+
+		uint64_t phase_ns = phase_start();
+
+		if (memcmp(job -> data, job -> expected, vp -> len))
+		{
+			size_t index = 0;
+			while(job -> data[index] == job -> expected[index])
+				index++;
+
+			pthread_mutex_lock(&vp -> report_lock);
+			std::cerr << "Data mismatch while verifying block " << job -> nr << " at offset " << job -> nr * vp -> len + index << format(" (expected %02x, got %02x)", job -> expected[index], job -> data[index]) << std::endl;
+			pthread_mutex_unlock(&vp -> report_lock);
+
+			__atomic_add_fetch(&vp -> n_mismatches, 1, __ATOMIC_RELAXED);
+		}
+		else
+		{
+			phase_end(PH_COMPARE, phase_ns);
+		}
+
+		pool_put(vp -> pool, job -> data);
+		job -> data = NULL;
+	}
+
+	return NULL;
+}
+
+int verify_blocks(int fd, buffer_pool_t *pool, uint64_t n, const uint64_t *nrs, unsigned char **expected, size_t len, int depth, int n_verifiers)
+{
+	verify_pipeline_t vp;
+
+	vp.q = queue_create(verify_queue_size(depth));
+	vp.pool = pool;
+	vp.len = len;
+	vp.producer_done = 0;
+	vp.n_mismatches = 0;
+	pthread_mutex_init(&vp.report_lock, NULL);
+
+	verify_job_t *jobs = (verify_job_t *)malloc(sizeof(verify_job_t) * n);
+	for(uint64_t index=0; index<n; index++)
+	{
+		jobs[index].nr = nrs[index];
+		jobs[index].expected = expected[index];
+		jobs[index].data = NULL;
+	}
+
+	pthread_t *threads = (pthread_t *)malloc(sizeof(pthread_t) * n_verifiers);
+	int n_started = 0;
+
+	for(; n_started<n_verifiers; n_started++)
+	{
+		if (pthread_create(&threads[n_started], NULL, verifier_thread, &vp))
+		{
+			std::cerr << "cannot start verifier thread" << std::endl;
+			break;
+		}
+	}
+
+	int rc = n_started ? 0 : -1;
+
+	// the handle of a read is its slot; slot_job tells which block it is for
+	uint64_t *slot_job = (uint64_t *)malloc(sizeof(uint64_t) * depth);
+	int *free_slots = (int *)malloc(sizeof(int) * depth);
+	int n_free = depth;
+
+	for(int index=0; index<depth; index++)
+		free_slots[index] = index;
+
+	uint64_t next = 0;
+	int in_flight = 0;
+
+	while(rc == 0)
+	{
+		// stop reading ahead after a mismatch
+		while(n_free > 0 && next < n && __atomic_load_n(&vp.n_mismatches, __ATOMIC_RELAXED) == 0)
+		{
+			int slot = free_slots[--n_free];
+
+			slot_job[slot] = next;
+
+			if (send_request_nbd(fd, 0, slot, nrs[next] * len, NULL, len))
+			{
+				std::cerr << "Failed to send read request for block " << nrs[next] << std::endl;
+				rc = -1;
+				break;
+			}
+
+			next++;
+			in_flight++;
+		}
+
+		if (rc || in_flight == 0)
+			break;
+
+		uint64_t handle = -1;
+		uint32_t err = 0;
+
+		if (receive_reply_nbd(fd, &handle, &err))
+		{
+			rc = -1;
+			break;
+		}
+
+		if (handle >= uint64_t(depth))
+		{
+			std::cerr << "reply for unknown handle " << handle << std::endl;
+			rc = -1;
+			break;
+		}
+
+		verify_job_t *job = &jobs[slot_job[handle]];
+
+		if (err)
+		{
+			std::cerr << "Failed reading from offset " << job -> nr * len << " length " << len << ": " << err << std::endl;
+			rc = err;
+			break;
+		}
+
+		job -> data = (unsigned char *)pool_get(pool, len);
+
+		uint64_t phase_ns = phase_start();
+
+		if (READ_BUFFERED(fd, job -> data, len) != ssize_t(len))
+		{
+			std::cerr << "short read retrieving data for read-command" << std::endl;
+			pool_put(pool, job -> data);
+			rc = -1;
+			break;
+		}
+
+		phase_end(PH_PAYLOAD, phase_ns);
+
+		while(!queue_push(vp.q, job))
+			sched_yield();
+
+		in_flight--;
+		free_slots[n_free++] = handle;
+	}
+
+	__atomic_store_n(&vp.producer_done, 1, __ATOMIC_RELEASE);
+
+	for(int index=0; index<n_started; index++)
+		pthread_join(threads[index], NULL);
+
+	if (rc == 0 && vp.n_mismatches)
+		rc = -1;
+
+	free(free_slots);
+	free(slot_job);
+	free(threads);
+	free(jobs);
+
+	pthread_mutex_destroy(&vp.report_lock);
+	queue_destroy(vp.q);
+
+	return rc;
+}
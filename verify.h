@@ -0,0 +1,7 @@
+// how many received blocks can wait for a verifier thread
+uint64_t verify_queue_size(int depth);
+
+// read blocks nrs[0...n) (block nr at offset nr * len) with up to 'depth'
+// reads in flight and compare them with expected[0...n) on n_verifiers
+// threads while the next ones are being read
+int verify_blocks(int fd, buffer_pool_t *pool, uint64_t n, const uint64_t *nrs, unsigned char **expected, size_t len, int depth, int n_verifiers);
@@ -0,0 +1,264 @@
+#include <algorithm>
+#include <iostream>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <string.h>
+#include <vector>
+
+#include "nbd.h"
+#include "utils-data.h"
+#include "utils-hist.h"
+#include "utils-net.h"
+#include "utils-time.h"
+#include "visibility.h"
+
+// the writer writes a new version of the block this often
+#define VISIBILITY_INTERVAL	0.002
+
+// the block holds the sequence number at the start and at the end, so
+// that a read that overlapped a write and returned a mix is seen
+#define VISIBILITY_OFFSET	0
+
+typedef struct
+{
+	std::string host;
+	int port;
+	uint32_t len;
+
+	// sequence number of the last acknowledged write
+	volatile uint64_t *acked;
+	volatile int *stop;
+
+	int fd;
+	bool failed;
+
+	// when each version was first read (ns), 0: never seen
+	std::vector<uint64_t> first_seen;
+	uint64_t n_reads, n_stale, n_torn;
+} visibility_reader_t;
+
+void * visibility_reader_thread(void *arg)
+{
+	visibility_reader_t *vr = (visibility_reader_t *)arg;
+
+	unsigned char *data = (unsigned char *)malloc(vr -> len);
+	uint64_t highest = 0;
+
+	while(!*vr -> stop)
+	{
+		// what was acknowledged before this read went out must be there
+		uint64_t acked = __atomic_load_n(vr -> acked, __ATOMIC_ACQUIRE);
+
+		if (read_nbd(vr -> fd, VISIBILITY_OFFSET, (char *)data, vr -> len))
+		{
+			vr -> failed = true;
+			break;
+		}
+
+		uint64_t now_ns = get_ns();
+
+		vr -> n_reads++;
+
+		uint64_t seq = bytes_to_u64(data);
+
+		if (seq != bytes_to_u64(&data[vr -> len - 8]))
+		{
+			vr -> n_torn++;
+			continue;
+		}
+
+		if (seq < acked)
+			vr -> n_stale++;
+
+		if (seq > highest && seq < vr -> first_seen.size())
+		{
+			// versions that were skipped became visible no later than this one
+			for(uint64_t s=highest + 1; s<=seq; s++)
+				vr -> first_seen.at(s) = now_ns;
+
+			highest = seq;
+		}
+	}
+
+	free(data);
+
+	return NULL;
+}
+
+int nbd_visibility(std::string host, int port, int n_readers, double duration)
+{
+	uint64_t size = -1;
+	uint32_t flags = -1;
+
+	int fd = connect_nbd(host, port, &size, &flags, false);
+	if (fd == -1)
+	{
+		std::cerr << "failed setting up NBD session for the writer" << std::endl;
+		return 1;
+	}
+
+	uint32_t len = std::max(uint32_t(16), block_size_preferred);
+
+	// versions 1...n_writes; sequence number 0 is the initial content
+	uint64_t n_writes = uint64_t(duration / VISIBILITY_INTERVAL) + 1;
+
+	unsigned char *data = (unsigned char *)malloc(len);
+	memset(data, 0x00, len);
+
+	if (write_nbd(fd, VISIBILITY_OFFSET, (const char *)data, len))
+	{
+		std::cerr << "initial write failed" << std::endl;
+		close_nbd(fd);
+		return 1;
+	}
+
+	volatile uint64_t acked = 0;
+	volatile int stop = 0;
+
+	std::vector<visibility_reader_t *> readers;
+
+	for(int index=0; index<n_readers; index++)
+	{
+		visibility_reader_t *vr = new visibility_reader_t;
+
+		vr -> host = host;
+		vr -> port = port;
+		vr -> len = len;
+		vr -> acked = &acked;
+		vr -> stop = &stop;
+		vr -> failed = false;
+		vr -> first_seen.resize(n_writes + 1, 0);
+		vr -> n_reads = vr -> n_stale = vr -> n_torn = 0;
+
+		uint64_t reader_size = -1;
+		vr -> fd = connect_nbd(host, port, &reader_size, &flags, false);
+
+		readers.push_back(vr);
+
+		if (vr -> fd == -1)
+		{
+			std::cerr << "failed setting up NBD session for reader " << index << std::endl;
+			n_readers = index;
+			break;
+		}
+	}
+
+	std::vector<pthread_t> threads(n_readers);
+	int n_started = 0;
+
+	for(int index=0; index<n_readers; index++)
+	{
+		if (pthread_create(&threads.at(index), NULL, visibility_reader_thread, readers.at(index)))
+		{
+			std::cerr << "cannot start thread for reader " << index << std::endl;
+			break;
+		}
+
+		n_started++;
+	}
+
+	std::cout << "1 writer, " << n_started << " reader(s) over " << transport_name(host) << ", a new version every " << VISIBILITY_INTERVAL * 1000.0 << " ms for " << duration << " seconds" << std::endl;
+
+	if (!(flags & 256))
+		std::cout << "note: the server does not advertise multi-conn, so it does not promise that sessions see each other's writes" << std::endl;
+
+	// when each version was acknowledged to the writer
+	std::vector<uint64_t> ack_ns(n_writes + 1, 0);
+	uint64_t n_written = 0;
+	bool failed = n_started != int(readers.size()) || readers.back() -> fd == -1;
+
+	double start_ts = get_ts();
+
+	for(uint64_t seq=1; seq<=n_writes && !failed; seq++)
+	{
+		double next_ts = start_ts + seq * VISIBILITY_INTERVAL;
+		double now_ts = get_ts();
+
+		if (next_ts > now_ts)
+			USLEEP(useconds_t((next_ts - now_ts) * 1000000.0));
+
+		u64_to_bytes(data, seq);
+		u64_to_bytes(&data[8], get_ns());
+		u64_to_bytes(&data[len - 8], seq);
+
+		if (write_nbd(fd, VISIBILITY_OFFSET, (const char *)data, len))
+		{
+			std::cerr << "write of version " << seq << " failed" << std::endl;
+			failed = true;
+			break;
+		}
+
+		ack_ns.at(seq) = get_ns();
+		__atomic_store_n(&acked, seq, __ATOMIC_RELEASE);
+
+		n_written = seq;
+	}
+
+	stop = 1;
+
+	for(int index=0; index<n_started; index++)
+		pthread_join(threads.at(index), NULL);
+
+	close_nbd(fd);
+	free(data);
+
+	// visible after the ack: time until the first read that saw it;
+	// visible earlier is fine (the server applied it before replying)
+	histogram_t *h = (histogram_t *)malloc(sizeof(histogram_t));
+	hist_init(h);
+
+	uint64_t n_before_ack = 0, n_never = 0, n_reads = 0, n_stale = 0, n_torn = 0;
+
+	for(size_t r=0; r<readers.size(); r++)
+	{
+		visibility_reader_t *vr = readers.at(r);
+
+		if (vr -> failed)
+			failed = true;
+
+		n_reads += vr -> n_reads;
+		n_stale += vr -> n_stale;
+		n_torn += vr -> n_torn;
+
+		for(uint64_t seq=1; seq<=n_written && r < size_t(n_started); seq++)
+		{
+			uint64_t seen = vr -> first_seen.at(seq);
+
+			if (seen == 0)
+				n_never++;
+			else if (seen < ack_ns.at(seq))
+				n_before_ack++;
+			else
+				hist_add(h, seen - ack_ns.at(seq));
+		}
+
+		if (vr -> fd != -1)
+			close_nbd(vr -> fd);
+
+		delete vr;
+	}
+
+	std::cout << std::endl << n_written << " version(s) written, " << n_reads << " read(s)" << std::endl;
+	std::cout << "seen by a reader before the writer got the ack: " << n_before_ack << ", only after: " << h -> n << ", never (overwritten first): " << n_never << std::endl;
+	std::cout << std::endl;
+
+	hist_print_header("ack to visible (us)");
+	hist_print("all readers", h);
+
+	std::cout << std::endl << "stale reads (older than what was acknowledged before the read was sent): " << n_stale << std::endl;
+	std::cout << "torn reads (half old, half new version): " << n_torn << std::endl;
+
+	free(h);
+
+	if (failed)
+	{
+		std::cerr << "one or more sessions failed" << std::endl;
+		return 1;
+	}
+
+	return n_stale || n_torn ? 1 : 0;
+}
@@ -0,0 +1,4 @@
+// one session writes sequence numbers to a block, n_readers other
+// sessions poll it: how long after the write was acknowledged does it
+// show up elsewhere, and are older versions read after that
+int nbd_visibility(std::string host, int port, int n_readers, double duration);